@@ -45,6 +45,12 @@ build() {
         -I ./src/user/
       $CC $CFLAGS $USR/main2.c -o $OUT/user_main2.elf -DARCH_X64 \
         -I ./src/user/
+      $CC $CFLAGS $USR/main3.c -o $OUT/user_main3.elf -DARCH_X64 \
+        -I ./src/user/
+      $CC $CFLAGS $USR/main4.c -o $OUT/user_main4.elf -DARCH_X64 \
+        -I ./src/user/
+      tar --format=ustar -cf $OUT/initrd.tar -C $OUT user_main1.elf user_main2.elf \
+        user_main3.elf user_main4.elf
 
       $CC $CFLAGS $DIR/kernel.c -o $OUT/kernel.elf -DARCH_X64 \
         -I ./src/kernel -I ./src/kernel/headers/ -I $DIR \
@@ -58,6 +64,7 @@ build() {
 
       mcopy -i fat.img $OUT/BOOTX64.EFI ::/EFI/BOOT -D o
       mcopy -i fat.img $OUT/kernel.elf ::/ -D o
+      mcopy -i fat.img $OUT/initrd.tar ::/ -D o
       ;;
     *)
       echo "Unknown taret '$TARGET'"
@@ -117,6 +124,11 @@ run() {
         -debugcon mon:stdio \
         -d int \
         -device virtio-keyboard-pci \
+        -drive id=drive0,file=file.txt,format=raw,if=none \
+        -device virtio-blk-pci,drive=drive0,disable-legacy=on \
+        -netdev user,id=net0 \
+        -device virtio-net-pci,netdev=net0,disable-legacy=on \
+        -device virtio-gpu-pci,disable-legacy=on \
       ;;
     *)
       echo "Unknown taret '$TARGET'"
@@ -68,6 +68,8 @@ typedef struct {
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define UPPER_BOUND(a, b) MIN(a, b)
+// align has to be a power of 2
+#define ALIGN_UP(n, align) (((n) + (align) - 1) & ~((size_t)(align) - 1))
 #define LOWER_BOUND(a, b) MAX(a, b)
 
 void *memcpy(void *restrict dest, const void *restrict src, size_t n);
@@ -94,14 +96,37 @@ typedef enum {
   SYS_LOG = 1,
   SYS_EXIT = 2,
   SYS_YIELD = 3,
+  SYS_FUTEX_WAIT = 4,
+  SYS_FUTEX_WAKE = 5,
+  SYS_ALLOC_PAGES = 6,
+  SYS_IPC_SEND = 7,
+  SYS_IPC_RECEIVE = 8,
+  SYS_IPC_REPLY = 9,
+  SYS_SHM_CREATE = 10,
+  SYS_SHM_MAP = 11,
+  SYS_SHM_UNMAP = 12,
+  SYS_SHM_RELEASE = 13,
 } SyscallType;
 
 typedef enum {
   SYS_OK = 0,
   SYS_ERR_UNKNOWN_SYSCALL = 1,
   SYS_ERR_BAD_ARG = 2,
+  SYS_ERR_WOULD_BLOCK = 3,
+  SYS_ERR_BUSY = 4,
+  SYS_ERR_OUT_OF_MEMORY = 5,
 } SyscallError;
 
+#define IPC_MESSAGE_WORDS 3
+
+// NOTE: Passed in registers, see handle_syscall
+typedef struct {
+  size_t words[IPC_MESSAGE_WORDS];
+  // Page aligned, the pages are moved from the sender to the receiver
+  size_t pages;
+  size_t page_count;
+} IpcMessage;
+
 SyscallError sys_log(const char *str, size_t limit);
 NORETURN void sys_exit(size_t error_code);
 
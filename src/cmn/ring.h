@@ -0,0 +1,163 @@
+#ifndef INCLUDE_CMN_RING
+#define INCLUDE_CMN_RING
+
+#include "cmn/lib.h"
+
+// Lock-free ring buffers of fixed size elements, the capacity has to be a power of 2.
+// Positions are free running counters masked on access, the ring is full
+// when head - tail == capacity. Pushes that don't fit are cut short, the
+// caller decides what to do with the rest.
+// NOTE: The multi-producer ring needs atomic compare-and-swap, so the A extension on rv32
+
+#define IS_POWER_OF_2(n) ((n) && !((n) & ((n) - 1)))
+#define ARRAY_LEN(array) (sizeof(array) / sizeof((array)[0]))
+
+static inline void ring_copy_in(uint8_t *buffer, uint32_t mask, uint32_t elem_size, uint32_t pos, const void *src, uint32_t count) {
+  uint32_t start = pos & mask;
+  uint32_t first = MIN(count, mask + 1 - start);
+  memcpy(buffer + start * elem_size, src, first * elem_size);
+  memcpy(buffer, (const uint8_t *)src + first * elem_size, (count - first) * elem_size);
+}
+
+static inline void ring_copy_out(const uint8_t *buffer, uint32_t mask, uint32_t elem_size, uint32_t pos, void *dest, uint32_t count) {
+  uint32_t start = pos & mask;
+  uint32_t first = MIN(count, mask + 1 - start);
+  memcpy(dest, buffer + start * elem_size, first * elem_size);
+  memcpy((uint8_t *)dest + first * elem_size, buffer, (count - first) * elem_size);
+}
+
+// Single producer, single consumer, for example an interrupt handler and a task
+typedef struct {
+  uint8_t *buffer;
+  uint32_t elem_size;
+  uint32_t mask; // capacity - 1
+  uint32_t head; // only written by the producer
+  uint32_t tail; // only written by the consumer
+} SpscRing;
+
+// Static initializer, the array length has to be a power of 2
+#define SPSC_RING_INIT(array) { \
+  .buffer = (uint8_t *)(array), \
+  .elem_size = sizeof((array)[0]), \
+  .mask = ARRAY_LEN(array) - 1, \
+}
+
+static inline void spsc_ring_init(SpscRing *ring, void *buffer, uint32_t elem_size, uint32_t capacity) {
+  ASSERT(IS_POWER_OF_2(capacity));
+  *ring = (SpscRing){
+    .buffer = buffer,
+    .elem_size = elem_size,
+    .mask = capacity - 1,
+  };
+}
+
+static inline uint32_t spsc_ring_len(SpscRing *ring) {
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline bool spsc_ring_is_empty(SpscRing *ring) {
+  return spsc_ring_len(ring) == 0;
+}
+
+// Returns how many elements fit
+static inline uint32_t spsc_ring_push_batch(SpscRing *ring, const void *elems, uint32_t count) {
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  count = MIN(count, ring->mask + 1 - (head - tail));
+  ring_copy_in(ring->buffer, ring->mask, ring->elem_size, head, elems, count);
+  // The consumer sees the elements before the new head
+  __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+  return count;
+}
+
+static inline uint32_t spsc_ring_pop_batch(SpscRing *ring, void *out_elems, uint32_t limit) {
+  uint32_t tail = ring->tail;
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint32_t count = MIN(limit, head - tail);
+  ring_copy_out(ring->buffer, ring->mask, ring->elem_size, tail, out_elems, count);
+  // The producer can't reuse the slots before they are copied out
+  __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+  return count;
+}
+
+static inline bool spsc_ring_push(SpscRing *ring, const void *elem) {
+  return spsc_ring_push_batch(ring, elem, 1) == 1;
+}
+
+static inline bool spsc_ring_pop(SpscRing *ring, void *out_elem) {
+  return spsc_ring_pop_batch(ring, out_elem, 1) == 1;
+}
+
+// Multiple producers, single consumer. Producers claim slots by moving the
+// head with compare-and-swap and publish every slot through its sequence
+// number, so a producer interrupted between the two doesn't block the others.
+// The consumer stops at the first slot that isn't published yet.
+// SOURCE: https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+typedef struct {
+  uint8_t *buffer;
+  uint32_t *sequences; // position + 1 once the slot at position is published
+  uint32_t elem_size;
+  uint32_t mask;
+  uint32_t head;
+  uint32_t tail; // only written by the consumer
+} MpscRing;
+
+static inline void mpsc_ring_init(MpscRing *ring, void *buffer, uint32_t *sequences, uint32_t elem_size, uint32_t capacity) {
+  ASSERT(IS_POWER_OF_2(capacity));
+  *ring = (MpscRing){
+    .buffer = buffer,
+    .sequences = sequences,
+    .elem_size = elem_size,
+    .mask = capacity - 1,
+  };
+  for (uint32_t i = 0; i < capacity; ++i) sequences[i] = i;
+}
+
+// Batches get consecutive slots, they aren't interleaved with other producers
+static inline uint32_t mpsc_ring_push_batch(MpscRing *ring, const void *elems, uint32_t count) {
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  uint32_t claimed;
+  do {
+    // NOTE: The tail moves after the consumer is done with the slots
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    claimed = MIN(count, ring->mask + 1 - (head - tail));
+    if (!claimed) return 0;
+  } while (!__atomic_compare_exchange_n(&ring->head, &head, head + claimed, true,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  const uint8_t *src = elems;
+  for (uint32_t i = 0; i < claimed; ++i) {
+    uint32_t pos = head + i;
+    memcpy(ring->buffer + (pos & ring->mask) * ring->elem_size, src + i * ring->elem_size, ring->elem_size);
+    __atomic_store_n(&ring->sequences[pos & ring->mask], pos + 1, __ATOMIC_RELEASE);
+  }
+  return claimed;
+}
+
+static inline bool mpsc_ring_can_pop(MpscRing *ring) {
+  uint32_t tail = ring->tail;
+  return __atomic_load_n(&ring->sequences[tail & ring->mask], __ATOMIC_ACQUIRE) == tail + 1;
+}
+
+static inline uint32_t mpsc_ring_pop_batch(MpscRing *ring, void *out_elems, uint32_t limit) {
+  uint32_t tail = ring->tail;
+  uint8_t *dest = out_elems;
+  uint32_t count = 0;
+  for (; count < limit; ++count) {
+    uint32_t pos = tail + count;
+    if (__atomic_load_n(&ring->sequences[pos & ring->mask], __ATOMIC_ACQUIRE) != pos + 1) break;
+    memcpy(dest + count * ring->elem_size, ring->buffer + (pos & ring->mask) * ring->elem_size, ring->elem_size);
+  }
+  __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+  return count;
+}
+
+static inline bool mpsc_ring_push(MpscRing *ring, const void *elem) {
+  return mpsc_ring_push_batch(ring, elem, 1) == 1;
+}
+
+static inline bool mpsc_ring_pop(MpscRing *ring, void *out_elem) {
+  return mpsc_ring_pop_batch(ring, out_elem, 1) == 1;
+}
+
+#endif
@@ -42,25 +42,123 @@ void load_elf_file(PageAllocator2 *alloc, PageTable *pml4, void *file, vaddr_t *
   *out_entry = elf->program_entry_addr;
 }
 
-void load_elf_file2(MemoryManager *mm, const char *file, vaddr_t *out_entry) {
-  ElfHeader64 *elf = (void *)file;
+// Streams the loadable segments from the file into the frames they'll be mapped from,
+// only the headers go through a temporary page
+void load_elf_image(ElfImage *image, MemoryManager *kernel_mm, Vfs *vfs, Fid fid) {
+  paddr_t headers_physical = alloc_pages2(kernel_mm->page_alloc, 1);
+  uint8_t *headers = (void *)(headers_physical + kernel_mm->virtual_offset);
+  vfs_file_rw_sectors(vfs, fid, 0, 1, headers, false);
+
+  ElfHeader64 *elf = (void *)headers;
   validate_elf_header(elf);
 
-  ElfProgramHeader64 *progs = (void *)(file + elf->program_table_offset);
+  size_t headers_end = elf->program_table_offset +
+    elf->program_table_entry_count * sizeof(ElfProgramHeader64);
+  // TODO: Support program tables past the first page
+  ASSERT(headers_end <= PAGE_SIZE);
+  uint32_t header_sectors = (headers_end + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  if (header_sectors > 1) {
+    vfs_file_rw_sectors(vfs, fid, 1, header_sectors - 1, headers + SECTOR_SIZE, false);
+  }
+
+  *image = (ElfImage){
+    .file = vfs_fidentity(vfs, fid),
+    .entry = elf->program_entry_addr,
+  };
+
+  uint32_t file_size = vfs_fsize(vfs, fid);
+  ElfProgramHeader64 *progs = (void *)(headers + elf->program_table_offset);
   for (uint32_t i = 0; i < elf->program_table_entry_count; ++i) {
     ElfProgramHeader64 *prog = &progs[i];
-    if (progs->type != ELF_PROG_EXECUTABLE) continue;
-    log("program header: %d, type=%d", i, progs->type);
+    if (prog->type != ELF_PROG_LOAD) continue;
+    ASSERT(image->segments_len < MAX_ELF_SEGMENTS);
     ASSERT(prog->alignment <= PAGE_SIZE);
+    ASSERT(prog->size_in_file <= prog->size_in_memory);
+    ASSERT(prog->file_offset + prog->size_in_file <= file_size);
+    // NOTE: Segments are congruent to their file offsets, so whole sectors
+    // can be read in place
+    ASSERT(prog->virtual_addr % SECTOR_SIZE == prog->file_offset % SECTOR_SIZE);
 
-    uint32_t page_count = (PAGE_SIZE - 1 + prog->size_in_memory) / PAGE_SIZE;
+    vaddr_t page_start = prog->virtual_addr & ~(PAGE_SIZE - 1);
+    size_t page_offset = prog->virtual_addr - page_start;
+    uint32_t page_count = (page_offset + prog->size_in_memory + PAGE_SIZE - 1) / PAGE_SIZE;
 
-    paddr_t physical = alloc_pages2(mm->page_alloc, page_count);
+    paddr_t physical = alloc_pages2(kernel_mm->page_alloc, page_count);
+    uint8_t *frames = (void *)(physical + kernel_mm->virtual_offset);
 
-    memcpy((void *)(physical + mm->virtual_offset), (void *)(file + prog->file_offset), prog->size_in_file);
+    if (prog->size_in_file) {
+      uint32_t sector_offset = prog->file_offset % SECTOR_SIZE;
+      uint32_t sectors_len = (sector_offset + prog->size_in_file + SECTOR_SIZE - 1) / SECTOR_SIZE;
+      vfs_file_rw_sectors(vfs, fid, prog->file_offset / SECTOR_SIZE, sectors_len,
+          frames + page_offset - sector_offset, false);
+    }
 
-    map_virtual_range(mm, prog->virtual_addr, physical, prog->size_in_memory,
-        PAGE_BIT_PRESENT | PAGE_BIT_WRITABLE | PAGE_BIT_USER);
+    // Only size_in_file comes from the file, the rest of the pages and the BSS are zeroed
+    memset(frames, 0, page_offset);
+    size_t data_end = page_offset + prog->size_in_file;
+    memset(frames + data_end, 0, page_count * PAGE_SIZE - data_end);
+
+    bool is_writable = (prog->flags & ELF_PROG_WRITEBALE) != 0;
+    ElfSegment *prev = image->segments_len ? &image->segments[image->segments_len - 1] : NULL;
+    if (prev && page_start < prev->virtual + prev->size) {
+      // NOTE: Segments are sorted by address, so only the last page of the previous one can be shared
+      ASSERT(page_start == prev->virtual + prev->size - PAGE_SIZE);
+      paddr_t shared = prev->physical + prev->size - PAGE_SIZE;
+      size_t shared_end = MIN(page_offset + prog->size_in_memory, PAGE_SIZE);
+      memcpy((uint8_t *)(shared + kernel_mm->virtual_offset) + page_offset, frames + page_offset,
+          shared_end - page_offset);
+
+      // The shared page gets the union of both permissions
+      if (is_writable && !prev->is_writable) {
+        if (prev->size == PAGE_SIZE) {
+          prev->is_writable = true;
+        } else {
+          ASSERT(image->segments_len < MAX_ELF_SEGMENTS);
+          prev->size -= PAGE_SIZE;
+          image->segments[image->segments_len++] = (ElfSegment){page_start, shared, PAGE_SIZE, true};
+        }
+      }
+
+      push_free_pages(kernel_mm->page_alloc, physical, 1);
+      if (page_count == 1) continue;
+      page_start += PAGE_SIZE;
+      physical += PAGE_SIZE;
+      page_count--;
+      ASSERT(image->segments_len < MAX_ELF_SEGMENTS);
+    }
+
+    image->segments[image->segments_len++] = (ElfSegment){
+      .virtual = page_start,
+      .physical = physical,
+      .size = page_count * PAGE_SIZE,
+      .is_writable = is_writable,
+    };
   }
-  *out_entry = elf->program_entry_addr;
+  push_free_pages(kernel_mm->page_alloc, headers_physical, 1);
+}
+
+// NOTE: Only called from the boot thread for now, so the cache isn't locked
+ElfImage *get_elf_image(ElfImageCache *cache, MemoryManager *kernel_mm, Vfs *vfs, Fid fid) {
+  FileIdentity file = vfs_fidentity(vfs, fid);
+  for (uint32_t i = 0; i < cache->len; ++i) {
+    ElfImage *image = &cache->images[i];
+    if (image->file.fs == file.fs && image->file.start == file.start) return image;
+  }
+
+  // TODO: Evict images without processes
+  ASSERT(cache->len < MAX_ELF_IMAGES);
+  ElfImage *image = &cache->images[cache->len++];
+  load_elf_image(image, kernel_mm, vfs, fid);
+  return image;
+}
+
+void map_elf_image(MemoryManager *mm, ElfImage *image) {
+  for (uint32_t i = 0; i < image->segments_len; ++i) {
+    ElfSegment *segment = &image->segments[i];
+    // The frames are shared, writable segments get private copies on the first write
+    size_t flags = PAGE_BIT_PRESENT | PAGE_BIT_USER;
+    if (segment->is_writable) flags |= PAGE_BIT_COPY_ON_WRITE;
+    map_virtual_range(mm, segment->virtual, segment->physical, segment->size, flags);
+  }
+  image->process_count++;
 }
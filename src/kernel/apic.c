@@ -69,8 +69,10 @@ void setup_apic(MemoryManager *mm, Apic *out_apic) {
 
   apic_regs[APIC_SPURIOUS_VECTOR] = 0x1FF;
 
-  apic_regs[APIC_LVT] = 0xF0;
-  apic_regs[APIC_TIMER_TICKS] = 0;
+  // Periodic tick for the task runtime timers
+  apic_regs[APIC_TIMER_DIVIDE] = 0xB; // divide by 1
+  apic_regs[APIC_LVT] = 0xF0 | APIC_LVT_PERIODIC;
+  apic_regs[APIC_TIMER_TICKS] = APIC_TIMER_PERIOD;
 }
 
 uint32_t read_ioapic_register(size_t io_apic_addr, size_t register_select) {
@@ -88,3 +90,127 @@ void write_ioapic_register(size_t io_apic_addr, size_t register_select, uint32_t
   *sel = register_select;
   *reg = value;
 }
+
+Cpu *register_cpu(uint32_t apic_id) {
+  ASSERT(CPU_COUNT < MAX_CPUS);
+  Cpu *cpu = &CPUS[CPU_COUNT++];
+  *cpu = (Cpu){ .apic_id = apic_id };
+  return cpu;
+}
+
+Cpu *get_current_cpu(void) {
+  uint32_t apic_id = APIC.regs[APIC_LOCAL_ID] >> 24;
+  for (uint32_t i = 0; i < CPU_COUNT; ++i) {
+    if (CPUS[i].apic_id == apic_id) return &CPUS[i];
+  }
+  TRAP();
+}
+
+uint8_t alloc_irq_vector(Cpu *cpu, IrqHandler handler, void *arg) {
+  size_t irq = irq_save();
+  for (uint32_t vector = IRQ_DYNAMIC_START; vector < IRQ_DYNAMIC_END; ++vector) {
+    IrqVector *v = &cpu->vectors[vector];
+    if (v->handler) continue;
+    *v = (IrqVector){ .handler = handler, .arg = arg };
+    cpu->vectors_used++;
+    irq_restore(irq);
+    return vector;
+  }
+  irq_restore(irq);
+  log("Out of interrupt vectors on cpu %d", (size_t)cpu->apic_id);
+  return 0;
+}
+
+void free_irq_vector(Cpu *cpu, uint8_t vector) {
+  size_t irq = irq_save();
+  if (cpu->vectors[vector].handler) cpu->vectors_used--;
+  cpu->vectors[vector] = (IrqVector){0};
+  irq_restore(irq);
+}
+
+Cpu *pick_cpu(CpuSet cpus) {
+  Cpu *best = NULL;
+  for (uint32_t i = 0; i < CPU_COUNT; ++i) {
+    if (!(cpus & (1u << i))) continue;
+    if (!best || CPUS[i].vectors_used < best->vectors_used) best = &CPUS[i];
+  }
+  return best;
+}
+
+// SOURCE: https://pdos.csail.mit.edu/6.828/2016/readings/ia32/ioapic.pdf
+enum {
+  IO_APIC_REDIRECTION_ACTIVE_LOW = 1 << 13,
+  IO_APIC_REDIRECTION_LEVEL = 1 << 15,
+  IO_APIC_REDIRECTION_MASKED = 1 << 16,
+};
+
+// SOURCE: https://uefi.org/specs/ACPI/6.6/05_ACPI_Software_Programming_Model.html#mps-inti-flags
+enum {
+  MPS_INTI_POLARITY_MASK = 3,
+  MPS_INTI_ACTIVE_LOW = 3,
+  MPS_INTI_TRIGGER_MASK = 3 << 2,
+  MPS_INTI_LEVEL = 3 << 2,
+};
+
+void setup_io_apics(MemoryManager *mm, BootData *data, IrqRouting *routing) {
+  *routing = (IrqRouting){0};
+  for (uint32_t i = 0; i < ISA_IRQ_COUNT; ++i) routing->isa_irqs[i].gsi = i;
+  for (uint32_t i = 0; i < data->irq_overrides_len; ++i) {
+    IrqOverride *o = &data->irq_overrides[i];
+    routing->isa_irqs[o->isa_irq] = (IsaIrqRoute){ .gsi = o->gsi, .flags = o->flags };
+  }
+
+  for (uint32_t i = 0; i < data->io_apics_len; ++i) {
+    vaddr_t regs = alloc_physical(mm, data->io_apics[i].addr, PAGE_SIZE,
+        PAGE_BIT_PRESENT | PAGE_BIT_WRITABLE);
+    flush_page_table(mm);
+
+    uint32_t version = read_ioapic_register(regs, IO_APIC_VER);
+    IoApic *io_apic = &routing->io_apics[routing->io_apics_len++];
+    *io_apic = (IoApic){
+      .regs = regs,
+      .gsi_base = data->io_apics[i].gsi_base,
+      .gsi_count = ((version >> 16) & 0xFF) + 1,
+    };
+    log("io apic gsi=%d..%d", (size_t)io_apic->gsi_base, (size_t)(io_apic->gsi_base + io_apic->gsi_count));
+
+    for (uint32_t input = 0; input < io_apic->gsi_count; ++input) {
+      write_ioapic_register(regs, 0x10 + input * 2, IO_APIC_REDIRECTION_MASKED);
+    }
+  }
+}
+
+uint8_t request_gsi_irq(IrqRouting *routing, uint32_t gsi, uint16_t flags, CpuSet cpus, IrqHandler handler, void *arg) {
+  IoApic *io_apic = NULL;
+  for (uint32_t i = 0; i < routing->io_apics_len; ++i) {
+    IoApic *a = &routing->io_apics[i];
+    if (gsi >= a->gsi_base && gsi < a->gsi_base + a->gsi_count) io_apic = a;
+  }
+  if (!io_apic) {
+    log("No IO APIC handles gsi %d", (size_t)gsi);
+    return 0;
+  }
+
+  Cpu *cpu = pick_cpu(cpus);
+  if (!cpu) return 0;
+  uint8_t vector = alloc_irq_vector(cpu, handler, arg);
+  if (!vector) return 0;
+
+  // Fixed delivery, physical destination
+  uint32_t low = vector;
+  if ((flags & MPS_INTI_POLARITY_MASK) == MPS_INTI_ACTIVE_LOW) low |= IO_APIC_REDIRECTION_ACTIVE_LOW;
+  if ((flags & MPS_INTI_TRIGGER_MASK) == MPS_INTI_LEVEL) low |= IO_APIC_REDIRECTION_LEVEL;
+
+  uint32_t reg = 0x10 + (gsi - io_apic->gsi_base) * 2;
+  write_ioapic_register(io_apic->regs, reg + 1, cpu->apic_id << 24);
+  write_ioapic_register(io_apic->regs, reg, low);
+  return vector;
+}
+
+uint8_t request_isa_irq(IrqRouting *routing, uint8_t isa_irq, CpuSet cpus, IrqHandler handler, void *arg) {
+  ASSERT(isa_irq < ISA_IRQ_COUNT);
+  IsaIrqRoute *route = &routing->isa_irqs[isa_irq];
+  // NOTE: ISA interrupts without an override are active high and edge triggered,
+  // which is what zeroed flags mean
+  return request_gsi_irq(routing, route->gsi, route->flags, cpus, handler, arg);
+}
@@ -0,0 +1,303 @@
+#include "cmn/lib.h"
+#include "common.h"
+#include "arch.h"
+#include "blk_queue.h"
+
+// Upper bound, the pages it touches
+static inline uint32_t blk_io_segments(const BlkIo *io) {
+  size_t offset = (size_t)io->buffer & (PAGE_SIZE - 1);
+  return (offset + io->len * SECTOR_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+static inline bool blk_queue_can_merge(BlkQueue *queue, BlkQueueRequest *req, bool is_write, uint32_t len,
+    uint32_t segments) {
+  return !req->part_of
+    && req->is_write == is_write
+    && req->len + len <= BLK_QUEUE_MAX_SECTORS
+    && req->segments + segments <= queue->dev->seg_max;
+}
+
+void blk_queue_free_request(BlkQueue *queue, BlkQueueRequest *req) {
+  req->next = queue->free;
+  queue->free = req;
+}
+
+// Returns the first pending request that doesn't start before sector, out_prev is the one before it
+BlkQueueRequest *blk_queue_find(BlkQueue *queue, uint32_t sector, BlkQueueRequest **out_prev) {
+  BlkQueueRequest *prev = NULL;
+  BlkQueueRequest *next = queue->pending;
+  while (next && next->first_sector < sector) {
+    prev = next;
+    next = next->next;
+  }
+  *out_prev = prev;
+  return next;
+}
+
+// Returns the link to the request that goes out next
+BlkQueueRequest **blk_queue_pick(BlkQueue *queue) {
+  if (queue->policy == BLK_SCHED_DEADLINE) {
+    BlkQueueRequest **oldest = &queue->pending;
+    for (BlkQueueRequest **link = &queue->pending; *link; link = &(*link)->next) {
+      if ((*link)->deadline < (*oldest)->deadline) oldest = link;
+    }
+    // NOTE: The sweep carries on from there
+    if ((*oldest)->deadline <= TASKS.ticks) return oldest;
+  }
+  for (BlkQueueRequest **link = &queue->pending; *link; link = &(*link)->next) {
+    if ((*link)->first_sector >= queue->head_sector) return link;
+  }
+  return &queue->pending;
+}
+
+// The last part to finish completes the BlkIo
+void blk_queue_end_part(BlkIo *io, bool is_error) {
+  io->is_error |= is_error;
+  if (!--io->parts) io->is_done = true;
+}
+
+void blk_queue_complete(VirtioBlkRequest *dev_req) {
+  BlkQueueRequest *req = dev_req->arg;
+  bool is_error = dev_req->status != VIRTIO_BLK_S_OK;
+  if (req->part_of) blk_queue_end_part(req->part_of, is_error);
+  for (BlkIo *io = req->first; io;) {
+    // NOTE: The owner can reuse it once it's done
+    BlkIo *next = io->next;
+    io->is_error = is_error;
+    io->is_done = true;
+    io = next;
+  }
+  blk_queue_free_request(req->queue, req);
+}
+
+void blk_queue_dispatch(BlkQueue *queue) {
+  while (queue->pending) {
+    BlkQueueRequest **link = blk_queue_pick(queue);
+    BlkQueueRequest *req = *link;
+
+    // Every BlkIo takes at least one segment, so they fit
+    VirtqBuf data[VIRTIO_BLK_MAX_SEGMENTS];
+    uint32_t count = 0;
+    if (req->part_of) data[count++] = (VirtqBuf){req->buffer, req->len * SECTOR_SIZE, false};
+    for (BlkIo *io = req->first; io; io = io->next) {
+      data[count++] = (VirtqBuf){io->buffer, io->len * SECTOR_SIZE, false};
+    }
+    // The device is full, the rest goes out as requests complete
+    if (!virtio_blk_submitv(queue->dev, data, count, req->first_sector, req->is_write, blk_queue_complete, req)) return;
+
+    *link = req->next;
+    queue->head_sector = req->first_sector + req->len;
+    queue->dispatched_requests++;
+  }
+}
+
+// A full queue goes out even when it's plugged
+BlkQueueRequest *blk_queue_alloc_request(BlkQueue *queue) {
+  while (!queue->free) {
+    blk_queue_dispatch(queue);
+    if (!virtio_blk_complete(queue->dev)) virtq_wait_used(queue->dev->vq);
+  }
+  BlkQueueRequest *req = queue->free;
+  queue->free = req->next;
+  return req;
+}
+
+void blk_queue_insert(BlkQueue *queue, BlkQueueRequest *req) {
+  BlkQueueRequest *prev;
+  req->next = blk_queue_find(queue, req->first_sector, &prev);
+  if (prev) prev->next = req;
+  else queue->pending = req;
+}
+
+// Too big for one device request, the parts go out on their own and are never merged
+void blk_queue_submit_split(BlkQueue *queue, BlkIo *io, bool is_write) {
+  uint8_t *buffer = io->buffer;
+  uint32_t sector = io->first_sector;
+  uint32_t sectors_left = io->len;
+  // NOTE: Held until every part is queued, making room can complete the first ones
+  io->parts = 1;
+  while (sectors_left) {
+    size_t offset = (size_t)buffer & (PAGE_SIZE - 1);
+    uint32_t len = MIN(sectors_left, BLK_QUEUE_MAX_SECTORS);
+    len = MIN(len, virtio_blk_max_sectors(queue->dev, buffer));
+
+    BlkQueueRequest *req = blk_queue_alloc_request(queue);
+    *req = (BlkQueueRequest){
+      .queue = queue,
+      .first_sector = sector,
+      .len = len,
+      .segments = (offset + len * SECTOR_SIZE + PAGE_SIZE - 1) / PAGE_SIZE,
+      .is_write = is_write,
+      .deadline = io->deadline,
+      .part_of = io,
+      .buffer = buffer,
+    };
+    io->parts++;
+    blk_queue_insert(queue, req);
+
+    buffer += len * SECTOR_SIZE;
+    sector += len;
+    sectors_left -= len;
+  }
+  blk_queue_end_part(io, false);
+}
+
+void blk_queue_submit(BlkQueue *queue, BlkIo *io) {
+  bool is_write = io->flags & BLKDEV_WRITE;
+  uint32_t segments = blk_io_segments(io);
+  io->is_done = false;
+  io->is_error = false;
+  io->next = NULL;
+  io->deadline = TASKS.ticks + (is_write ? BLK_QUEUE_WRITE_DEADLINE : BLK_QUEUE_READ_DEADLINE);
+  queue->submitted_ios++;
+
+  BlkQueueRequest *prev;
+  BlkQueueRequest *next = blk_queue_find(queue, io->first_sector, &prev);
+  if (segments > queue->dev->seg_max || io->len > BLK_QUEUE_MAX_SECTORS) {
+    blk_queue_submit_split(queue, io, is_write);
+  } else if (prev && prev->first_sector + prev->len == io->first_sector
+      && blk_queue_can_merge(queue, prev, is_write, io->len, segments)) {
+    prev->last->next = io;
+    prev->last = io;
+    prev->len += io->len;
+    prev->segments += segments;
+
+    // It might have filled the gap to the next one
+    if (next && !next->part_of && prev->first_sector + prev->len == next->first_sector
+        && blk_queue_can_merge(queue, prev, next->is_write, next->len, next->segments)) {
+      prev->last->next = next->first;
+      prev->last = next->last;
+      prev->len += next->len;
+      prev->segments += next->segments;
+      prev->deadline = MIN(prev->deadline, next->deadline);
+      prev->next = next->next;
+      blk_queue_free_request(queue, next);
+    }
+  } else if (next && io->first_sector + io->len == next->first_sector
+      && blk_queue_can_merge(queue, next, is_write, io->len, segments)) {
+    io->next = next->first;
+    next->first = io;
+    next->first_sector = io->first_sector;
+    next->len += io->len;
+    next->segments += segments;
+    next->deadline = MIN(next->deadline, io->deadline);
+  } else {
+    BlkQueueRequest *req = blk_queue_alloc_request(queue);
+    *req = (BlkQueueRequest){
+      .queue = queue,
+      .first = io,
+      .last = io,
+      .first_sector = io->first_sector,
+      .len = io->len,
+      .segments = segments,
+      .is_write = is_write,
+      .deadline = io->deadline,
+    };
+    // NOTE: Making room might have sent some of them out
+    blk_queue_insert(queue, req);
+  }
+
+  if (!queue->plugs) blk_queue_dispatch(queue);
+}
+
+bool blk_queue_is_done(BlkQueue *queue, BlkIo *io) {
+  if (io->is_done) return true;
+  // Somebody is waiting, so the plugged requests go out as well
+  blk_queue_dispatch(queue);
+  if (virtio_blk_complete(queue->dev)) blk_queue_dispatch(queue);
+  return io->is_done;
+}
+
+void blk_queue_wait(BlkQueue *queue, BlkIo *io) {
+  while (!blk_queue_is_done(queue, io)) virtq_wait_used(queue->dev->vq);
+}
+
+void blk_queue_plug(BlkQueue *queue) {
+  queue->plugs++;
+}
+
+void blk_queue_unplug(BlkQueue *queue) {
+  ASSERT(queue->plugs);
+  queue->plugs--;
+  if (!queue->plugs) blk_queue_dispatch(queue);
+}
+
+void blk_queue_read_write_sectors(BlkDev *blk, void *buffer, uint32_t first_sector, uint32_t len, BlkDevFlags flags) {
+  BlkQueue *queue = (void *)blk;
+  BlkIo io = {
+    .buffer = buffer,
+    .first_sector = first_sector,
+    .len = len,
+    .flags = flags,
+  };
+  blk_queue_submit(queue, &io);
+  blk_queue_wait(queue, &io);
+  // TODO: It should be an error
+  ASSERT(!io.is_error);
+}
+
+void blk_queue_submit_sectors(BlkDev *blk, void *buffer, uint32_t first_sector, uint32_t len, BlkDevFlags flags) {
+  BlkQueue *queue = (void *)blk;
+  ASSERT(!queue->has_v1_io && "Only one request at a time");
+  queue->v1_io = (BlkIo){
+    .buffer = buffer,
+    .first_sector = first_sector,
+    .len = len,
+    .flags = flags,
+  };
+  queue->has_v1_io = true;
+  blk_queue_submit(queue, &queue->v1_io);
+}
+
+bool blk_queue_is_done_blk(BlkDev *blk) {
+  BlkQueue *queue = (void *)blk;
+  ASSERT(queue->has_v1_io);
+  if (!blk_queue_is_done(queue, &queue->v1_io)) return false;
+  queue->has_v1_io = false;
+  // TODO: It should be an error
+  ASSERT(!queue->v1_io.is_error);
+  return true;
+}
+
+void blk_queue_submit_io(BlkDev *blk, BlkIo *io) {
+  blk_queue_submit((BlkQueue *)blk, io);
+}
+
+bool blk_queue_is_io_done(BlkDev *blk, BlkIo *io) {
+  return blk_queue_is_done((BlkQueue *)blk, io);
+}
+
+void blk_queue_wait_io(BlkDev *blk, BlkIo *io) {
+  blk_queue_wait((BlkQueue *)blk, io);
+}
+
+void blk_queue_plug_blk(BlkDev *blk) {
+  blk_queue_plug((BlkQueue *)blk);
+}
+
+void blk_queue_unplug_blk(BlkDev *blk) {
+  blk_queue_unplug((BlkQueue *)blk);
+}
+
+void blk_queue_init(BlkQueue *queue, VirtioBlkdev *dev, BlkSchedPolicy policy) {
+  *queue = (BlkQueue){
+    .blk = {
+      .read_write_sectors = blk_queue_read_write_sectors,
+      .submit = blk_queue_submit_sectors,
+      .is_done = blk_queue_is_done_blk,
+      .submit_io = blk_queue_submit_io,
+      .is_io_done = blk_queue_is_io_done,
+      .wait_io = blk_queue_wait_io,
+      .plug = blk_queue_plug_blk,
+      .unplug = blk_queue_unplug_blk,
+      .waiters = dev->blk.waiters,
+      .sector_capacity = dev->blk.sector_capacity,
+    },
+    .dev = dev,
+    .policy = policy,
+  };
+  for (uint32_t i = 0; i < BLK_QUEUE_MAX_REQUESTS; ++i) {
+    queue->requests[i].queue = queue;
+    blk_queue_free_request(queue, &queue->requests[i]);
+  }
+}
@@ -0,0 +1,40 @@
+#include "cmn/lib.h"
+#include "common.h"
+#include "arch.h"
+
+void defer_work(DeferredWorkQueue *queue, DeferredWork *work) {
+  size_t irq = irq_save();
+  if (!work->is_queued) {
+    work->is_queued = true;
+    work->next = NULL;
+    if (queue->last) queue->last->next = work;
+    else queue->first = work;
+    queue->last = work;
+  }
+  irq_restore(irq);
+}
+
+bool run_deferred_work(DeferredWorkQueue *queue) {
+  size_t irq = irq_save();
+  if (queue->is_running || !queue->first) {
+    irq_restore(irq);
+    return false;
+  }
+
+  queue->is_running = true;
+  DeferredWork *work;
+  while ((work = queue->first)) {
+    queue->first = work->next;
+    if (!queue->first) queue->last = NULL;
+    work->next = NULL;
+    // NOTE: Cleared before running, an interrupt during the work queues it again
+    work->is_queued = false;
+
+    irq_enable();
+    work->run(work);
+    irq_save();
+  }
+  queue->is_running = false;
+  irq_restore(irq);
+  return true;
+}
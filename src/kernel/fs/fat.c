@@ -89,25 +89,34 @@ static inline int fat_first_sector_in_cluster(const FatDriver *driver, uint32_t
   return ((cluster - 2) * driver->sectors_per_cluster) + driver->first_data_sector;
 }
 
-// note: uses buffer in dat to read fat table from disk
-FatTableEntry fat_next_cluster(FatDriver *driver, uint32_t cluster) {
-  uint32_t fat_offset = cluster * 4;
-  uint32_t fat_sector = driver->first_fat_sector + (fat_offset / SECTOR_SIZE);
-  uint32_t ent_offset = fat_offset % SECTOR_SIZE;
-
-  // TODO: cache it instead of reading from disk for every lookup
-  virtio_blk_rw(driver->blkdev, driver->buffer, fat_sector, 1, false);
+static inline uint32_t fat_table_sector(const FatDriver *driver, uint32_t cluster) {
+  return driver->first_fat_sector + (cluster * 4 / SECTOR_SIZE);
+}
 
-  uint32_t table_value = *(uint32_t *)&driver->buffer[ent_offset];
+// Expects the sector from fat_table_sector in the driver's buffer
+static inline FatTableEntry fat_table_entry(const FatDriver *driver, uint32_t cluster) {
+  uint32_t table_value = *(uint32_t *)&driver->buffer[cluster * 4 % SECTOR_SIZE];
   return table_value & 0x0fffffff; // the highes 4 bits are reserved
 }
 
+// note: uses buffer in dat to read fat table from disk
+FatTableEntry fat_next_cluster(FatDriver *driver, uint32_t cluster) {
+  uint32_t sector = fat_table_sector(driver, cluster);
+  // NOTE: One sector covers 128 clusters, so runs of clusters hit the same one
+  if (driver->buffered_fat_sector != sector) {
+    blk_v1_read_write_sectors(driver->blkdev, driver->buffer, sector, 1, BLKDEV_READ);
+    driver->buffered_fat_sector = sector;
+  }
+  return fat_table_entry(driver, cluster);
+}
+
 DirEntry fat_find_directory_entry(FatDriver *driver, uint32_t first_directory_cluster, Str name) {
   FatEntry *entries = (void *)driver->buffer;
   uint32_t sector = fat_first_sector_in_cluster(driver, first_directory_cluster);
 
   // TODO: do it for every sector in cluster
-  virtio_blk_rw(driver->blkdev, driver->buffer, sector, 1, false);
+  blk_v1_read_write_sectors(driver->blkdev, driver->buffer, sector, 1, BLKDEV_READ);
+  driver->buffered_fat_sector = 0;
 
   bool last_lfn_matched = false;
 
@@ -150,19 +159,33 @@ DirEntry fat_find_directory_entry(FatDriver *driver, uint32_t first_directory_cl
   return (DirEntry){0};
 }
 
-FatDriver fat_driver_init(VirtioBlkdev *blkdev) {
+// fat_driver_init only takes FAT32 volumes
+bool fat_is_fat32(const uint8_t sector[SECTOR_SIZE]) {
+  const fat_BS_t *bs = (const void *)sector;
+  const fat_extBS_32 *ebs = (const void *)&bs->extended_section;
+  if (sector[510] != 0x55 || sector[511] != 0xAA) return false;
+  if (bs->bytes_per_sector != SECTOR_SIZE || !bs->sectors_per_cluster) return false;
+  // The 16-bit fields are zero on FAT32
+  if (bs->table_size_16 || bs->root_entry_count) return false;
+
+  uint32_t total_sectors = bs->total_sectors_16 ? bs->total_sectors_16 : bs->total_sectors_32;
+  uint32_t meta_sectors = bs->reserved_sector_count + bs->table_count * ebs->table_size_32;
+  if (total_sectors <= meta_sectors) return false;
+  return (total_sectors - meta_sectors) / bs->sectors_per_cluster > 65525;
+}
+
+FatDriver fat_driver_init(BlkDev *blkdev) {
   FatDriver driver = {
     .fs.type = FS_FAT32,
     .blkdev = blkdev,
-    .buffer = (void *)alloc_pages(1)
   };
-  virtio_blk_rw(blkdev, driver.buffer, 0, 1, false);
+  blk_v1_read_write_sectors(blkdev, driver.buffer, 0, 1, BLKDEV_READ);
 
   fat_BS_t *bs = (void *)driver.buffer;
   fat_extBS_32 *ebs = (void *)&bs->extended_section;
 
   // TODO: move it behind a debug flag or something
-  LOG("Reading FAT disk boot record data\n", 0);
+  log("Reading FAT disk boot record data");
   DEBUGD(bs->bytes_per_sector);
   DEBUGD(bs->sectors_per_cluster);
   DEBUGD(bs->reserved_sector_count);
@@ -207,6 +230,14 @@ FatDriver fat_driver_init(VirtioBlkdev *blkdev) {
   return driver;
 }
 
+void fat_wait_ios(FatDriver *driver, BlkIo *ios, uint32_t len) {
+  for (uint32_t i = 0; i < len; ++i) {
+    blk_v2_wait(driver->blkdev, &ios[i]);
+    // TODO: It should be an error
+    ASSERT(!ios[i].is_error);
+  }
+}
+
 // TODO: consider adding a separate option struct
 void fat_rw_sectors(FatDriver *driver, uint32_t first_cluster, uint32_t sectors_start, uint32_t sectors_len, uint8_t *buffer, bool is_write) {
   uint32_t start_in_clusters = sectors_start / driver->sectors_per_cluster;
@@ -219,20 +250,47 @@ void fat_rw_sectors(FatDriver *driver, uint32_t first_cluster, uint32_t sectors_
   for (; i < start_in_clusters; ++i) {
     cluster = fat_next_cluster(driver, cluster);
   }
+
+  // The cluster runs go out together, so the request queue can merge the contiguous ones.
+  // NOTE: A FAT table read waits, which sends out the ones before it
+  BlkIo ios[FAT_RW_BATCH];
+  uint32_t ios_len = 0;
+  blk_v2_plug(driver->blkdev);
+
   uint32_t total_sectors_read = 0;
   uint32_t sectors_start_in_cluster = sectors_start % driver->sectors_per_cluster;
   for (; i < end_in_clusters; ++i) {
     uint32_t cluster_start_on_disk = fat_first_sector_in_cluster(driver, cluster);
     uint32_t cluster_len_limit = driver->sectors_per_cluster - sectors_start_in_cluster;
     uint32_t sectors_len_in_cluster = UPPER_BOUND(cluster_len_limit, sectors_len - total_sectors_read);
+    uint8_t *run_buffer = buffer + SECTOR_SIZE * total_sectors_read;
+    uint32_t run_start = cluster_start_on_disk + sectors_start_in_cluster;
+    BlkDevFlags flags = is_write ? BLKDEV_WRITE : BLKDEV_READ;
 
-    uint8_t *buffer_start = buffer + SECTOR_SIZE * total_sectors_read;
-    uint32_t first_disk_sector = cluster_start_on_disk + sectors_start_in_cluster;
-    virtio_blk_rw(driver->blkdev, buffer_start, first_disk_sector, sectors_len_in_cluster, is_write);
+    if (!blk_v2_is_supported(driver->blkdev)) {
+      // NOTE: Like the bare virtio-blk on rv32, one run at a time
+      blk_v1_read_write_sectors(driver->blkdev, run_buffer, run_start, sectors_len_in_cluster, flags);
+    } else {
+      if (ios_len == FAT_RW_BATCH) {
+        fat_wait_ios(driver, ios, ios_len);
+        ios_len = 0;
+      }
+      BlkIo *io = &ios[ios_len++];
+      *io = (BlkIo){
+        .buffer = run_buffer,
+        .first_sector = run_start,
+        .len = sectors_len_in_cluster,
+        .flags = flags,
+      };
+      blk_v2_submit(driver->blkdev, io);
+    }
 
     total_sectors_read += sectors_len_in_cluster;
     // after the first one it's from the beginning of the cluster
     sectors_start_in_cluster = 0;
-    cluster = fat_next_cluster(driver, cluster);
+    if (i + 1 < end_in_clusters) cluster = fat_next_cluster(driver, cluster);
   }
+
+  blk_v2_unplug(driver->blkdev);
+  fat_wait_ios(driver, ios, ios_len);
 }
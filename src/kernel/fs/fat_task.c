@@ -0,0 +1,40 @@
+#include "common.h"
+#include "vfs.h"
+
+// NOTE: Kept out of fat.c, the bootloader links the file systems but not the
+// task runtime. Include it after fat.c, it uses the table helpers from there.
+
+void fat_rw_task(Task *task) {
+  FatRwTask *this = (void *)task;
+  FatDriver *driver = this->driver;
+  uint32_t first_cluster_index = this->sectors_start / driver->sectors_per_cluster;
+  uint32_t end_cluster_index = (this->sectors_start + this->sectors_len - 1) / driver->sectors_per_cluster + 1;
+
+  BEGIN_TASK(task);
+  this->cluster_index = 0;
+  this->sectors_done = 0;
+
+  for (; this->cluster_index < end_cluster_index; ++this->cluster_index) {
+    if (this->cluster_index >= first_cluster_index) {
+      uint32_t start_in_cluster = this->cluster_index == first_cluster_index
+        ? this->sectors_start % driver->sectors_per_cluster : 0;
+      uint32_t len = UPPER_BOUND(driver->sectors_per_cluster - start_in_cluster,
+          this->sectors_len - this->sectors_done);
+      uint32_t first_disk_sector = fat_first_sector_in_cluster(driver, this->cluster) + start_in_cluster;
+
+      blk_v1_submit(driver->blkdev, this->buffer + SECTOR_SIZE * this->sectors_done,
+          first_disk_sector, len, this->is_write ? BLKDEV_WRITE : BLKDEV_READ);
+      this->sectors_done += len;
+      AWAIT_EVENT(task, blk_v1_get_wait_queue(driver->blkdev), blk_v1_is_done(driver->blkdev));
+    }
+    if (this->cluster_index + 1 == end_cluster_index) break;
+
+    if (driver->buffered_fat_sector != fat_table_sector(driver, this->cluster)) {
+      blk_v1_submit(driver->blkdev, driver->buffer, fat_table_sector(driver, this->cluster), 1, BLKDEV_READ);
+      AWAIT_EVENT(task, blk_v1_get_wait_queue(driver->blkdev), blk_v1_is_done(driver->blkdev));
+      driver->buffered_fat_sector = fat_table_sector(driver, this->cluster);
+    }
+    this->cluster = fat_table_entry(driver, this->cluster);
+  }
+  END_TASK(task);
+}
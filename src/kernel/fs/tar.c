@@ -32,7 +32,7 @@ uint32_t oct_to_bin(char *str, uint32_t size) {
   return number;
 }
 
-TarDriver tar_driver_init(VirtioBlkdev *blkdev) {
+TarDriver tar_driver_init(BlkDev *blkdev) {
   TarDriver driver = {
     .fs.type = FS_USTAR,
     .blkdev = blkdev,
@@ -44,14 +44,18 @@ TarDriver tar_driver_init(VirtioBlkdev *blkdev) {
 DirEntry tar_find_file(TarDriver *driver, Str name) {
   ASSERT(name.len <= 100);
   uint32_t sector = 0, size;
+  uint32_t sector_capacity = blk_v1_get_sector_capacity(driver->blkdev);
   TarHeader *header;
 
-  while (sector < driver->blkdev->sector_capacity) {
-    virtio_blk_rw(driver->blkdev, driver->buffer, sector, 1, false);
+  while (sector < sector_capacity) {
+    blk_v1_read_write_sectors(driver->blkdev, driver->buffer, sector, 1, BLKDEV_READ);
     header = (void *)driver->buffer;
+    if (!header->name[0]) break; // end of archive
     size = oct_to_bin(header->size, sizeof(header->size) - 1);
 
-    if (!strncmp(header->name, name.ptr, name.len)) {
+    bool name_matches = are_strings_equal(header->name, name.ptr, name.len) &&
+      (name.len == sizeof(header->name) || !header->name[name.len]);
+    if (name_matches) {
       ASSERT(header->type == '0'); // normal file
       return (DirEntry){
         .type = ENTRY_FILE,
@@ -59,7 +59,7 @@ MatchResult vfs_mount_match(Vfs *vfs, Str path) {
   }
   if (path.ptr[matching] == '/') matching++;
   return (MatchResult){
-    .subpath = (Str){ &path.ptr[matching], path.len - matching },
+    .subpath = (Str){ path.len - matching, &path.ptr[matching] },
     .fs = longest_match == MAX_MOUNT_POINTS ? 0 : vfs->mounts[longest_match].fs,
   };
 }
@@ -82,7 +82,7 @@ Fid vfs_fopen(Vfs *vfs, Str path) {
       while (1) {
         uint32_t len = 0;
         for (; len < subpath.len && subpath.ptr[len] != '/'; len++);
-        name = (Str){ subpath.ptr, len };
+        name = (Str){ len, subpath.ptr };
         if (subpath.len <= len) break;
         subpath.len -= len + 1; // include '/'
         subpath.ptr += len + 1;
@@ -128,7 +128,8 @@ Fid vfs_fopen(Vfs *vfs, Str path) {
       return (Fid){ file->gen, index };
     } break;
     default:
-      PANIC("Unsupported file system type: %d\n", match.fs->type);
+      log("Unsupported file system type: %d", match.fs->type);
+      TRAP();
   }
 }
 
@@ -145,6 +146,12 @@ extern inline uint32_t vfs_fsize(Vfs *vfs, Fid fid) {
   return vfs->files[fid.index].size;
 }
 
+FileIdentity vfs_fidentity(Vfs *vfs, Fid fid) {
+  ASSERT(vfs->files[fid.index].gen == fid.gen);
+  File *file = &vfs->files[fid.index];
+  return (FileIdentity){ file->fs, file->start };
+}
+
 void vfs_file_rw_sectors(Vfs *vfs, Fid fid, uint32_t start, uint32_t len, uint8_t *buffer, bool is_write) {
   ASSERT(vfs->files[fid.index].gen == fid.gen);
   File *file = &vfs->files[fid.index];
@@ -156,10 +163,12 @@ void vfs_file_rw_sectors(Vfs *vfs, Fid fid, uint32_t start, uint32_t len, uint8_
     } break;
     case FS_USTAR: {
       TarDriver *driver = (void *)file->fs;
-      virtio_blk_rw(driver->blkdev, buffer, file->start + start, len, is_write);
+      blk_v1_read_write_sectors(driver->blkdev, buffer, file->start + start, len,
+          is_write ? BLKDEV_WRITE : BLKDEV_READ);
     } break;
     default:
-      PANIC("unknown file system type: %d", file->fs->type);
+      log("Unknown file system type: %d", file->fs->type);
+      TRAP();
   }
 
 }
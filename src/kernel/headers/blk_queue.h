@@ -0,0 +1,72 @@
+#ifndef INCLUDE_BLK_QUEUE
+#define INCLUDE_BLK_QUEUE
+
+// Request queue between the filesystems and a virtio block device. Contiguous
+// requests are merged into one device request and the rest are sorted by sector.
+// SOURCE: https://www.kernel.org/doc/html/latest/block/deadline-iosched.html
+
+#include "common.h"
+#include "interfaces/blk.h"
+#include "virtio.h"
+
+typedef enum {
+  // One sweep up the disk, then back to the lowest sector (C-LOOK)
+  BLK_SCHED_ELEVATOR,
+  // Elevator, but expired requests go first
+  BLK_SCHED_DEADLINE,
+} BlkSchedPolicy;
+
+#define BLK_QUEUE_MAX_REQUESTS 64
+// Merging stops at this many sectors
+#define BLK_QUEUE_MAX_SECTORS 256
+// In timer ticks, writes can wait longer like with the Linux deadline scheduler
+#define BLK_QUEUE_READ_DEADLINE 50
+#define BLK_QUEUE_WRITE_DEADLINE 500
+
+typedef struct BlkQueue BlkQueue;
+
+// Contiguous BlkIos going the same way, sent as one device request
+typedef struct BlkQueueRequest BlkQueueRequest;
+struct BlkQueueRequest {
+  BlkQueue *queue;
+  BlkIo *first; // linked in sector order
+  BlkIo *last;
+  uint32_t first_sector;
+  uint32_t len;
+  uint32_t segments; // upper bound of the device segments
+  bool is_write;
+  uint64_t deadline; // of the oldest BlkIo
+  BlkQueueRequest *next; // in the pending or the free list
+  // Part of a BlkIo too big for one device request, first and last aren't used
+  BlkIo *part_of;
+  uint8_t *buffer;
+};
+
+// NOTE: Overlapping requests aren't kept in order, a write has to be done before it's read back
+struct BlkQueue {
+  BlkDev blk;
+  VirtioBlkdev *dev;
+  BlkSchedPolicy policy;
+  BlkQueueRequest requests[BLK_QUEUE_MAX_REQUESTS];
+  BlkQueueRequest *pending; // sorted by first sector
+  BlkQueueRequest *free;
+  uint32_t plugs;
+  uint32_t head_sector; // where the elevator is
+  BlkIo v1_io;
+  bool has_v1_io;
+
+  uint64_t submitted_ios;
+  uint64_t dispatched_requests;
+};
+
+// NOTE: The requests point back to the queue, so it's set up in place
+void blk_queue_init(BlkQueue *queue, VirtioBlkdev *dev, BlkSchedPolicy policy);
+void blk_queue_submit(BlkQueue *queue, BlkIo *io);
+bool blk_queue_is_done(BlkQueue *queue, BlkIo *io);
+void blk_queue_wait(BlkQueue *queue, BlkIo *io);
+void blk_queue_plug(BlkQueue *queue);
+void blk_queue_unplug(BlkQueue *queue);
+// Sends the pending requests to the device in the scheduler's order, until it's full
+void blk_queue_dispatch(BlkQueue *queue);
+
+#endif
@@ -155,6 +155,113 @@ typedef enum {
   ELF_PROG_READABLE = 4,
 } ElfProgramHeaderFlags;
 
+// src/task.c
+// Stackless cooperative tasks (protothreads). A task function is re-entered
+// from the top on every run and jumps back to the last YIELD/AWAIT, so locals
+// don't survive suspension points - keep the state in the struct embedding Task.
+
+typedef enum {
+  TASK_READY,
+  TASK_WAITING,
+  TASK_DONE,
+} TaskState;
+
+typedef enum {
+  WAIT_NONE,
+  WAIT_POLL, // condition is rechecked on every pass of the runtime
+  WAIT_EVENT, // parked on a WaitQueue, woken by a driver or an interrupt handler
+  WAIT_TIMER,
+} TaskWaitReason;
+
+struct Task;
+typedef void (*TaskFn)(struct Task *task);
+
+typedef struct Task {
+  uint32_t _pc;
+  TaskState state;
+  TaskWaitReason wait_reason;
+  TaskFn run;
+  uint64_t deadline;
+  struct Task *next;
+} Task;
+
+typedef struct {
+  Task *first;
+  Task *last;
+} TaskQueue;
+
+typedef TaskQueue WaitQueue;
+
+typedef struct {
+  TaskQueue ready;
+  TaskQueue polling;
+  Task *timers; // sorted by deadline
+  uint64_t ticks;
+} TaskRuntime;
+
+// Driven by the arch main loop and its timer interrupt
+extern TaskRuntime TASKS;
+
+void task_spawn(TaskRuntime *rt, Task *task, TaskFn run);
+void task_wake(TaskRuntime *rt, Task *task);
+void task_wait(Task *task, WaitQueue *wq);
+void task_poll(TaskRuntime *rt, Task *task);
+void task_sleep(TaskRuntime *rt, Task *task, uint64_t ticks);
+// Safe to call from interrupt handlers
+void wake_one(TaskRuntime *rt, WaitQueue *wq);
+void wake_all(TaskRuntime *rt, WaitQueue *wq);
+void task_runtime_tick(TaskRuntime *rt);
+// Runs every ready task once, returns false if there was nothing to do
+bool run_tasks(TaskRuntime *rt);
+
+// src/deferred_work.c
+// Interrupt handlers only acknowledge the device and queue the rest of the
+// work, which runs later with interrupts enabled. One queue per CPU.
+
+struct DeferredWork;
+typedef void (*DeferredWorkFn)(struct DeferredWork *work);
+
+typedef struct DeferredWork {
+  DeferredWorkFn run;
+  bool is_queued;
+  struct DeferredWork *next;
+} DeferredWork;
+
+typedef struct {
+  DeferredWork *first;
+  DeferredWork *last;
+  bool is_running; // interrupts nested in the work don't run it again
+} DeferredWorkQueue;
+
+// Safe to call from interrupt handlers, work that's already queued isn't
+// queued twice, so it has to handle everything that happened since it ran
+void defer_work(DeferredWorkQueue *queue, DeferredWork *work);
+// Returns false if there was nothing to do
+bool run_deferred_work(DeferredWorkQueue *queue);
+
+#define BEGIN_TASK(task) switch ((task)->_pc) { case 0:
+#define END_TASK(task) } (task)->state = TASK_DONE; return
+
+#define YIELD(task) \
+  do { (task)->_pc = __LINE__; return; case __LINE__:; } while (0)
+
+// Busy condition without an interrupt behind it, rechecked by the runtime
+#define AWAIT(task, cond) \
+  (task)->_pc = __LINE__; __attribute__((fallthrough)); case __LINE__: \
+  if (!(cond)) { task_poll(&TASKS, (task)); return; }
+
+// Condition is checked with interrupts off, so a wakeup from an interrupt
+// handler can't slip in between the check and parking on the queue
+#define AWAIT_EVENT(task, wq, cond) \
+  (task)->_pc = __LINE__; __attribute__((fallthrough)); case __LINE__: { \
+    size_t _irq = irq_save(); \
+    if (!(cond)) { task_wait((task), (wq)); irq_restore(_irq); return; } \
+    irq_restore(_irq); \
+  }
+
+#define SLEEP(task, ticks) \
+  do { task_sleep(&TASKS, (task), (ticks)); (task)->_pc = __LINE__; return; case __LINE__:; } while (0)
+
 #include "kernel/interfaces/gpu.h"
 #include "kernel/interfaces/blk.h"
 #include "kernel/interfaces/input.h"
@@ -162,11 +269,11 @@ typedef enum {
 // src/kernel.c
 typedef struct {
   GpuDev *gpu;
-  BlkDev *blk_devices;
+  BlkDev **blk_devices;
   InputDev *input_devices;
   uint32_t blk_devices_count;
   uint32_t input_devices_count;
-  
+  struct VirtioNetdev *netdev; // NULL without a network card
 } Hardware;
 void kernel_init(Hardware *hw);
 void kernel_update(Hardware *hw);
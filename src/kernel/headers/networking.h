@@ -20,4 +20,16 @@ typedef struct {
 
 void net_dhcp_request(VirtioNetdev *netdev);
 
+typedef struct {
+  Task task;
+  VirtioNetdev *netdev;
+  uint8_t *buffer;
+  uint8_t dhcp_mac[6];
+  NetCon dhcp_server;
+  NetCon sender;
+} DhcpTask;
+
+// Same exchange as net_dhcp_request, without blocking the caller
+void net_dhcp_task(Task *task);
+
 #endif // !INCLUDE_NETWORKING
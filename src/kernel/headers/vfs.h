@@ -32,6 +32,12 @@ typedef struct {
   uint16_t index;
 } Fid;
 
+// Stays the same across opens of the same file, unlike Fid
+typedef struct {
+  Fs *fs;
+  uint32_t start;
+} FileIdentity;
+
 typedef struct Vfs Vfs;
 
 void vfs_mount(Vfs *vfs, Str path, Fs *fs);
@@ -39,28 +45,51 @@ Fid vfs_fopen(Vfs *vfs, Str path);
 void vfs_fclose(Vfs *vfs, Fid fid);
 void vfs_file_rw_sectors(Vfs *vfs, Fid fid, uint32_t start, uint32_t len, uint8_t *buffer, bool is_write);
 inline uint32_t vfs_fsize(Vfs *vfs, Fid fid);
+FileIdentity vfs_fidentity(Vfs *vfs, Fid fid);
 
 typedef struct {
   Fs fs; // every file system driver needs this header
-  uint8_t *buffer;
-  VirtioBlkdev *blkdev;
+  BlkDev *blkdev;
+  uint8_t buffer[SECTOR_SIZE];
+  // FAT table sector in the buffer, 0 if it holds something else
+  uint32_t buffered_fat_sector;
   uint32_t first_data_sector;
   uint32_t first_fat_sector;
   uint32_t root_cluster;
   uint8_t sectors_per_cluster;
 } FatDriver;
 
-FatDriver fat_driver_init(VirtioBlkdev *blkdev);
+// Cluster runs submitted at once by fat_rw_sectors
+#define FAT_RW_BATCH 16
+
+bool fat_is_fat32(const uint8_t sector[SECTOR_SIZE]);
+FatDriver fat_driver_init(BlkDev *blkdev);
 DirEntry fat_find_directory_entry(FatDriver *driver, uint32_t first_directory_cluster, Str name);
 void fat_rw_sectors(FatDriver *driver, uint32_t first_cluster, uint32_t sectors_start, uint32_t sectors_len, uint8_t *buffer, bool is_write);
 
+// Task version of fat_rw_sectors, fill in the arguments and spawn it
+typedef struct {
+  Task task;
+  FatDriver *driver;
+  uint8_t *buffer;
+  uint32_t cluster; // first cluster of the file
+  uint32_t sectors_start;
+  uint32_t sectors_len;
+  bool is_write;
+
+  uint32_t cluster_index;
+  uint32_t sectors_done;
+} FatRwTask;
+
+void fat_rw_task(Task *task);
+
 typedef struct {
   Fs fs;
-  VirtioBlkdev *blkdev;
-  uint8_t buffer[512];
+  BlkDev *blkdev;
+  uint8_t buffer[SECTOR_SIZE];
 } TarDriver;
 
-TarDriver tar_driver_init(VirtioBlkdev *blkdev);
+TarDriver tar_driver_init(BlkDev *blkdev);
 DirEntry tar_find_file(TarDriver *driver, Str name);
 
 #endif
@@ -1,8 +1,9 @@
 #ifndef INCLUDE_VIRTIO
 #define INCLUDE_VIRTIO
 
-// Legacy virtio interface
-// https://docs.oasis-open.org/virtio/virtio/v1.1/csprd01/virtio-v1.1-csprd01.html#x1-220004
+// Drivers are written against VirtioDevice, the transports (legacy virtio-mmio,
+// modern virtio-pci) only differ in how the registers are reached
+// SOURCE: https://docs.oasis-open.org/virtio/virtio/v1.2/virtio-v1.2.html#x1-1080004
 
 #include "common.h"
 
@@ -22,8 +23,22 @@ typedef enum {
   VIRTIO_STATUS_DRIVER = 1 << 1,
   VIRTIO_STATUS_DRIVER_OK = 1 << 2,
   VIRTIO_STATUS_FEAT_OK = 1 << 3,
+  VIRTIO_STATUS_FAILED = 1 << 7,
 } VirtioDeviceStatus;
 
+// Feature bits shared by all the devices
+// SOURCE: https://docs.oasis-open.org/virtio/virtio/v1.2/virtio-v1.2.html#x1-6600006
+#define VIRTIO_RING_F_INDIRECT_DESC ((uint64_t)1 << 28)
+#define VIRTIO_RING_F_EVENT_IDX ((uint64_t)1 << 29)
+#define VIRTIO_F_VERSION_1 ((uint64_t)1 << 32)
+#define VIRTIO_F_RING_PACKED ((uint64_t)1 << 34)
+
+// Offered to every device on top of what the driver asks for,
+// bits can be cleared to try the fallbacks
+uint64_t VIRTIO_RING_FEATURES = VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_RING_F_EVENT_IDX | VIRTIO_F_RING_PACKED;
+
+// Legacy virtio-mmio registers
+// SOURCE: https://docs.oasis-open.org/virtio/virtio/v1.1/csprd01/virtio-v1.1-csprd01.html#x1-220004
 typedef volatile struct { 
   uint32_t magic;
   uint32_t version;
@@ -50,15 +65,23 @@ typedef volatile struct {
   uint32_t status;
   char padding6[140];
   char config[];
-} VirtioDevice;
+} VirtioMmioRegs;
+
+typedef struct VirtioDevice VirtioDevice;
 
-// TODO: 128 would be the bigges power of 2,
-// that make our virtq still fit inside 2 pages
-#define VIRTQ_ENTRY_NUM 16
+// Upper bound of the queue sizes, the device can offer less.
+// NOTE: The sizes are rounded down to a power of 2, which legacy devices
+// require and the ring indices rely on
+#define VIRTQ_MAX_SIZE 1024
+
+// Longest chain that fits in an indirect descriptor table
+#define VIRTQ_INDIRECT_MAX 32
 
 typedef enum {
   VIRTQ_DESC_NEXT = 1,
   VIRTQ_DESC_WRITE = 2,
+  // The buffer is a table of descriptors holding the chain
+  VIRTQ_DESC_INDIRECT = 4,
 } VirtqDescFlags;
 
 typedef struct PACKED {
@@ -68,10 +91,24 @@ typedef struct PACKED {
   uint16_t next;
 } VirtqDesc;
 
+typedef enum {
+  // Asks the device not to interrupt when it uses a buffer, it's only a hint
+  VIRTQ_AVAIL_F_NO_INTERRUPT = 1,
+} VirtqAvailFlags;
+
+typedef enum {
+  // Asks the driver not to notify when it makes a buffer available, it's only a hint
+  VIRTQ_USED_F_NO_NOTIFY = 1,
+} VirtqUsedFlags;
+
+// NOTE: ring has Virtq.size entries, followed by a 16-bit event field.
+// With EVENT_IDX the flags are ignored, the event fields say instead at which
+// index the other side wants to hear from us: used_event after the avail ring,
+// avail_event after the used ring.
 typedef struct PACKED {
   uint16_t flags;
   uint16_t index;
-  uint16_t ring[VIRTQ_ENTRY_NUM];
+  uint16_t ring[];
 } VirtqAvail;
 
 typedef struct PACKED {
@@ -82,22 +119,170 @@ typedef struct PACKED {
 typedef struct PACKED {
   uint16_t flags;
   uint16_t index;
-  VirtqUsedElem ring[VIRTQ_ENTRY_NUM];
+  VirtqUsedElem ring[];
 } VirtqUsed;
 
+// Packed layout (virtio 1.1): the driver makes descriptors available and the
+// device marks them used in the same ring, the flags say which side owns them
+// SOURCE: https://docs.oasis-open.org/virtio/virtio/v1.2/virtio-v1.2.html#x1-720008
+typedef enum {
+  // Set to the driver's wrap counter when available, USED to its inverse
+  VIRTQ_PACKED_DESC_AVAIL = 1 << 7,
+  // Both set to the device's wrap counter when used
+  VIRTQ_PACKED_DESC_USED = 1 << 15,
+} VirtqPackedDescFlags;
+
+typedef struct PACKED {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t id; // buffer id, the same for the whole chain
+  uint16_t flags;
+} VirtqPackedDesc;
+
+typedef enum {
+  VIRTQ_EVENT_ENABLE = 0,
+  VIRTQ_EVENT_DISABLE = 1,
+  // Only with EVENT_IDX, at the descriptor in off_wrap
+  VIRTQ_EVENT_DESC = 2,
+} VirtqEventFlags;
+
+// Event suppression, the driver area is written by the driver,
+// the device area by the device
 typedef struct PACKED {
-  VirtqDesc descs[VIRTQ_ENTRY_NUM];
-  VirtqAvail avail;
-  volatile VirtqUsed used ALIGNED(PAGE_SIZE);
+  uint16_t off_wrap; // ring position, the wrap counter in bit 15
+  uint16_t flags;
+} VirtqEvent;
+
+// The rings and this driver state share one physically contiguous
+// allocation from virtq_create, the state comes after the rings
+typedef struct {
+  // Split layout
+  VirtqDesc *descs;
+  VirtqAvail *avail;
+  volatile VirtqUsed *used;
+
+  // Packed layout
+  volatile VirtqPackedDesc *ring;
+  volatile VirtqEvent *driver_event;
+  volatile VirtqEvent *device_event;
+  uint16_t next_avail; // ring position
+  bool avail_wrap;
+  bool used_wrap;
+  // Indexed by the buffer id: the ring descriptors the chain took while
+  // it's in flight, the next free id otherwise
+  uint16_t *packed_ids;
+  uint16_t free_id;
 
-  // helper variables for constructing descriptor chains
-  uint32_t desc_index;
+  uint16_t size;
+  VirtioDevice *dev;
+  uint16_t index;
+  bool is_packed;
+  bool has_event_idx;
+  bool is_interrupt_disabled;
+  // Avail ring entries (split) or descriptors (packed) since the last notification
+  uint16_t unnotified;
+
+  // Free split descriptors are chained through next
+  uint16_t free_head;
+  uint16_t free_count;
+  // Next used ring entry to pop, the ring position for packed rings
+  uint16_t last_used;
+  // Indexed by the split chain head or the packed buffer id, what was
+  // passed to virtq_add while the chain is in flight
+  void **cookies;
+  // VIRTQ_INDIRECT_MAX descriptors for every chain head, NULL without INDIRECT_DESC
+  VirtqDesc *indirect;
+  // The allocation holding all of the above
+  void *rings;
+  uint32_t rings_pages;
+  // Tasks waiting for the device to use buffers, woken by the interrupt handler
+  WaitQueue waiters;
 } Virtq;
 
-Virtq *virtq_create(VirtioDevice *dev, uint32_t index);
-void virtq_descf(Virtq *vq, void *addr, uint16_t len, bool is_write);
-void virtq_descm(Virtq *vq, void *addr, uint16_t len, bool is_write);
-void virtq_descl(Virtq *vq, void *addr, uint16_t len, bool is_write);
+// One link of a descriptor chain
+typedef struct {
+  void *addr;
+  uint32_t len;
+  bool is_write; // written by the device
+} VirtqBuf;
+
+typedef struct {
+  uint8_t (*get_status)(VirtioDevice *dev);
+  void (*set_status)(VirtioDevice *dev, uint8_t status);
+  uint64_t (*get_features)(VirtioDevice *dev);
+  void (*set_features)(VirtioDevice *dev, uint64_t features);
+  // Biggest size the device supports for the queue, 0 if it doesn't have it
+  uint16_t (*get_queue_size)(VirtioDevice *dev, uint16_t index);
+  // Hands the rings to the device, returns false if it doesn't have the queue
+  bool (*setup_queue)(VirtioDevice *dev, uint16_t index, Virtq *vq);
+  // Optional, gives back what setup_queue took, the device is already reset
+  void (*release_queue)(VirtioDevice *dev, uint16_t index);
+  void (*notify)(VirtioDevice *dev, uint16_t index);
+  // Features the driver has to accept on this transport
+  uint64_t required_features;
+  // Alignment of the used ring, legacy devices take the rings as one block
+  // with the used ring on the next page
+  uint32_t used_align;
+} VirtioTransport;
+
+// Embedded as the first member by the transports
+struct VirtioDevice {
+  const VirtioTransport *transport;
+  VirtioDeviceType type;
+  volatile uint8_t *config; // device specific
+  uint64_t features; // accepted by virtio_begin_init
+};
+
+typedef struct {
+  VirtioDevice dev;
+  VirtioMmioRegs *regs;
+} VirtioMmioDevice;
+
+// Returns false if there is no virtio device at regs
+bool virtio_mmio_init(VirtioMmioDevice *mmio, void *regs);
+
+// Resets the device and negotiates the features, the queues are set up
+// afterwards, then virtio_finish_init. Returns the accepted features.
+// NOTE: VIRTIO_RING_FEATURES are offered for every device
+uint64_t virtio_begin_init(VirtioDevice *dev, uint64_t features);
+void virtio_finish_init(VirtioDevice *dev);
+// The device stops using the queues, it can be set up again with virtio_begin_init
+void virtio_reset(VirtioDevice *dev);
+
+// The queue gets the biggest size up to max_size the device supports, the
+// layout is packed if VIRTIO_F_RING_PACKED was accepted, split otherwise
+Virtq *virtq_create(VirtioDevice *dev, uint32_t index, uint16_t max_size);
+// Frees the queue, the device has to be reset first, it could still be using the rings
+void virtq_destroy(Virtq *vq);
+// For the transports, the addresses of the descriptor, driver and device areas
+void virtq_get_areas(Virtq *vq, uint64_t *out_desc, uint64_t *out_driver, uint64_t *out_device);
+// Tells the device there are new available buffers in the queue, unless it said
+// it doesn't need to know. Batches should be notified once, at the end.
+void virtq_notify(Virtq *vq);
+// Interrupts are a hint, the device can still send them
+void virtq_disable_interrupts(Virtq *vq);
+// Returns false if buffers were used while they were disabled,
+// those won't raise an interrupt
+bool virtq_enable_interrupts(Virtq *vq);
+// Chains the buffers and makes them available, the device is notified separately.
+// With INDIRECT_DESC a chain of up to VIRTQ_INDIRECT_MAX buffers takes only one
+// descriptor of the ring. Returns false if there aren't enough free descriptors.
+// The cookie can't be NULL.
+bool virtq_add(Virtq *vq, const VirtqBuf *bufs, uint32_t count, void *cookie);
+bool virtq_has_used(Virtq *vq);
+// Splits the buffer where it isn't physically contiguous, returns the number
+// of parts or 0 if there are more than limit
+uint32_t virtq_split_buf(VirtqBuf *out_bufs, uint32_t limit, void *addr, uint32_t len, bool is_write);
+// Frees the descriptors of the next used chain and returns its cookie, NULL if there is none
+void *virtq_pop_used(Virtq *vq, uint32_t *out_len);
+// True when no chain is in flight, the used ones have to be popped first
+bool virtq_is_idle(Virtq *vq);
+// Called from the interrupt handler of the device after the used ring moved
+void virtq_handle_interrupt(Virtq *vq);
+// For callers outside of tasks, sleeps until there is a used chain to pop
+void virtq_wait_used(Virtq *vq);
+// Pops until every chain was used, their cookies are dropped
+void virtq_wait_idle(Virtq *vq);
 
 typedef enum {
   VIRTIO_BLK_IN = 0, // read
@@ -110,32 +295,114 @@ typedef struct PACKED {
   uint64_t sector;
 } VirtioBlkReq;
 
-typedef struct BlkDev {
+typedef enum {
+  VIRTIO_BLK_F_SEG_MAX = 2,
+} VirtioBlkFeatures;
+
+typedef enum {
+  VIRTIO_BLK_S_OK = 0,
+  VIRTIO_BLK_S_IOERR = 1,
+  VIRTIO_BLK_S_UNSUPP = 2,
+  // Not written by the device yet
+  VIRTIO_BLK_S_PENDING = 0xff,
+} VirtioBlkStatus;
+
+typedef struct PACKED {
+  uint64_t capacity;
+  uint32_t size_max;
+  uint32_t seg_max;
+} VirtioBlkConfig;
+
+// Data buffers of one request, the header and the status take the rest of an indirect table
+#define VIRTIO_BLK_MAX_SEGMENTS (VIRTQ_INDIRECT_MAX - 2)
+// Requests in flight at once, also limited by the queue size
+#define VIRTIO_BLK_MAX_REQUESTS 128
+
+typedef struct VirtioBlkRequest VirtioBlkRequest;
+typedef void (*VirtioBlkCallback)(VirtioBlkRequest *req);
+
+// Request slot, the header and the status are read and written by the device
+struct VirtioBlkRequest {
+  VirtioBlkReq header;
+  uint8_t status;
+  bool is_done;
+  VirtioBlkCallback callback;
+  void *arg;
+  VirtioBlkRequest *next_free;
+};
+
+typedef struct {
+  BlkDev blk;
   VirtioDevice *dev;
   Virtq *vq;
-  uint32_t sector_capacity;
-  VirtioBlkReq request;
-  uint8_t status;
+  uint32_t seg_max; // data buffers per request
+  VirtioBlkRequest *requests; // in DMA memory
+  VirtioBlkRequest *free_requests;
+  uint32_t request_count;
+  // The request of blk_v1_submit in flight, and the part of its buffer
+  // that goes out once it's done, if it didn't fit into one
+  VirtioBlkRequest *v1_request;
+  uint8_t *v1_buffer;
+  uint32_t v1_sector;
+  uint32_t v1_len;
+  bool v1_is_write;
 } VirtioBlkdev;
+// NOTE: blk only has the v1 interface, filesystems go through a BlkQueue
 
 VirtioBlkdev virtio_blk_init(VirtioDevice *dev);
+// Resets the device and frees the queue and the requests, nothing may be in flight
+void virtio_blk_destroy(VirtioBlkdev *blkdev);
+// Only wakes up the waiters, the requests are completed by virtio_blk_complete
+void virtio_blk_handle_interrupt(void *blkdev);
+// Returns NULL when every request slot or the queue is taken, complete some and try again.
+// With a callback the slot is released after it runs, otherwise wait for virtio_blk_is_done and release it:
+// AWAIT_EVENT(task, &blkdev->vq->waiters, virtio_blk_is_done(blkdev, req)).
+// The buffer doesn't have to be physically contiguous.
+VirtioBlkRequest *virtio_blk_submit(VirtioBlkdev *blkdev, uint8_t *buffer, uint32_t first_sector, uint32_t len,
+    bool is_write, VirtioBlkCallback callback, void *arg);
+// Same with the data spread over several buffers, each a multiple of the sector size.
+// Also NULL if the data takes more than seg_max segments, which never goes through,
+// virtio_blk_max_sectors tells how much of a buffer surely fits
+VirtioBlkRequest *virtio_blk_submitv(VirtioBlkdev *blkdev, const VirtqBuf *data, uint32_t data_count,
+    uint32_t first_sector, bool is_write, VirtioBlkCallback callback, void *arg);
+// Marks the used requests as done and runs their callbacks, returns how many completed.
+// NOTE: Callbacks run in whatever task completes the requests, maybe with interrupts off
+uint32_t virtio_blk_complete(VirtioBlkdev *blkdev);
+bool virtio_blk_is_done(VirtioBlkdev *blkdev, VirtioBlkRequest *req);
+// Returns the status of the done request
+uint8_t virtio_blk_release(VirtioBlkdev *blkdev, VirtioBlkRequest *req);
+// Synchronous version, spins until the request is done
+// Most sectors one request takes from buffer, however it's laid out in physical memory
+uint32_t virtio_blk_max_sectors(VirtioBlkdev *blkdev, const uint8_t *buffer);
+// Any length, the buffer is split into several requests if needed
 void virtio_blk_rw(VirtioBlkdev *blkdev, uint8_t *buffer, uint32_t first_sector, uint32_t len, bool is_write);
 
+// Event buffers kept in the event queue
+#define VIRTIO_INPUT_EVENT_NUM 64
+
 typedef struct InputDev {
   VirtioDevice *dev;
   Virtq *event_queue;
   Virtq *status_queue;
   InputEvent *events;
-  uint16_t processed;
 } VirtioInput;
 
 VirtioInput virtio_input_init(VirtioDevice *dev);
+void virtio_input_handle_interrupt(void *input);
 
 typedef struct GpuDev {
   VirtioDevice *dev;
   Virtq *vq;
   Virtq *cq;
   uint32_t *fb;
+  // NOTE: Commands have to outlive the submission,
+  // so they can't be on the stack of the caller
+  struct VirtioGpuFlush *flush;
 } VirtioGpu;
 
+void virtio_gpu_handle_interrupt(void *gpu);
+void virtio_gpu_submit_flush(VirtioGpu *gpu);
+bool virtio_gpu_is_flushed(VirtioGpu *gpu);
+void virtio_gpu_flush(VirtioGpu *gpu);
+
 #endif
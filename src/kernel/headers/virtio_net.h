@@ -23,18 +23,57 @@ typedef struct {
   uint16_t num_buffers;
 } PACKED VirtioNetHeader;
 
+#define VIRTIO_NET_BUFFER_SIZE 2048
+// Packets handled in one pass before the other tasks get a turn
+#define VIRTIO_NET_POLL_BUDGET 8
+
+// Called for every received packet in polling mode, the packet
+// (without the virtio header) is only valid during the call
+typedef void (*NetRxHandler)(void *arg, uint8_t *packet, uint32_t size);
+
+typedef struct {
+  uint64_t interrupts;
+  uint64_t polls; // passes over the receive queue
+  uint64_t polled_packets;
+} VirtioNetStats;
+
 typedef struct {
+  Task task;
+  struct VirtioNetdev *netdev;
+} VirtioNetPollTask;
+
+typedef struct VirtioNetdev {
   VirtioDevice *dev;
   Virtq *rq;
   Virtq *tq;
   VirtioNetHeader header;
   uint8_t mac[6];
-  uint32_t processed_requests;
-  char *buffers;
+  char *buffers; // VIRTIO_NET_BUFFER_SIZE for every entry of the receive queue
+
+  // Polling mode, set up by virtio_net_start_polling
+  NetRxHandler rx_handler;
+  void *rx_arg;
+  uint32_t poll_budget;
+  VirtioNetPollTask poll;
+  VirtioNetStats stats;
 } VirtioNetdev;
 
 VirtioNetdev virtio_net_init(VirtioDevice *dev);
+void virtio_net_handle_interrupt(void *netdev);
+// Asynchronous version: submit, then AWAIT_EVENT(task, &netdev->tq->waiters, virtio_net_is_sent(netdev)).
+// Packets can be submitted while others are still being sent, they have to stay valid until then.
+void virtio_net_submit(VirtioNetdev *netdev, uint8_t *packet, uint32_t size);
+// Frees the descriptors of the packets that were sent
+void virtio_net_reclaim_sent(VirtioNetdev *netdev);
+// True when every submitted packet was sent
+bool virtio_net_is_sent(VirtioNetdev *netdev);
+void virtio_net_send(VirtioNetdev *netdev, uint8_t *packet, uint32_t size);
+bool virtio_net_can_recv(VirtioNetdev *netdev);
 uint32_t virtio_net_recv(VirtioNetdev *netdev);
 void virtio_net_return_buffer(VirtioNetdev *netdev, uint32_t index);
+// Hands every received packet to handler from a task. After an interrupt the
+// receive interrupts stay off and the queue is polled, poll_budget packets at
+// a time, until it's empty.
+void virtio_net_start_polling(VirtioNetdev *netdev, NetRxHandler handler, void *arg);
 
 #endif
@@ -5,13 +5,96 @@
 
 #define SECTOR_SIZE 512
 
-typedef struct BlkDev BlkDev;
-
 typedef enum {
   BLKDEV_READ = 0,
   BLKDEV_WRITE = 1,
 } BlkDevFlags;
 
-void blk_v1_read_write_sectors(BlkDev *blkdev, void *buffer, uint32_t first_sector, uint32_t len, BlkDevFlags flags);
+typedef struct BlkDev BlkDev;
+
+// Request of the v2 interface, owned by the device until it's done
+typedef struct BlkIo BlkIo;
+struct BlkIo {
+  void *buffer;
+  uint32_t first_sector;
+  uint32_t len;
+  BlkDevFlags flags;
+  bool is_done;
+  bool is_error;
+
+  // Used by the device while the request is in flight
+  BlkIo *next;
+  uint64_t deadline;
+  uint32_t parts; // device requests of a BlkIo that had to be split
+};
+
+// Embedded as the first member by the block device drivers
+struct BlkDev {
+  void (*read_write_sectors)(BlkDev *blkdev, void *buffer, uint32_t first_sector, uint32_t len, BlkDevFlags flags);
+  void (*submit)(BlkDev *blkdev, void *buffer, uint32_t first_sector, uint32_t len, BlkDevFlags flags);
+  bool (*is_done)(BlkDev *blkdev);
+  // Several requests in flight at once
+  void (*submit_io)(BlkDev *blkdev, BlkIo *io);
+  bool (*is_io_done)(BlkDev *blkdev, BlkIo *io);
+  void (*wait_io)(BlkDev *blkdev, BlkIo *io);
+  // Optional, for devices with a request queue
+  void (*plug)(BlkDev *blkdev);
+  void (*unplug)(BlkDev *blkdev);
+  // Woken up when a submitted request completes
+  WaitQueue *waiters;
+  uint32_t sector_capacity;
+};
+
+static inline void blk_v1_read_write_sectors(BlkDev *blkdev, void *buffer, uint32_t first_sector, uint32_t len, BlkDevFlags flags) {
+  blkdev->read_write_sectors(blkdev, buffer, first_sector, len, flags);
+}
+
+// Asynchronous version: submit, then
+// AWAIT_EVENT(task, blk_v1_get_wait_queue(blkdev), blk_v1_is_done(blkdev))
+static inline void blk_v1_submit(BlkDev *blkdev, void *buffer, uint32_t first_sector, uint32_t len, BlkDevFlags flags) {
+  blkdev->submit(blkdev, buffer, first_sector, len, flags);
+}
+
+static inline bool blk_v1_is_done(BlkDev *blkdev) {
+  return blkdev->is_done(blkdev);
+}
+
+static inline WaitQueue *blk_v1_get_wait_queue(BlkDev *blkdev) {
+  return blkdev->waiters;
+}
+
+// The v2 functions are optional, devices without them only take the v1 ones
+static inline bool blk_v2_is_supported(BlkDev *blkdev) {
+  return blkdev->submit_io != NULL;
+}
+
+// Asynchronous version with several requests in flight: submit them, then
+// AWAIT_EVENT(task, blk_v1_get_wait_queue(blkdev), blk_v2_is_done(blkdev, io)) for each
+static inline void blk_v2_submit(BlkDev *blkdev, BlkIo *io) {
+  blkdev->submit_io(blkdev, io);
+}
+
+static inline bool blk_v2_is_done(BlkDev *blkdev, BlkIo *io) {
+  return blkdev->is_io_done(blkdev, io);
+}
+
+// Spins until the request is done
+static inline void blk_v2_wait(BlkDev *blkdev, BlkIo *io) {
+  blkdev->wait_io(blkdev, io);
+}
+
+// Requests submitted while the device is plugged are held back, so they can be merged.
+// They go out once the last plug is removed, the queue fills up or somebody waits on one.
+static inline void blk_v2_plug(BlkDev *blkdev) {
+  if (blkdev->plug) blkdev->plug(blkdev);
+}
+
+static inline void blk_v2_unplug(BlkDev *blkdev) {
+  if (blkdev->unplug) blkdev->unplug(blkdev);
+}
+
+static inline uint32_t blk_v1_get_sector_capacity(BlkDev *blkdev) {
+  return blkdev->sector_capacity;
+}
 
 #endif
@@ -9,4 +9,10 @@ typedef struct GpuDev GpuDev;
 void gpu_v1_get_surface(GpuDev *gpu, Surface *out_surface);
 void gpu_v1_flush(GpuDev *gpu);
 
+// Asynchronous version: submit, then
+// AWAIT_EVENT(task, gpu_v1_get_wait_queue(gpu), gpu_v1_is_flushed(gpu))
+void gpu_v1_submit_flush(GpuDev *gpu);
+bool gpu_v1_is_flushed(GpuDev *gpu);
+WaitQueue *gpu_v1_get_wait_queue(GpuDev *gpu);
+
 #endif
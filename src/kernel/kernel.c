@@ -7,6 +7,8 @@
 #include "strings.c"
 #include "drawing.c"
 #include "print.c"
+#include "task.c"
+#include "deferred_work.c"
 
 #include "hardware/uart.c"
 #include "hardware/virtio.c"
@@ -17,31 +19,92 @@
 
 #include "fs/tar.c"
 #include "fs/fat.c"
+#include "fs/fat_task.c"
 #include "fs/vfs.c"
 #include "networking.c"
 
-void kernel_init(Hardware *hw) {
-  ASSERT(hw->gpu);
-
+// Draws the second disk's first sector, and then the FAT file read next to it
+typedef struct {
+  Task task;
+  Hardware *hw;
   Surface surface;
-  gpu_v1_get_surface(hw->gpu, &surface);
+  FatRwTask *fat_read; // NULL without a FAT32 disk
+  char buffer[SECTOR_SIZE];
+} BootScreenTask;
 
-  for (uint32_t i = 0; i < surface.width * surface.height; ++i) {
-    surface.ptr[i] = bswap32(0x333333ff);
-  }
+void boot_screen_task(Task *task) {
+  BootScreenTask *this = (void *)task;
+  BlkDev *blkdev = this->hw->blk_devices[1];
+  GpuDev *gpu = this->hw->gpu;
 
-  draw_line(&surface, 50, 50, RED, "Hello, World!", -1);
-  draw_line(&surface, 50, 62, GREEN, "Some more strings", -1);
-  draw_line(&surface, 50, 74, BLUE, "Blue text\nsome more", -1);
+  BEGIN_TASK(task);
+  blk_v1_submit(blkdev, this->buffer, 0, 1, BLKDEV_READ);
+  AWAIT_EVENT(task, blk_v1_get_wait_queue(blkdev), blk_v1_is_done(blkdev));
+  draw_line(&this->surface, 50, 100, WHITE, this->buffer, SECTOR_SIZE);
 
+  gpu_v1_submit_flush(gpu);
+  AWAIT_EVENT(task, gpu_v1_get_wait_queue(gpu), gpu_v1_is_flushed(gpu));
 
+  if (this->fat_read) {
+    // NOTE: The read runs on the other disk, nothing wakes us when it ends
+    AWAIT(task, this->fat_read->task.state == TASK_DONE);
+    draw_line(&this->surface, 50, 200, GREEN, (char *)this->fat_read->buffer, SECTOR_SIZE);
+    gpu_v1_submit_flush(gpu);
+    AWAIT_EVENT(task, gpu_v1_get_wait_queue(gpu), gpu_v1_is_flushed(gpu));
+  }
+  END_TASK(task);
+}
+
+void kernel_init(Hardware *hw) {
+  ASSERT(hw->gpu);
   ASSERT(hw->blk_devices_count == 2);
-  char buffer[SECTOR_SIZE];
-  blk_v1_read_write_sectors(&hw->blk_devices[1], buffer, 0, 1, BLKDEV_READ);
 
-  draw_line(&surface, 50, 100, WHITE, buffer, SECTOR_SIZE);
+  // NOTE: Tasks outlive this function
+  static BootScreenTask boot_screen;
+  static FatDriver fat_driver;
+  static FatRwTask fat_read;
+  static uint8_t fat_buffer[SECTOR_SIZE];
+  static DhcpTask dhcp;
+
+  boot_screen = (BootScreenTask){ .hw = hw };
+  Surface *surface = &boot_screen.surface;
+  gpu_v1_get_surface(hw->gpu, surface);
+
+  for (uint32_t i = 0; i < surface->width * surface->height; ++i) {
+    surface->ptr[i] = bswap32(0x333333ff);
+  }
+
+  draw_line(surface, 50, 50, RED, "Hello, World!", -1);
+  draw_line(surface, 50, 62, GREEN, "Some more strings", -1);
+  draw_line(surface, 50, 74, BLUE, "Blue text\nsome more", -1);
 
-  gpu_v1_flush(hw->gpu);
+  // The file lookup is a few sectors of setup, the read itself is a task
+  blk_v1_read_write_sectors(hw->blk_devices[0], fat_buffer, 0, 1, BLKDEV_READ);
+  if (fat_is_fat32(fat_buffer)) {
+    fat_driver = fat_driver_init(hw->blk_devices[0]);
+    DirEntry dir = fat_find_directory_entry(&fat_driver, fat_driver.root_cluster, STR("dir"));
+    DirEntry file = dir.type == ENTRY_DIR
+      ? fat_find_directory_entry(&fat_driver, dir.start, STR("some_long_filename.txt"))
+      : (DirEntry){0};
+    if (file.type == ENTRY_FILE && file.size > SECTOR_SIZE) {
+      fat_read = (FatRwTask){
+        .driver = &fat_driver,
+        .buffer = fat_buffer,
+        .cluster = file.start,
+        .sectors_start = 1,
+        .sectors_len = 1,
+      };
+      task_spawn(&TASKS, &fat_read.task, fat_rw_task);
+      boot_screen.fat_read = &fat_read;
+    }
+  }
+
+  // The disk reads, the flushes and the DHCP exchange overlap
+  task_spawn(&TASKS, &boot_screen.task, boot_screen_task);
+  if (hw->netdev) {
+    dhcp = (DhcpTask){ .netdev = hw->netdev };
+    task_spawn(&TASKS, &dhcp.task, net_dhcp_task);
+  }
 
   for (uint32_t i = 0; i < hw->input_devices_count; ++i) {
     char buffer[128 + 1];
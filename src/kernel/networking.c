@@ -322,8 +322,8 @@ void net_dhcp_request(VirtioNetdev *netdev) {
 
   {
     uint32_t index = virtio_net_recv(netdev);
-    VirtioNetHeader *header = (void *)(netdev->buffers + 2048 * index);
-    void *packet = netdev->buffers + 2048 * index + sizeof(*header);
+    VirtioNetHeader *header = (void *)(netdev->buffers + VIRTIO_NET_BUFFER_SIZE * index);
+    void *packet = netdev->buffers + VIRTIO_NET_BUFFER_SIZE * index + sizeof(*header);
     net_handle_dhcp_offer(packet, &sender, &dhcp_server);
     ASSERT(sender.ip == CLIENT_IP);
     ASSERT(dhcp_server.ip == SERVER_IP);
@@ -335,9 +335,49 @@ void net_dhcp_request(VirtioNetdev *netdev) {
 
   {
     uint32_t index = virtio_net_recv(netdev);
-    VirtioNetHeader *header = (void *)(netdev->buffers + 2048 * index);
-    void *packet = netdev->buffers + 2048 * index + sizeof(*header);
+    VirtioNetHeader *header = (void *)(netdev->buffers + VIRTIO_NET_BUFFER_SIZE * index);
+    void *packet = netdev->buffers + VIRTIO_NET_BUFFER_SIZE * index + sizeof(*header);
     net_handle_dhcp_ack(packet, &sender, &dhcp_server);
     virtio_net_return_buffer(netdev, index);
   }
 }
+
+// Payload of the next received packet, after the virtio header
+void *net_packet_at(VirtioNetdev *netdev, uint32_t index) {
+  return netdev->buffers + VIRTIO_NET_BUFFER_SIZE * index + sizeof(VirtioNetHeader);
+}
+
+void net_dhcp_task(Task *task) {
+  DhcpTask *this = (void *)task;
+  VirtioNetdev *netdev = this->netdev;
+
+  BEGIN_TASK(task);
+  this->buffer = (void *)alloc_pages(1);
+  this->dhcp_server = (NetCon){ this->dhcp_mac, 0, 0 };
+  this->sender = (NetCon){ netdev->mac, 0, 0 };
+
+  net_packet_dhcp_discover(this->buffer, netdev->mac);
+  virtio_net_submit(netdev, this->buffer, NET_SIZE_DHCP);
+  AWAIT_EVENT(task, &netdev->tq->waiters, virtio_net_is_sent(netdev));
+
+  AWAIT_EVENT(task, &netdev->rq->waiters, virtio_net_can_recv(netdev));
+  {
+    uint32_t index = virtio_net_recv(netdev);
+    net_handle_dhcp_offer(net_packet_at(netdev, index), &this->sender, &this->dhcp_server);
+    ASSERT(this->sender.ip == CLIENT_IP);
+    ASSERT(this->dhcp_server.ip == SERVER_IP);
+    virtio_net_return_buffer(netdev, index);
+  }
+
+  net_packet_dhcp_request(this->buffer, this->sender, this->dhcp_server);
+  virtio_net_submit(netdev, this->buffer, NET_SIZE_DHCP);
+  AWAIT_EVENT(task, &netdev->tq->waiters, virtio_net_is_sent(netdev));
+
+  AWAIT_EVENT(task, &netdev->rq->waiters, virtio_net_can_recv(netdev));
+  {
+    uint32_t index = virtio_net_recv(netdev);
+    net_handle_dhcp_ack(net_packet_at(netdev, index), &this->sender, &this->dhcp_server);
+    virtio_net_return_buffer(netdev, index);
+  }
+  END_TASK(task);
+}
@@ -0,0 +1,51 @@
+#include "cmn/lib.h"
+#include "common.h"
+#include "arch.h"
+
+// Block device backed by memory, for the ramdisk loaded by the bootloader
+
+void ramdisk_read_write_sectors(BlkDev *blkdev, void *buffer, uint32_t first_sector, uint32_t len, BlkDevFlags flags) {
+  RamDisk *ramdisk = (void *)blkdev;
+  // TODO: It should be an error
+  ASSERT(first_sector + len <= blkdev->sector_capacity);
+  uint8_t *sectors = ramdisk->ptr + (size_t)first_sector * SECTOR_SIZE;
+  if (flags & BLKDEV_WRITE) memcpy(sectors, buffer, len * SECTOR_SIZE);
+  else memcpy(buffer, sectors, len * SECTOR_SIZE);
+}
+
+bool ramdisk_is_done(BlkDev *blkdev) {
+  return true;
+}
+
+void ramdisk_submit_io(BlkDev *blkdev, BlkIo *io) {
+  ramdisk_read_write_sectors(blkdev, io->buffer, io->first_sector, io->len, io->flags);
+  io->is_done = true;
+  io->is_error = false;
+}
+
+bool ramdisk_is_io_done(BlkDev *blkdev, BlkIo *io) {
+  return io->is_done;
+}
+
+void ramdisk_wait_io(BlkDev *blkdev, BlkIo *io) {
+  ASSERT(io->is_done);
+}
+
+// NOTE: The waiters pointer makes the struct immovable, so it's set up in place
+void ramdisk_init(RamDisk *ramdisk, void *ptr, size_t size) {
+  ASSERT(size % SECTOR_SIZE == 0);
+  *ramdisk = (RamDisk){
+    .blk = {
+      .read_write_sectors = ramdisk_read_write_sectors,
+      // NOTE: Copies finish right away, there is nothing to wait for
+      .submit = ramdisk_read_write_sectors,
+      .is_done = ramdisk_is_done,
+      .submit_io = ramdisk_submit_io,
+      .is_io_done = ramdisk_is_io_done,
+      .wait_io = ramdisk_wait_io,
+      .waiters = &ramdisk->waiters,
+      .sector_capacity = size / SECTOR_SIZE,
+    },
+    .ptr = ptr,
+  };
+}
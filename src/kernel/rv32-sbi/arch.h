@@ -2,11 +2,35 @@
 #define INCLUDE_RV32_ARCH
 
 #include "common.h"
+#include "cmn/ring.h"
 
 extern char BSS_START[], BSS_END[], STACK_TOP[];
 extern char HEAP_START[], HEAP_END[], KERNEL_BASE[];
 
 #define WFI() __asm__ __volatile__ ("wfi")
+
+#define SSTATUS_SIE (1 << 1)
+
+// Returns the previous interrupt state for irq_restore
+static inline size_t irq_save(void) {
+  size_t sstatus;
+  __asm__ __volatile__("csrrci %0, sstatus, %1" : "=r"(sstatus) : "i"(SSTATUS_SIE) : "memory");
+  return sstatus;
+}
+
+static inline void irq_restore(size_t sstatus) {
+  if (sstatus & SSTATUS_SIE) __asm__ __volatile__("csrsi sstatus, %0" :: "i"(SSTATUS_SIE) : "memory");
+}
+
+static inline void irq_enable(void) {
+  __asm__ __volatile__("csrsi sstatus, %0" :: "i"(SSTATUS_SIE) : "memory");
+}
+
+// Called with interrupts disabled, returns once one is pending.
+// NOTE: wfi wakes up on a pending interrupt even when they are disabled
+static inline void wait_for_interrupt(void) {
+  WFI();
+}
 #define PAGE_SIZE 4096
 
 // src/uart.c
@@ -49,13 +73,50 @@ typedef enum {
 } PageEntryFlags;
 
 paddr_t alloc_pages(uint32_t count);
+
+// Memory for devices, physical and virtual addresses are the same
+static inline void *alloc_dma_pages(uint32_t count) {
+  return (void *)alloc_pages(count);
+}
+
+// NOTE: The page allocator can't free yet, the pages leak
+static inline void free_dma_pages(void *ptr, uint32_t count) {}
+
+static inline uint64_t dma_address(void *ptr) {
+  return (size_t)ptr;
+}
 void map_page(uint32_t *table1, vaddr_t vaddr, paddr_t paddr, uint32_t flags);
 
 volatile uint8_t * const UART = (void *)0x10000000;
 const uint32_t UART_INT = 10;
 
+// NOTE: QEMU virt machine, device N is at VIRTIO_MMIO_START + N * 0x1000
+// and raises PLIC interrupt VIRTIO_INTERRUPT_START + N
 const uint32_t VIRTIO_MMIO_START = 0x10001000;
-const uint32_t VIRTIO_INTERRUPT_START = 0;
+const uint32_t VIRTIO_INTERRUPT_START = 1;
 const uint32_t VIRTIO_COUNT = 7;
 
+// Runs in the interrupt handler, after the device interrupt was acknowledged
+typedef void (*IrqHandler)(void *arg);
+
+typedef struct {
+  IrqHandler handler;
+  void *arg;
+} IrqVector;
+
+#define MAX_VIRTIO_DEVICES 8
+IrqVector VIRTIO_IRQS[MAX_VIRTIO_DEVICES];
+
+// NOTE: Nested traps would overwrite sepc and sstatus, so the deferred
+// work runs from the main loop instead of the end of the interrupt
+DeferredWorkQueue DEFERRED_WORK;
+
+#define UART_INPUT_SIZE 64 // power of 2
+uint8_t UART_INPUT_BUFFER[UART_INPUT_SIZE];
+// Pushed by the interrupt handler, popped by the deferred work
+SpscRing UART_INPUT = SPSC_RING_INIT(UART_INPUT_BUFFER);
+
+void echo_uart_input(DeferredWork *work);
+DeferredWork UART_ECHO_WORK = { .run = echo_uart_input };
+
 #endif
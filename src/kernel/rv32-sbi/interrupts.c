@@ -47,35 +47,47 @@ void report_exception(uint32_t cause, uint32_t val, uint32_t epc) {
   }
 }
 
+void echo_uart_char(int ch) {
+  printf("char: '%c', %d\n", ch, ch);
+  switch (ch) {
+    case 13: {
+      putchar(10);
+    } break;
+    case 127: {
+      putchar(8);
+      putchar(' ');
+      putchar(8);
+    } break;
+    default: {
+      putchar(ch);
+    } break;
+  }
+}
+
+void echo_uart_input(DeferredWork *work) {
+  uint8_t chars[16];
+  uint32_t count;
+  while ((count = spsc_ring_pop_batch(&UART_INPUT, chars, sizeof(chars)))) {
+    for (uint32_t i = 0; i < count; ++i) echo_uart_char(chars[i]);
+  }
+}
+
 void handle_external_interrupt(uint32_t id) {
   if ((id - VIRTIO_INTERRUPT_START) < VIRTIO_COUNT) {
-    VirtioDevice *dev = (void *)(VIRTIO_MMIO_START + id * 0x1000);
-    uint32_t status = dev->interrupt_status;
-    // TODO: Devices specific interrupt handling
-    switch (dev->device) {
-      case VIRTIO_DEVICE_GPU: {
-        LOG("Gpu interrupt", 0);
-      } break;
-      default: break;
-    }
-    dev->interrupt_ack = status;
+    uint32_t index = id - VIRTIO_INTERRUPT_START;
+    VirtioMmioRegs *regs = (void *)(VIRTIO_MMIO_START + index * 0x1000);
+    // NOTE: Acknowledged first, so the buffers used while the handler runs
+    // raise another interrupt instead of getting lost
+    uint32_t status = regs->interrupt_status;
+    regs->interrupt_ack = status;
+    IrqVector *irq = &VIRTIO_IRQS[index];
+    if (irq->handler) irq->handler(irq->arg);
     return;
   } else if (id == UART_INT) {
-    int ch = *UART;
-    printf("char: '%c', %d\n", ch, ch);
-    switch (ch) {
-      case 13: {
-        putchar(10);
-      } break;
-      case 127: {
-        putchar(8);
-        putchar(' ');
-        putchar(8);
-      } break;
-      default: {
-        putchar(ch);
-      } break;
-    }
+    // Reading the character clears the interrupt, it's lost if the ring is full
+    uint8_t ch = *UART;
+    spsc_ring_push(&UART_INPUT, &ch);
+    defer_work(&DEFERRED_WORK, &UART_ECHO_WORK);
   } else {
     PANIC("Unknown supervisor external interrupt %d", id);
   }
@@ -98,7 +110,7 @@ void handle_supervisor_interrupt(void) {
         PANIC("Supervisor software interrupt", 0);
       } break;
       case 5: {
-        printf("Timer\n");
+        task_runtime_tick(&TASKS);
         uint64_t time;
         __asm__ __volatile__("rdtime %0" : "=r"(time));
         sbi_set_timer(time + 10000000);
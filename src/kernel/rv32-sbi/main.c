@@ -11,7 +11,7 @@
 #include "kernel.c"
 
 // TODO: setup proper memory handling and allocators
-// TODO: task system, processes
+// TODO: processes
 // TODO: Basic automated testing with qemu
 
 void uart_putchar(char ch) {
@@ -58,21 +58,31 @@ void kernel_main(Hardware **hardware) {
   uint32_t input_devices_len = 0;
 
   VirtioGpu gpu = {0};
+  VirtioNetdev netdev = {0};
 
 #define MAX_BLK_DEVICES 8
   static VirtioBlkdev blk_devices[MAX_BLK_DEVICES] = {0};
+  static BlkDev *blk_device_ptrs[MAX_BLK_DEVICES] = {0};
   uint32_t blk_devices_len = 0;
 
+  static VirtioMmioDevice virtio_devices[MAX_VIRTIO_DEVICES] = {0};
+
+  // NOTE: The devices get interrupts before their init, the drivers
+  // sleep until the device is done with the setup commands
+  plic_set_threshold(0);
+
   // TODO: Automatic virtio device detection and handling
+  ASSERT(VIRTIO_COUNT <= MAX_VIRTIO_DEVICES);
   for (uint32_t i = 0; i < VIRTIO_COUNT; ++i) {
     uint32_t dev_addr = VIRTIO_MMIO_START + i * 0x1000;
-    VirtioDevice *dev = (void *)dev_addr;
-    if (dev->magic != VIRTIO_MAGIC) continue;
-    if (dev->version != 1) {
-      LOG("Virtio device with uknown version %d, at address 0x%x\n", dev->version, dev_addr);
+    VirtioMmioRegs *regs = (void *)dev_addr;
+    if (regs->magic != VIRTIO_MAGIC) continue;
+    if (!virtio_mmio_init(&virtio_devices[i], regs)) {
+      LOG("Virtio device with uknown version %d, at address 0x%x\n", regs->version, dev_addr);
       continue;
     }
-    switch (dev->device) {
+    VirtioDevice *dev = &virtio_devices[i].dev;
+    switch (dev->type) {
       case VIRTIO_DEVICE_NONE: {
         continue;
       } break;
@@ -82,38 +92,51 @@ void kernel_main(Hardware **hardware) {
           LOG("Not enough slots for virtio blokdev, len=%d", input_devices_len);
           break;
         }
-        input_devices[input_devices_len++] = virtio_input_init(dev);
+        VirtioInput *input = &input_devices[input_devices_len++];
+        *input = virtio_input_init(dev);
+        VIRTIO_IRQS[i] = (IrqVector){ virtio_input_handle_interrupt, input };
         plic_enablep(VIRTIO_INTERRUPT_START + i, 3);
         LOG("Connected virtio_input at address 0x%x\n", dev_addr);
       } break;
       case VIRTIO_DEVICE_GPU: {
         ASSERT(gpu.dev == NULL);
+        plic_enablep(VIRTIO_INTERRUPT_START + i, 3);
         gpu = virtio_gpu_init(dev);
-        // plic_enablep(VIRTIO_INTERRUPT_START + i, 3);
+        VIRTIO_IRQS[i] = (IrqVector){ virtio_gpu_handle_interrupt, &gpu };
         LOG("Connected virtio_gpu at address 0x%x\n", dev_addr);
       } break;
+      case VIRTIO_DEVICE_NET: {
+        ASSERT(netdev.dev == NULL);
+        netdev = virtio_net_init(dev);
+        VIRTIO_IRQS[i] = (IrqVector){ virtio_net_handle_interrupt, &netdev };
+        plic_enablep(VIRTIO_INTERRUPT_START + i, 3);
+        LOG("Connected virtio_net at address 0x%x\n", dev_addr);
+      } break;
       case VIRTIO_DEVICE_BLK: {
         if (blk_devices_len >= MAX_BLK_DEVICES) {
           LOG("Not enough slots for virtio blokdev, len=%d", blk_devices_len);
           break;
         }
-        blk_devices[blk_devices_len++] = virtio_blk_init(dev);
-        // plic_enablep(VIRTIO_INTERRUPT_START + i, 3);
+        VirtioBlkdev *blkdev = &blk_devices[blk_devices_len];
+        blk_device_ptrs[blk_devices_len++] = &blkdev->blk;
+        *blkdev = virtio_blk_init(dev);
+        VIRTIO_IRQS[i] = (IrqVector){ virtio_blk_handle_interrupt, blkdev };
+        plic_enablep(VIRTIO_INTERRUPT_START + i, 3);
         LOG("Connected virito_blkdev at address 0x%x\n", dev_addr);
       } break;
       default: {
-        LOG("Unknown virtio device type %d, at address 0x%x\n", dev->device, dev_addr);
+        LOG("Unknown virtio device type %d, at address 0x%x\n", dev->type, dev_addr);
       } break;
     }
   }
-  plic_set_threshold(0);
 
   Hardware hw = {
     .gpu = &gpu,
-    .blk_devices = blk_devices,
+    .blk_devices = blk_device_ptrs,
     .blk_devices_count = blk_devices_len,
     .input_devices = input_devices,
     .input_devices_count = input_devices_len,
+    .netdev = netdev.dev ? &netdev : NULL,
   };
 
   // sbi_set_timer(0);
@@ -122,7 +145,9 @@ void kernel_main(Hardware **hardware) {
 
   kernel_init(&hw);
   for (;;) {
-    __asm__ __volatile__("wfi");
+    bool has_work = run_deferred_work(&DEFERRED_WORK);
+    if (run_tasks(&TASKS)) has_work = true;
+    if (!has_work) WFI();
     kernel_update(&hw);
   }
 }
@@ -1,17 +1,130 @@
+#include "cmn/lib.h"
+#include "common.h"
+#include "arch.h"
 
-#include <stdint.h>
-#define BEGIN_TASK() switch (task->_pc) { case 0:
-#define END_TASK() }
-#define YIELD() task->_pc = __LINE__; return; case __LINE__:
+TaskRuntime TASKS = {0};
 
-typedef struct {
-  uint32_t _pc;
-} SimpleTask;
+// NOTE: Queues are touched from interrupt handlers (wakeups, timer ticks),
+// every modification happens with interrupts disabled
 
-void run_simple_task(SimpleTask *task) {
-  BEGIN_TASK();
+void task_queue_push(TaskQueue *queue, Task *task) {
+  task->next = NULL;
+  if (queue->last) queue->last->next = task;
+  else queue->first = task;
+  queue->last = task;
+}
+
+Task *task_queue_pop(TaskQueue *queue) {
+  Task *task = queue->first;
+  if (!task) return NULL;
+  queue->first = task->next;
+  if (!queue->first) queue->last = NULL;
+  task->next = NULL;
+  return task;
+}
+
+void make_ready(TaskRuntime *rt, Task *task) {
+  task->state = TASK_READY;
+  task_queue_push(&rt->ready, task);
+}
+
+void task_spawn(TaskRuntime *rt, Task *task, TaskFn run) {
+  *task = (Task){ .run = run };
+  size_t irq = irq_save();
+  make_ready(rt, task);
+  irq_restore(irq);
+}
+
+void task_wake(TaskRuntime *rt, Task *task) {
+  size_t irq = irq_save();
+  if (task->state == TASK_WAITING) make_ready(rt, task);
+  irq_restore(irq);
+}
+
+void task_wait(Task *task, WaitQueue *wq) {
+  size_t irq = irq_save();
+  task->state = TASK_WAITING;
+  task->wait_reason = WAIT_EVENT;
+  task_queue_push(wq, task);
+  irq_restore(irq);
+}
+
+void task_poll(TaskRuntime *rt, Task *task) {
+  size_t irq = irq_save();
+  task->state = TASK_WAITING;
+  task->wait_reason = WAIT_POLL;
+  task_queue_push(&rt->polling, task);
+  irq_restore(irq);
+}
+
+void task_sleep(TaskRuntime *rt, Task *task, uint64_t ticks) {
+  size_t irq = irq_save();
+  task->state = TASK_WAITING;
+  task->wait_reason = WAIT_TIMER;
+  task->deadline = rt->ticks + ticks;
+
+  Task **link = &rt->timers;
+  while (*link && (*link)->deadline <= task->deadline) link = &(*link)->next;
+  task->next = *link;
+  *link = task;
+  irq_restore(irq);
+}
+
+void wake_one(TaskRuntime *rt, WaitQueue *wq) {
+  size_t irq = irq_save();
+  Task *task = task_queue_pop(wq);
+  if (task) make_ready(rt, task);
+  irq_restore(irq);
+}
+
+void wake_all(TaskRuntime *rt, WaitQueue *wq) {
+  size_t irq = irq_save();
+  Task *task;
+  while ((task = task_queue_pop(wq))) make_ready(rt, task);
+  irq_restore(irq);
+}
+
+void task_runtime_tick(TaskRuntime *rt) {
+  size_t irq = irq_save();
+  rt->ticks++;
+  while (rt->timers && rt->timers->deadline <= rt->ticks) {
+    Task *task = rt->timers;
+    rt->timers = task->next;
+    make_ready(rt, task);
+  }
+  irq_restore(irq);
+}
+
+bool run_tasks(TaskRuntime *rt) {
+  size_t irq = irq_save();
+  Task *batch = rt->ready.first;
+  rt->ready = (TaskQueue){0};
+  bool has_work = batch != NULL;
+
+  // Polling tasks get another look on every pass
+  Task *task;
+  while ((task = task_queue_pop(&rt->polling))) {
+    task->next = batch;
+    task->state = TASK_READY;
+    batch = task;
+  }
+  irq_restore(irq);
 
+  while (batch) {
+    task = batch;
+    batch = batch->next;
+    task->next = NULL;
+    task->wait_reason = WAIT_NONE;
 
+    task->run(task);
 
-  END_TASK();
+    // NOTE: A task that parked itself might already be woken up and queued
+    // again by an interrupt, only requeue the ones that yielded
+    if (task->state == TASK_READY && task->wait_reason == WAIT_NONE) {
+      irq = irq_save();
+      task_queue_push(&rt->ready, task);
+      irq_restore(irq);
+    }
+  }
+  return has_work;
 }
@@ -1,39 +1,507 @@
 #include "common.h"
 #include "virtio.h"
 
-Virtq *virtq_create(VirtioDevice *dev, uint32_t index) {
-  Virtq *vq = (void *)alloc_pages(2);
-  dev->queue_sel = index;
-  dev->queue_num = VIRTQ_ENTRY_NUM;
-  dev->queue_align = 0;
-  dev->queue_pfn = (uint32_t)vq;
-  return vq;
+uint8_t virtio_mmio_get_status(VirtioDevice *dev) {
+  VirtioMmioDevice *mmio = (void *)dev;
+  return mmio->regs->status;
 }
 
-extern inline void virtq_descf(Virtq *vq, void *addr, uint16_t len, bool is_write) {
-  vq->avail.ring[vq->avail.index++ % VIRTQ_ENTRY_NUM] = vq->desc_index;
-  vq->descs[vq->desc_index++] = (VirtqDesc){
-    .addr = (uint32_t)addr,
-    .len = len,
-    .flags = (is_write << 1) | VIRTQ_DESC_NEXT,
-    .next = vq->desc_index,
-  };
+void virtio_mmio_set_status(VirtioDevice *dev, uint8_t status) {
+  VirtioMmioDevice *mmio = (void *)dev;
+  mmio->regs->status = status;
+}
+
+// NOTE: Legacy devices only have 32 feature bits
+uint64_t virtio_mmio_get_features(VirtioDevice *dev) {
+  VirtioMmioDevice *mmio = (void *)dev;
+  mmio->regs->host_features_sel = 0;
+  return mmio->regs->host_features;
+}
+
+void virtio_mmio_set_features(VirtioDevice *dev, uint64_t features) {
+  VirtioMmioDevice *mmio = (void *)dev;
+  mmio->regs->guest_features_sel = 0;
+  mmio->regs->guest_features = features;
+}
+
+uint16_t virtio_mmio_get_queue_size(VirtioDevice *dev, uint16_t index) {
+  VirtioMmioRegs *regs = ((VirtioMmioDevice *)dev)->regs;
+  regs->queue_sel = index;
+  // NOTE: A queue that is already in use can't be set up again
+  if (regs->queue_pfn) return 0;
+  return MIN(regs->queue_num_max, 0xFFFF);
+}
+
+bool virtio_mmio_setup_queue(VirtioDevice *dev, uint16_t index, Virtq *vq) {
+  VirtioMmioRegs *regs = ((VirtioMmioDevice *)dev)->regs;
+  regs->queue_sel = index;
+  if (regs->queue_num_max < vq->size) return false;
+  // NOTE: Packed rings need VERSION_1, which legacy devices can't offer
+  ASSERT(!vq->is_packed);
+  // The rings are laid out in one block starting with the descriptors
+  uint64_t addr = dma_address(vq->descs);
+  ASSERT(addr % PAGE_SIZE == 0);
+  regs->guest_page_size = PAGE_SIZE;
+  regs->queue_num = vq->size;
+  regs->queue_align = PAGE_SIZE;
+  regs->queue_pfn = addr / PAGE_SIZE;
+  return true;
 }
 
-extern inline void virtq_descm(Virtq *vq, void *addr, uint16_t len, bool is_write) {
-  vq->descs[vq->desc_index++] = (VirtqDesc){
-    .addr = (uint32_t)addr,
-    .len = len,
-    .flags = (is_write << 1) | VIRTQ_DESC_NEXT,
-    .next = vq->desc_index,
+void virtio_mmio_notify(VirtioDevice *dev, uint16_t index) {
+  VirtioMmioDevice *mmio = (void *)dev;
+  mmio->regs->queue_notify = index;
+}
+
+const VirtioTransport VIRTIO_MMIO_TRANSPORT = {
+  .get_status = virtio_mmio_get_status,
+  .set_status = virtio_mmio_set_status,
+  .get_features = virtio_mmio_get_features,
+  .set_features = virtio_mmio_set_features,
+  .get_queue_size = virtio_mmio_get_queue_size,
+  .setup_queue = virtio_mmio_setup_queue,
+  .notify = virtio_mmio_notify,
+  .used_align = PAGE_SIZE,
+};
+
+bool virtio_mmio_init(VirtioMmioDevice *mmio, void *regs_ptr) {
+  VirtioMmioRegs *regs = regs_ptr;
+  if (regs->magic != VIRTIO_MAGIC || regs->version != 1) return false;
+  *mmio = (VirtioMmioDevice){
+    .dev = {
+      .transport = &VIRTIO_MMIO_TRANSPORT,
+      .type = regs->device,
+      .config = (volatile uint8_t *)regs->config,
+    },
+    .regs = regs,
   };
+  return true;
+}
+
+// SOURCE: https://docs.oasis-open.org/virtio/virtio/v1.2/virtio-v1.2.html#x1-1070001
+void virtio_reset(VirtioDevice *dev) {
+  const VirtioTransport *t = dev->transport;
+  t->set_status(dev, 0);
+  // NOTE: The reset is done once the device reads back 0
+  while (t->get_status(dev) != 0) {}
+}
+
+uint64_t virtio_begin_init(VirtioDevice *dev, uint64_t features) {
+  const VirtioTransport *t = dev->transport;
+  virtio_reset(dev);
+  t->set_status(dev, VIRTIO_STATUS_ACK);
+  t->set_status(dev, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+  uint64_t device_features = t->get_features(dev);
+  ASSERT((device_features & t->required_features) == t->required_features);
+  features |= t->required_features | VIRTIO_RING_FEATURES;
+  features &= device_features;
+  t->set_features(dev, features);
+
+  uint8_t status = VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEAT_OK;
+  t->set_status(dev, status);
+  // The device clears FEAT_OK if it doesn't like the subset
+  if (!(t->get_status(dev) & VIRTIO_STATUS_FEAT_OK)) {
+    t->set_status(dev, status | VIRTIO_STATUS_FAILED);
+    TRAP();
+  }
+  dev->features = features;
+  return features;
 }
 
-extern inline void virtq_descl(Virtq *vq, void *addr, uint16_t len, bool is_write) {
-  vq->descs[vq->desc_index++] = (VirtqDesc){
-    .addr = (uint32_t)addr,
-    .len = len,
-    .flags = is_write << 1,
-    .next = 0,
+void virtio_finish_init(VirtioDevice *dev) {
+  const VirtioTransport *t = dev->transport;
+  t->set_status(dev, t->get_status(dev) | VIRTIO_STATUS_DRIVER_OK);
+}
+
+// SOURCE: https://docs.oasis-open.org/virtio/virtio/v1.2/virtio-v1.2.html#x1-380006
+// SOURCE: https://docs.oasis-open.org/virtio/virtio/v1.2/virtio-v1.2.html#x1-720008
+Virtq *virtq_create(VirtioDevice *dev, uint32_t index, uint16_t max_size) {
+  const VirtioTransport *t = dev->transport;
+  uint32_t size = MIN(t->get_queue_size(dev, index), MIN(max_size, VIRTQ_MAX_SIZE));
+  // TODO: It should be an error
+  ASSERT(size);
+  // Keep only the highest bit
+  while (size & (size - 1)) size &= size - 1;
+
+  // The descriptors come first, page aligned. For split rings the driver area
+  // is the avail ring and the device area the used ring, both end with a 16-bit
+  // event field. Packed rings only have the event suppression structures.
+  bool is_packed = dev->features & VIRTIO_F_RING_PACKED;
+  size_t driver_offset, device_offset, state_offset;
+  if (is_packed) {
+    driver_offset = sizeof(VirtqPackedDesc) * size;
+    device_offset = driver_offset + sizeof(VirtqEvent);
+    state_offset = ALIGN_UP(device_offset + sizeof(VirtqEvent), 16);
+  } else {
+    driver_offset = sizeof(VirtqDesc) * size;
+    device_offset = ALIGN_UP(driver_offset + sizeof(VirtqAvail) + sizeof(uint16_t) * (size + 1), t->used_align);
+    state_offset = ALIGN_UP(device_offset + sizeof(VirtqUsed) + sizeof(VirtqUsedElem) * size + sizeof(uint16_t), 16);
+  }
+  size_t cookies_offset = state_offset + ALIGN_UP(sizeof(Virtq), sizeof(void *));
+  size_t ids_offset = cookies_offset + sizeof(void *) * size;
+  size_t indirect_offset = ALIGN_UP(ids_offset + (is_packed ? sizeof(uint16_t) * size : 0), 16);
+  bool has_indirect = dev->features & VIRTIO_RING_F_INDIRECT_DESC;
+  size_t total_size = indirect_offset + (has_indirect ? sizeof(VirtqDesc) * VIRTQ_INDIRECT_MAX * size : 0);
+  uint32_t rings_pages = (total_size + PAGE_SIZE - 1) / PAGE_SIZE;
+  uint8_t *rings = alloc_dma_pages(rings_pages);
+
+  Virtq *vq = (void *)(rings + state_offset);
+  *vq = (Virtq){
+    .size = size,
+    .dev = dev,
+    .index = index,
+    .is_packed = is_packed,
+    .has_event_idx = dev->features & VIRTIO_RING_F_EVENT_IDX,
+    .free_count = size,
+    .cookies = (void *)(rings + cookies_offset),
+    .indirect = has_indirect ? (void *)(rings + indirect_offset) : NULL,
+    .rings = rings,
+    .rings_pages = rings_pages,
   };
+  if (is_packed) {
+    vq->ring = (void *)rings;
+    vq->driver_event = (void *)(rings + driver_offset);
+    vq->device_event = (void *)(rings + device_offset);
+    vq->avail_wrap = true;
+    vq->used_wrap = true;
+    vq->packed_ids = (void *)(rings + ids_offset);
+    for (uint32_t i = 0; i + 1 < size; ++i) vq->packed_ids[i] = i + 1;
+    // NOTE: The split used event starts at 0 too, but here the zeroed flags mean any descriptor
+    if (vq->has_event_idx) {
+      vq->driver_event->off_wrap = 1 << 15;
+      vq->driver_event->flags = VIRTQ_EVENT_DESC;
+    }
+  } else {
+    vq->descs = (void *)rings;
+    vq->avail = (void *)(rings + driver_offset);
+    vq->used = (void *)(rings + device_offset);
+    for (uint32_t i = 0; i + 1 < size; ++i) vq->descs[i].next = i + 1;
+  }
+
+  bool has_queue = t->setup_queue(dev, index, vq);
+  // TODO: It should be an error
+  ASSERT(has_queue);
+  return vq;
+}
+
+void virtq_destroy(Virtq *vq) {
+  const VirtioTransport *t = vq->dev->transport;
+  if (t->release_queue) t->release_queue(vq->dev, vq->index);
+  // NOTE: vq lives in the allocation too
+  free_dma_pages(vq->rings, vq->rings_pages);
+}
+
+void virtq_get_areas(Virtq *vq, uint64_t *out_desc, uint64_t *out_driver, uint64_t *out_device) {
+  if (vq->is_packed) {
+    *out_desc = dma_address((void *)vq->ring);
+    *out_driver = dma_address((void *)vq->driver_event);
+    *out_device = dma_address((void *)vq->device_event);
+  } else {
+    *out_desc = dma_address(vq->descs);
+    *out_driver = dma_address(vq->avail);
+    *out_device = dma_address((void *)vq->used);
+  }
+}
+
+// Written by the driver, the device interrupts once the used index moves past it
+volatile uint16_t *virtq_used_event(Virtq *vq) {
+  return (volatile uint16_t *)((uint8_t *)vq->avail + sizeof(VirtqAvail) + sizeof(uint16_t) * vq->size);
+}
+
+// Written by the device, we notify once the available index moves past it
+volatile uint16_t *virtq_avail_event(Virtq *vq) {
+  return (volatile uint16_t *)((uint8_t *)vq->used + sizeof(VirtqUsed) + sizeof(VirtqUsedElem) * vq->size);
+}
+
+// True if event is in [old_index, new_index), with wrapping
+// SOURCE: https://docs.oasis-open.org/virtio/virtio/v1.2/virtio-v1.2.html#x1-680009 (vring_need_event)
+bool virtq_need_event(uint16_t event, uint16_t new_index, uint16_t old_index) {
+  return (uint16_t)(new_index - event - 1) < (uint16_t)(new_index - old_index);
+}
+
+bool virtq_needs_notify(Virtq *vq) {
+  if (vq->is_packed) {
+    uint16_t flags = vq->device_event->flags;
+    if (flags != VIRTQ_EVENT_DESC) return flags != VIRTQ_EVENT_DISABLE;
+    // Positions in the ring, the event is moved back a lap if it has the old wrap counter
+    uint16_t off_wrap = vq->device_event->off_wrap;
+    uint16_t event = off_wrap & 0x7FFF;
+    if ((bool)(off_wrap >> 15) != vq->avail_wrap) event -= vq->size;
+    return virtq_need_event(event, vq->next_avail, vq->next_avail - vq->unnotified);
+  }
+  if (vq->has_event_idx) {
+    return virtq_need_event(*virtq_avail_event(vq), vq->avail->index, vq->avail->index - vq->unnotified);
+  }
+  return !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+}
+
+void virtq_notify(Virtq *vq) {
+  size_t irq = irq_save();
+  // NOTE: The device has to see the available ring before we read
+  // whether it wants to be notified, it could go to sleep in between
+  __sync_synchronize();
+  if (vq->unnotified && virtq_needs_notify(vq)) vq->dev->transport->notify(vq->dev, vq->index);
+  vq->unnotified = 0;
+  irq_restore(irq);
+}
+
+void virtq_arm_interrupt(Virtq *vq) {
+  if (vq->is_packed) {
+    if (vq->has_event_idx) {
+      vq->driver_event->off_wrap = vq->last_used | vq->used_wrap << 15;
+      vq->driver_event->flags = VIRTQ_EVENT_DESC;
+    } else {
+      vq->driver_event->flags = VIRTQ_EVENT_ENABLE;
+    }
+  } else {
+    if (vq->has_event_idx) {
+      *virtq_used_event(vq) = vq->last_used;
+    } else {
+      vq->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+  }
+}
+
+void virtq_disable_interrupts(Virtq *vq) {
+  vq->is_interrupt_disabled = true;
+  if (vq->is_packed) {
+    vq->driver_event->flags = VIRTQ_EVENT_DISABLE;
+  } else if (!vq->has_event_idx) {
+    vq->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+  }
+  // NOTE: The split used event just stays behind, so there is at most one more interrupt
+}
+
+bool virtq_enable_interrupts(Virtq *vq) {
+  vq->is_interrupt_disabled = false;
+  virtq_arm_interrupt(vq);
+  // NOTE: The device has to see it before we check the used index
+  __sync_synchronize();
+  return !virtq_has_used(vq);
+}
+
+void virtq_fill_desc(VirtqDesc *desc, const VirtqBuf *buf, bool is_last) {
+  desc->addr = dma_address(buf->addr);
+  desc->len = buf->len;
+  desc->flags = (buf->is_write ? VIRTQ_DESC_WRITE : 0) | (is_last ? 0 : VIRTQ_DESC_NEXT);
+}
+
+// Returns the head
+uint16_t virtq_split_add(Virtq *vq, const VirtqBuf *bufs, uint32_t count, bool is_indirect) {
+  uint16_t head = vq->free_head;
+  uint16_t index = head;
+  if (is_indirect) {
+    // Every head has its own table, it's free as long as the head is
+    VirtqDesc *table = &vq->indirect[head * VIRTQ_INDIRECT_MAX];
+    for (uint32_t i = 0; i < count; ++i) {
+      virtq_fill_desc(&table[i], &bufs[i], i + 1 == count);
+      table[i].next = i + 1;
+    }
+    vq->descs[head].addr = dma_address(table);
+    vq->descs[head].len = sizeof(VirtqDesc) * count;
+    vq->descs[head].flags = VIRTQ_DESC_INDIRECT;
+  } else {
+    // The free list is already chained through next, only the flags
+    // tell the device where the chain ends
+    for (uint32_t i = 0; i < count; ++i) {
+      bool is_last = i + 1 == count;
+      virtq_fill_desc(&vq->descs[index], &bufs[i], is_last);
+      if (!is_last) index = vq->descs[index].next;
+    }
+  }
+  vq->free_head = vq->descs[index].next;
+
+  vq->avail->ring[vq->avail->index % vq->size] = head;
+  // NOTE: The device has to see the chain before the new index
+  __sync_synchronize();
+  vq->avail->index++;
+  vq->unnotified++;
+  return head;
+}
+
+// Returns the buffer id
+uint16_t virtq_packed_add(Virtq *vq, const VirtqBuf *bufs, uint32_t count, bool is_indirect) {
+  uint16_t id = vq->free_id;
+  vq->free_id = vq->packed_ids[id];
+  uint32_t ring_count = is_indirect ? 1 : count;
+  vq->packed_ids[id] = ring_count;
+
+  uint16_t head = vq->next_avail;
+  uint16_t head_flags = 0;
+  for (uint32_t i = 0; i < ring_count; ++i) {
+    volatile VirtqPackedDesc *desc = &vq->ring[vq->next_avail];
+    uint16_t flags = vq->avail_wrap ? VIRTQ_PACKED_DESC_AVAIL : VIRTQ_PACKED_DESC_USED;
+    if (is_indirect) {
+      // NOTE: The table uses the same layout, only the write flag counts there
+      VirtqPackedDesc *table = (void *)&vq->indirect[id * VIRTQ_INDIRECT_MAX];
+      for (uint32_t j = 0; j < count; ++j) {
+        table[j] = (VirtqPackedDesc){
+          .addr = dma_address(bufs[j].addr),
+          .len = bufs[j].len,
+          .flags = bufs[j].is_write ? VIRTQ_DESC_WRITE : 0,
+        };
+      }
+      desc->addr = dma_address(table);
+      desc->len = sizeof(VirtqPackedDesc) * count;
+      flags |= VIRTQ_DESC_INDIRECT;
+    } else {
+      desc->addr = dma_address(bufs[i].addr);
+      desc->len = bufs[i].len;
+      flags |= (bufs[i].is_write ? VIRTQ_DESC_WRITE : 0) | (i + 1 < count ? VIRTQ_DESC_NEXT : 0);
+    }
+    desc->id = id;
+    if (i == 0) {
+      head_flags = flags;
+    } else {
+      desc->flags = flags;
+    }
+    if (++vq->next_avail == vq->size) {
+      vq->next_avail = 0;
+      vq->avail_wrap = !vq->avail_wrap;
+    }
+  }
+  // NOTE: The device takes the whole chain once the head is available, so it goes last
+  __sync_synchronize();
+  vq->ring[head].flags = head_flags;
+  vq->unnotified += ring_count;
+  return id;
+}
+
+bool virtq_add(Virtq *vq, const VirtqBuf *bufs, uint32_t count, void *cookie) {
+  ASSERT(count && cookie);
+  bool is_indirect = vq->indirect && count > 1 && count <= VIRTQ_INDIRECT_MAX;
+  uint32_t ring_count = is_indirect ? 1 : count;
+  // NOTE: Shared by the tasks and threads submitting to the device
+  size_t irq = irq_save();
+  if (vq->free_count < ring_count) {
+    irq_restore(irq);
+    return false;
+  }
+  // Both the split heads and the packed ids are unique while the chain is in flight
+  uint16_t id = vq->is_packed
+    ? virtq_packed_add(vq, bufs, count, is_indirect)
+    : virtq_split_add(vq, bufs, count, is_indirect);
+  vq->free_count -= ring_count;
+  vq->cookies[id] = cookie;
+  irq_restore(irq);
+  return true;
+}
+
+uint32_t virtq_split_buf(VirtqBuf *out_bufs, uint32_t limit, void *addr, uint32_t len, bool is_write) {
+  uint8_t *ptr = addr;
+  uint32_t count = 0;
+  while (len) {
+    uint32_t part = MIN(len, PAGE_SIZE - ((size_t)ptr & (PAGE_SIZE - 1)));
+    VirtqBuf *prev = count ? &out_bufs[count - 1] : NULL;
+    if (prev && dma_address(prev->addr) + prev->len == dma_address(ptr)) {
+      prev->len += part;
+    } else {
+      if (count == limit) return 0;
+      out_bufs[count++] = (VirtqBuf){ptr, part, is_write};
+    }
+    ptr += part;
+    len -= part;
+  }
+  return count;
+}
+
+bool virtq_has_used(Virtq *vq) {
+  if (vq->is_packed) {
+    // The device sets both flags to its wrap counter
+    uint16_t flags = vq->ring[vq->last_used].flags;
+    bool is_avail = flags & VIRTQ_PACKED_DESC_AVAIL;
+    bool is_used = flags & VIRTQ_PACKED_DESC_USED;
+    return is_avail == is_used && is_used == vq->used_wrap;
+  }
+  return vq->used->index != vq->last_used;
+}
+
+// Returns the head and frees its descriptors
+uint16_t virtq_split_pop(Virtq *vq, uint32_t *out_len) {
+  VirtqUsedElem elem = vq->used->ring[vq->last_used++ % vq->size];
+  uint16_t head = elem.id;
+
+  // The whole chain goes back to the front of the free list,
+  // an indirect chain is only one descriptor of the ring
+  uint16_t tail = head;
+  uint32_t count = 1;
+  for (; vq->descs[tail].flags & VIRTQ_DESC_NEXT; ++count) tail = vq->descs[tail].next;
+  vq->descs[tail].next = vq->free_head;
+  vq->free_head = head;
+  vq->free_count += count;
+  *out_len = elem.len;
+  return head;
+}
+
+// Returns the buffer id and frees its descriptors
+uint16_t virtq_packed_pop(Virtq *vq, uint32_t *out_len) {
+  volatile VirtqPackedDesc *desc = &vq->ring[vq->last_used];
+  uint16_t id = desc->id;
+  *out_len = desc->len;
+
+  // The device writes one descriptor for the chain and skips the rest
+  uint16_t count = vq->packed_ids[id];
+  vq->last_used += count;
+  if (vq->last_used >= vq->size) {
+    vq->last_used -= vq->size;
+    vq->used_wrap = !vq->used_wrap;
+  }
+  vq->packed_ids[id] = vq->free_id;
+  vq->free_id = id;
+  vq->free_count += count;
+  return id;
+}
+
+void *virtq_pop_used(Virtq *vq, uint32_t *out_len) {
+  size_t irq = irq_save();
+  if (!virtq_has_used(vq)) {
+    irq_restore(irq);
+    return NULL;
+  }
+  // NOTE: The entry can't be read before the index or flags that published it
+  __sync_synchronize();
+  uint32_t len;
+  uint16_t id = vq->is_packed ? virtq_packed_pop(vq, &len) : virtq_split_pop(vq, &len);
+  void *cookie = vq->cookies[id];
+  ASSERT(cookie && "The device used a chain that isn't in flight");
+  vq->cookies[id] = NULL;
+  // The next used buffer interrupts
+  if (vq->has_event_idx && !vq->is_interrupt_disabled) virtq_arm_interrupt(vq);
+  irq_restore(irq);
+
+  if (out_len) *out_len = len;
+  return cookie;
+}
+
+bool virtq_is_idle(Virtq *vq) {
+  return vq->free_count == vq->size;
+}
+
+void virtq_handle_interrupt(Virtq *vq) {
+  wake_all(&TASKS, &vq->waiters);
+}
+
+void virtq_wait_used(Virtq *vq) {
+  for (;;) {
+    size_t irq = irq_save();
+    // Nobody might pop in the meantime, so ask for the interrupt we are waiting for
+    if (vq->has_event_idx) {
+      virtq_arm_interrupt(vq);
+      __sync_synchronize();
+    }
+    bool is_used = virtq_has_used(vq);
+    // NOTE: The interrupt can't slip in between the check and going to sleep
+    if (!is_used) wait_for_interrupt();
+    irq_restore(irq);
+    if (is_used) return;
+  }
+}
+
+void virtq_wait_idle(Virtq *vq) {
+  for (;;) {
+    while (virtq_pop_used(vq, NULL)) {}
+    if (virtq_is_idle(vq)) return;
+    virtq_wait_used(vq);
+  }
 }
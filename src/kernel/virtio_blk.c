@@ -1,67 +1,193 @@
 #include "interfaces/blk.h"
 #include "virtio.h"
 
+void virtio_blk_read_write_sectors(BlkDev *blk, void *buffer, uint32_t first_sector, uint32_t len, BlkDevFlags flags) {
+  virtio_blk_rw((VirtioBlkdev *)blk, buffer, first_sector, len, flags);
+}
+
+// Spins until a request slot and enough descriptors are free
+// NOTE: Slots that are done but not released yet don't come back this way
+VirtioBlkRequest *virtio_blk_submit_wait(VirtioBlkdev *blkdev, uint8_t *buffer, uint32_t first_sector, uint32_t len,
+    bool is_write) {
+  for (;;) {
+    VirtioBlkRequest *req = virtio_blk_submit(blkdev, buffer, first_sector, len, is_write, NULL, NULL);
+    if (req) return req;
+    if (!virtio_blk_complete(blkdev)) virtq_wait_used(blkdev->vq);
+  }
+}
+
+// Sends as much of the rest of the blk_v1_submit buffer as fits into one request
+void virtio_blk_submit_v1_part(VirtioBlkdev *blkdev) {
+  uint32_t len = MIN(blkdev->v1_len, virtio_blk_max_sectors(blkdev, blkdev->v1_buffer));
+  blkdev->v1_request = virtio_blk_submit_wait(blkdev, blkdev->v1_buffer, blkdev->v1_sector, len,
+      blkdev->v1_is_write);
+  blkdev->v1_buffer += len * SECTOR_SIZE;
+  blkdev->v1_sector += len;
+  blkdev->v1_len -= len;
+}
+
+void virtio_blk_submit_sectors(BlkDev *blk, void *buffer, uint32_t first_sector, uint32_t len, BlkDevFlags flags) {
+  VirtioBlkdev *blkdev = (void *)blk;
+  ASSERT(!blkdev->v1_request && "Only one request at a time");
+  blkdev->v1_buffer = buffer;
+  blkdev->v1_sector = first_sector;
+  blkdev->v1_len = len;
+  blkdev->v1_is_write = flags & BLKDEV_WRITE;
+  virtio_blk_submit_v1_part(blkdev);
+}
+
+bool virtio_blk_is_done_blk(BlkDev *blk) {
+  VirtioBlkdev *blkdev = (void *)blk;
+  ASSERT(blkdev->v1_request);
+  if (!virtio_blk_is_done(blkdev, blkdev->v1_request)) return false;
+  uint8_t status = virtio_blk_release(blkdev, blkdev->v1_request);
+  blkdev->v1_request = NULL;
+  // TODO: It should be an error
+  ASSERT(status == VIRTIO_BLK_S_OK);
+  // NOTE: The waiter stays parked, the next part wakes it up like the first one
+  if (blkdev->v1_len) {
+    virtio_blk_submit_v1_part(blkdev);
+    return false;
+  }
+  return true;
+}
+
 VirtioBlkdev virtio_blk_init(VirtioDevice *dev) {
-  ASSERT(dev->magic == VIRTIO_MAGIC);
-  ASSERT(dev->version == 1);
-  ASSERT(dev->device = VIRTIO_DEVICE_BLK);
+  ASSERT(dev->type == VIRTIO_DEVICE_BLK);
 
-  dev->status = 0;
-  dev->status |= VIRTIO_STATUS_ACK;
-  dev->status |= VIRTIO_STATUS_DRIVER;
-  dev->status |= VIRTIO_STATUS_FEAT_OK;
+  uint64_t features = virtio_begin_init(dev, 1 << VIRTIO_BLK_F_SEG_MAX);
+  Virtq *vq = virtq_create(dev, 0, VIRTQ_MAX_SIZE);
+  virtio_finish_init(dev);
 
-  Virtq *vq = virtq_create(dev, 0);
-  dev->status |= VIRTIO_STATUS_DRIVER_OK;
+  volatile VirtioBlkConfig *config = (void *)dev->config;
+  uint64_t capacity = config->capacity;
+  // Without indirect descriptors every segment takes a descriptor of the ring
+  uint32_t seg_max = vq->indirect ? VIRTIO_BLK_MAX_SEGMENTS : MIN(VIRTIO_BLK_MAX_SEGMENTS, vq->size - 2);
+  if ((features & (1 << VIRTIO_BLK_F_SEG_MAX)) && config->seg_max) seg_max = MIN(seg_max, config->seg_max);
 
-  uint64_t capacity = *(uint64_t *)dev->config;
-  printf("virtio: blkdev with capacity = %d\n", (uint32_t)capacity);
+  // NOTE: Without indirect descriptors the ring can fill up before the slots run out
+  uint32_t request_count = MIN(VIRTIO_BLK_MAX_REQUESTS, vq->size);
+  VirtioBlkRequest *requests = alloc_dma_pages(ALIGN_UP(request_count * sizeof(VirtioBlkRequest), PAGE_SIZE) / PAGE_SIZE);
+  for (uint32_t i = 0; i + 1 < request_count; ++i) requests[i].next_free = &requests[i + 1];
+  log("virtio: blkdev with capacity = %d, segments = %d, requests = %d", capacity, (size_t)seg_max,
+      (size_t)request_count);
 
   return (VirtioBlkdev){
+    .blk = {
+      .read_write_sectors = virtio_blk_read_write_sectors,
+      .submit = virtio_blk_submit_sectors,
+      .is_done = virtio_blk_is_done_blk,
+      .waiters = &vq->waiters,
+      .sector_capacity = capacity,
+    },
     .vq = vq,
-    .sector_capacity = capacity,
     .dev = dev,
+    .seg_max = seg_max,
+    .requests = requests,
+    .free_requests = requests,
+    .request_count = request_count,
   };
 }
 
-void virtio_blk_rw(VirtioBlkdev *blkdev, uint8_t *buffer, uint32_t first_sector, uint32_t len, bool is_write) {
+void virtio_blk_destroy(VirtioBlkdev *blkdev) {
+  virtio_reset(blkdev->dev);
+  virtq_destroy(blkdev->vq);
+  free_dma_pages(blkdev->requests,
+      ALIGN_UP(blkdev->request_count * sizeof(VirtioBlkRequest), PAGE_SIZE) / PAGE_SIZE);
+  *blkdev = (VirtioBlkdev){0};
+}
+
+void virtio_blk_handle_interrupt(void *arg) {
+  VirtioBlkdev *blkdev = arg;
+  virtq_handle_interrupt(blkdev->vq);
+}
+
+VirtioBlkRequest *virtio_blk_submit(VirtioBlkdev *blkdev, uint8_t *buffer, uint32_t first_sector, uint32_t len,
+    bool is_write, VirtioBlkCallback callback, void *arg) {
+  VirtqBuf data = {buffer, SECTOR_SIZE * len, !is_write};
+  return virtio_blk_submitv(blkdev, &data, 1, first_sector, is_write, callback, arg);
+}
+
+VirtioBlkRequest *virtio_blk_submitv(VirtioBlkdev *blkdev, const VirtqBuf *data, uint32_t data_count,
+    uint32_t first_sector, bool is_write, VirtioBlkCallback callback, void *arg) {
+  VirtqBuf bufs[VIRTIO_BLK_MAX_SEGMENTS + 2];
+  uint32_t segments = 0;
+  uint32_t len = 0;
+  for (uint32_t i = 0; i < data_count; ++i) {
+    uint32_t count = virtq_split_buf(&bufs[1 + segments], blkdev->seg_max - segments,
+        data[i].addr, data[i].len, !is_write);
+    if (!count) return NULL;
+    segments += count;
+    len += data[i].len / SECTOR_SIZE;
+  }
   // TODO: It should be an error
-  ASSERT(first_sector + len <= blkdev->sector_capacity);
+  ASSERT(first_sector + len <= blkdev->blk.sector_capacity);
 
-  blkdev->request = (VirtioBlkReq){
-    .sector = first_sector,
-    .type = is_write ? VIRTIO_BLK_OUT : VIRTIO_BLK_IN,
+  VirtioBlkRequest *req = blkdev->free_requests;
+  if (!req) return NULL;
+  VirtioBlkRequest *next_free = req->next_free;
+  *req = (VirtioBlkRequest){
+    .header = {
+      .sector = first_sector,
+      .type = is_write ? VIRTIO_BLK_OUT : VIRTIO_BLK_IN,
+    },
+    .status = VIRTIO_BLK_S_PENDING,
+    .callback = callback,
+    .arg = arg,
+    .next_free = next_free,
   };
 
-  Virtq *vq = blkdev->vq;
-  vq->descs[0] = (VirtqDesc){
-    .addr = (uint32_t)&blkdev->request,
-    .len = sizeof(blkdev->request),
-    .next = 1,
-    .flags = VIRTQ_DESC_NEXT,
-  };
-  vq->descs[1] = (VirtqDesc){
-    .addr = (uint32_t)buffer,
-    .len = SECTOR_SIZE * len,
-    .next = 2,
-    .flags = VIRTQ_DESC_NEXT | (is_write ? 0 : VIRTQ_DESC_WRITE),
-  };
-  vq->descs[2] = (VirtqDesc){
-    .addr = (uint32_t)&blkdev->status,
-    .len = 1,
-    .flags = VIRTQ_DESC_WRITE,
-  };
+  bufs[0] = (VirtqBuf){&req->header, sizeof(req->header), false};
+  bufs[segments + 1] = (VirtqBuf){&req->status, 1, true};
+  if (!virtq_add(blkdev->vq, bufs, segments + 2, req)) return NULL;
+  blkdev->free_requests = next_free;
+  virtq_notify(blkdev->vq);
+  return req;
+}
 
-  vq->avail.ring[vq->avail.index++ % VIRTQ_ENTRY_NUM] = 0;
-  __sync_synchronize();
-  blkdev->dev->queue_notify = 0;
+uint32_t virtio_blk_complete(VirtioBlkdev *blkdev) {
+  uint32_t count = 0;
+  VirtioBlkRequest *req;
+  while ((req = virtq_pop_used(blkdev->vq, NULL))) {
+    req->is_done = true;
+    count++;
+    if (!req->callback) continue;
+    req->callback(req);
+    virtio_blk_release(blkdev, req);
+  }
+  return count;
+}
 
-  while (vq->avail.index != vq->used.index);
+bool virtio_blk_is_done(VirtioBlkdev *blkdev, VirtioBlkRequest *req) {
+  if (!req->is_done) virtio_blk_complete(blkdev);
+  return req->is_done;
+}
 
-  // TODO: It should be an error
-  ASSERT(blkdev->status == 0);
+uint8_t virtio_blk_release(VirtioBlkdev *blkdev, VirtioBlkRequest *req) {
+  ASSERT(req->is_done);
+  req->next_free = blkdev->free_requests;
+  blkdev->free_requests = req;
+  return req->status;
 }
 
-void blk_v1_read_write_sectors(BlkDev *blkdev, void *buffer, uint32_t first_sector, uint32_t len, BlkDevFlags flags) {
-  virtio_blk_rw(blkdev, buffer, first_sector, len, flags);
+// NOTE: Every page can be a segment of its own, contiguous ones only make it fit more
+uint32_t virtio_blk_max_sectors(VirtioBlkdev *blkdev, const uint8_t *buffer) {
+  size_t offset = (size_t)buffer & (PAGE_SIZE - 1);
+  uint32_t len = (blkdev->seg_max * PAGE_SIZE - offset) / SECTOR_SIZE;
+  ASSERT(len && "A sector doesn't fit into the device segments");
+  return len;
+}
+
+void virtio_blk_rw(VirtioBlkdev *blkdev, uint8_t *buffer, uint32_t first_sector, uint32_t len, bool is_write) {
+  while (len) {
+    uint32_t part = MIN(len, virtio_blk_max_sectors(blkdev, buffer));
+    VirtioBlkRequest *req = virtio_blk_submit_wait(blkdev, buffer, first_sector, part, is_write);
+    while (!virtio_blk_is_done(blkdev, req)) virtq_wait_used(blkdev->vq);
+    uint8_t status = virtio_blk_release(blkdev, req);
+    // TODO: It should be an error
+    ASSERT(status == VIRTIO_BLK_S_OK);
+    buffer += part * SECTOR_SIZE;
+    first_sector += part;
+    len -= part;
+  }
 }
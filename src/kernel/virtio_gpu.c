@@ -103,23 +103,24 @@ typedef struct PACKED {
   uint32_t padding;
 } VirtioGpuMemEntry;
 
+struct VirtioGpuFlush {
+  VirtioGpuTransferToHost2D transfer;
+  VirtioGpuCtrlHdr transfer_res;
+  VirtioGpuResourceFlush flush;
+  VirtioGpuCtrlHdr flush_res;
+};
+
 // TODO: dynamic screen size
 VirtioGpu virtio_gpu_init(VirtioDevice *dev) {
-  ASSERT(dev->magic == VIRTIO_MAGIC);
-  ASSERT(dev->version == 1);
-  ASSERT(dev->device == VIRTIO_DEVICE_GPU);
-
-  dev->status = 0;
-  dev->status |= VIRTIO_STATUS_ACK;
-  dev->status |= VIRTIO_STATUS_DRIVER;
-  dev->status |= VIRTIO_STATUS_FEAT_OK;
+  ASSERT(dev->type == VIRTIO_DEVICE_GPU);
 
-  Virtq *vq = virtq_create(dev, 0);
-  Virtq *cq = virtq_create(dev, 1);
+  virtio_begin_init(dev, 0);
+  // NOTE: Only a few commands are in flight at a time
+  Virtq *vq = virtq_create(dev, 0, 16);
+  Virtq *cq = virtq_create(dev, 1, 16);
+  virtio_finish_init(dev);
 
-  dev->status |= VIRTIO_STATUS_DRIVER_OK;
-
-  uint8_t *buffer = (void *)alloc_pages(300);
+  uint8_t *buffer = alloc_dma_pages(300);
 
   VirtioGpuResourceCreate2D req1 = {
     .hdr.type = VIRTIO_GPU_CMD_RESOURCE_CREATE_2D,
@@ -136,7 +137,7 @@ VirtioGpu virtio_gpu_init(VirtioDevice *dev) {
     .nr_entries = 1,
   };
   VirtioGpuMemEntry ent2 = {
-    .addr = (uint32_t)buffer,
+    .addr = dma_address(buffer),
     .length = DISPLAY_WIDTH * DISPLAY_HEIGHT * 4,
   };
   VirtioGpuCtrlHdr res2 = {0};
@@ -150,20 +151,16 @@ VirtioGpu virtio_gpu_init(VirtioDevice *dev) {
   };
   VirtioGpuCtrlHdr res3 = {0};
 
-  virtq_descf(vq, &req1, sizeof(req1), 0);
-  virtq_descl(vq, &res1, sizeof(res1), 1);
-
-  virtq_descf(vq, &req2, sizeof(req2), 0);
-  virtq_descm(vq, &ent2, sizeof(ent2), 0);
-  virtq_descl(vq, &res2, sizeof(res2), 1);
+  VirtqBuf cmd1[] = {{&req1, sizeof(req1), false}, {&res1, sizeof(res1), true}};
+  VirtqBuf cmd2[] = {{&req2, sizeof(req2), false}, {&ent2, sizeof(ent2), false}, {&res2, sizeof(res2), true}};
+  VirtqBuf cmd3[] = {{&req3, sizeof(req3), false}, {&res3, sizeof(res3), true}};
+  // NOTE: The queue is empty, the commands fit
+  virtq_add(vq, cmd1, ARRAY_LEN(cmd1), &res1);
+  virtq_add(vq, cmd2, ARRAY_LEN(cmd2), &res2);
+  virtq_add(vq, cmd3, ARRAY_LEN(cmd3), &res3);
 
-  virtq_descf(vq, &req3, sizeof(req3), 0);
-  virtq_descl(vq, &res3, sizeof(res3), 1);
-
-  __sync_synchronize();
-  dev->queue_notify = 0;
-  while (vq->avail.index != vq->used.index);
-  vq->desc_index = 0;
+  virtq_notify(vq);
+  virtq_wait_idle(vq);
 
   ASSERT(res1.type == VIRTIO_GPU_RESP_OK_NODATA);
   ASSERT(res2.type == VIRTIO_GPU_RESP_OK_NODATA);
@@ -174,40 +171,60 @@ VirtioGpu virtio_gpu_init(VirtioDevice *dev) {
     .vq = vq,
     .cq = cq,
     .fb = (void *)buffer,
+    .flush = alloc_dma_pages(1),
   };
 }
 
-void virtio_gpu_flush(VirtioGpu *gpu) {
-  VirtioGpuTransferToHost2D req1 = {
-    .hdr.type = VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D,
-    .rect.w = DISPLAY_WIDTH,
-    .rect.h = DISPLAY_HEIGHT,
-    .resource_id = 1,
-  };
-  VirtioGpuCtrlHdr res1 = {0};
+void virtio_gpu_handle_interrupt(void *arg) {
+  VirtioGpu *gpu = arg;
+  virtq_handle_interrupt(gpu->vq);
+}
 
-  VirtioGpuResourceFlush req2 = {
-    .hdr.type = VIRTIO_GPU_CMD_RESOURCE_FLUSH,
-    .rect.w = DISPLAY_WIDTH,
-    .rect.h = DISPLAY_HEIGHT,
-    .resource_id = 1,
+void virtio_gpu_submit_flush(VirtioGpu *gpu) {
+  struct VirtioGpuFlush *cmd = gpu->flush;
+  *cmd = (struct VirtioGpuFlush){
+    .transfer = {
+      .hdr.type = VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D,
+      .rect.w = DISPLAY_WIDTH,
+      .rect.h = DISPLAY_HEIGHT,
+      .resource_id = 1,
+    },
+    .flush = {
+      .hdr.type = VIRTIO_GPU_CMD_RESOURCE_FLUSH,
+      .rect.w = DISPLAY_WIDTH,
+      .rect.h = DISPLAY_HEIGHT,
+      .resource_id = 1,
+    },
   };
-  VirtioGpuCtrlHdr res2 = {0};
 
-  Virtq *vq = gpu->vq;
-  virtq_descf(vq, &req1, sizeof(req1), 0);
-  virtq_descl(vq, &res1, sizeof(res1), 1);
+  VirtqBuf transfer[] = {
+    {&cmd->transfer, sizeof(cmd->transfer), false},
+    {&cmd->transfer_res, sizeof(cmd->transfer_res), true},
+  };
+  VirtqBuf flush[] = {
+    {&cmd->flush, sizeof(cmd->flush), false},
+    {&cmd->flush_res, sizeof(cmd->flush_res), true},
+  };
+  // NOTE: The previous flush has to be done, there is only one command buffer
+  bool is_added = virtq_add(gpu->vq, transfer, ARRAY_LEN(transfer), &cmd->transfer_res);
+  is_added &= virtq_add(gpu->vq, flush, ARRAY_LEN(flush), &cmd->flush_res);
+  ASSERT(is_added);
 
-  virtq_descf(vq, &req2, sizeof(req2), 0);
-  virtq_descl(vq, &res2, sizeof(res2), 1);
+  virtq_notify(gpu->vq);
+}
 
-  __sync_synchronize();
-  gpu->dev->queue_notify = 0;
-  while (vq->avail.index != vq->used.index);
-  vq->desc_index = 0;
+bool virtio_gpu_is_flushed(VirtioGpu *gpu) {
+  while (virtq_pop_used(gpu->vq, NULL)) {}
+  if (!virtq_is_idle(gpu->vq)) return false;
+  ASSERT(gpu->flush->transfer_res.type == VIRTIO_GPU_RESP_OK_NODATA);
+  ASSERT(gpu->flush->flush_res.type == VIRTIO_GPU_RESP_OK_NODATA);
+  return true;
+}
 
-  ASSERT(res1.type == VIRTIO_GPU_RESP_OK_NODATA);
-  ASSERT(res2.type == VIRTIO_GPU_RESP_OK_NODATA);
+void virtio_gpu_flush(VirtioGpu *gpu) {
+  virtio_gpu_submit_flush(gpu);
+  virtq_wait_idle(gpu->vq);
+  ASSERT(virtio_gpu_is_flushed(gpu));
 }
 
 void gpu_v1_get_surface(GpuDev *gpu, Surface *out_surface) {
@@ -222,3 +239,15 @@ void gpu_v1_get_surface(GpuDev *gpu, Surface *out_surface) {
 void gpu_v1_flush(GpuDev *gpu) {
   virtio_gpu_flush(gpu);
 }
+
+void gpu_v1_submit_flush(GpuDev *gpu) {
+  virtio_gpu_submit_flush(gpu);
+}
+
+bool gpu_v1_is_flushed(GpuDev *gpu) {
+  return virtio_gpu_is_flushed(gpu);
+}
+
+WaitQueue *gpu_v1_get_wait_queue(GpuDev *gpu) {
+  return &gpu->vq->waiters;
+}
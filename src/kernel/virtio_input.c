@@ -21,57 +21,50 @@ typedef volatile struct {
 } VirtioInputConfig;
 
 VirtioInput virtio_input_init(VirtioDevice *dev) {
-  ASSERT(dev->magic == VIRTIO_MAGIC);
-  ASSERT(dev->version == 1);
-  ASSERT(dev->device = VIRTIO_DEVICE_INPUT);
-
-  dev->status = 0;
-  dev->status |= VIRTIO_STATUS_ACK;
-  dev->status |= VIRTIO_STATUS_DRIVER;
-  dev->status |= VIRTIO_STATUS_FEAT_OK;
-
-  Virtq *eq = virtq_create(dev, 0);
-  Virtq *sq = virtq_create(dev, 1);
-
-  uint8_t *buffer = (void *)alloc_pages(1);
-
-  for (uint32_t i = 0; i < 16; ++i) {
-    eq->descs[i] = (VirtqDesc){
-      .addr = (uint32_t)buffer + sizeof(InputEvent) * i,
-      .len = sizeof(InputEvent),
-      .flags = VIRTQ_DESC_WRITE,
-    };
-    eq->avail.ring[i] = i;
+  ASSERT(dev->type == VIRTIO_DEVICE_INPUT);
+
+  virtio_begin_init(dev, 0);
+  Virtq *eq = virtq_create(dev, 0, VIRTIO_INPUT_EVENT_NUM);
+  Virtq *sq = virtq_create(dev, 1, VIRTIO_INPUT_EVENT_NUM);
+
+  uint8_t *buffer = alloc_dma_pages((eq->size * sizeof(InputEvent) + PAGE_SIZE - 1) / PAGE_SIZE);
+
+  InputEvent *events = (void *)buffer;
+  for (uint32_t i = 0; i < eq->size; ++i) {
+    VirtqBuf buf = {&events[i], sizeof(InputEvent), true};
+    virtq_add(eq, &buf, 1, &events[i]);
   }
-  eq->avail.index += 16;
-  __sync_synchronize();
 
-  dev->status |= VIRTIO_STATUS_DRIVER_OK;
+  virtio_finish_init(dev);
+  virtq_notify(eq);
 
   return (VirtioInput){
     .dev = dev,
     .event_queue = eq,
     .status_queue = sq,
-    .events = (void *)buffer,
+    .events = events,
   };
 }
 
+void virtio_input_handle_interrupt(void *arg) {
+  VirtioInput *input = arg;
+  virtq_handle_interrupt(input->event_queue);
+}
+
 uint32_t input_v1_read_events(InputDev *dev, InputEvent *out_events, uint32_t event_limit) {
   Virtq *vq = dev->event_queue;
-  uint32_t available_events = vq->used.index - dev->processed;
-  if (available_events <= 0) return 0;
-
-  uint32_t events_to_write = UPPER_BOUND(available_events, event_limit);
-  for (uint32_t i = 0; i < events_to_write; ++i) {
-    VirtqUsedElem elem = vq->used.ring[dev->processed++ % VIRTQ_ENTRY_NUM];
-    // ASSERT(elem.len == sizeof(InputEvent));
-    out_events[i] = dev->events[elem.id];
-    vq->avail.ring[vq->avail.index++ % VIRTQ_ENTRY_NUM] = elem.id;
+  uint32_t events_written = 0;
+  for (; events_written < event_limit; ++events_written) {
+    InputEvent *event = virtq_pop_used(vq, NULL);
+    if (!event) break;
+    out_events[events_written] = *event;
+    // The buffer goes right back, its descriptor was just freed
+    VirtqBuf buf = {event, sizeof(InputEvent), true};
+    virtq_add(vq, &buf, 1, event);
   }
 
-  __sync_synchronize();
-  dev->dev->queue_notify = 0;
-  return events_to_write;
+  if (events_written) virtq_notify(vq);
+  return events_written;
 }
 
 uint32_t input_v1_get_name(InputDev *dev, char *buffer, uint32_t limit) {
@@ -3,52 +3,52 @@
 
 // https://docs.oasis-open.org/virtio/virtio/v1.1/csprd01/virtio-v1.1-csprd01.html#x1-1940001
 
+// Puts the buffer back into the receive queue, the device is notified separately
+void virtio_net_refill(VirtioNetdev *netdev, uint32_t index) {
+  char *buffer = netdev->buffers + VIRTIO_NET_BUFFER_SIZE * index;
+  VirtqBuf buf = {buffer, VIRTIO_NET_BUFFER_SIZE, true};
+  // NOTE: Every buffer has its own slot, there is always room
+  bool is_added = virtq_add(netdev->rq, &buf, 1, buffer);
+  ASSERT(is_added);
+}
+
 VirtioNetdev virtio_net_init(VirtioDevice *dev) {
-  ASSERT(dev->magic == VIRTIO_MAGIC);
-  ASSERT(dev->version == 1);
-  ASSERT(dev->device = VIRTIO_DEVICE_NET);
-
-  dev->status = 0;
-  dev->status |= VIRTIO_STATUS_ACK;
-  dev->status |= VIRTIO_STATUS_DRIVER;
-
-  // Will this work?
-  uint32_t features = dev->host_features;
-  ASSERT(features & VIRTIO_NET_F_MAC);
-  dev->guest_features = VIRTIO_NET_F_MAC;
-  dev->status |= VIRTIO_STATUS_FEAT_OK;
-
-  uint8_t *mac = (void *)dev->config;
-  Virtq *rq = virtq_create(dev, 0);
-  Virtq *tq = virtq_create(dev, 1);
-
-  char *buffers = (void *)alloc_pages(8);
-  uint32_t buffer_size = 2048;
-  for (uint32_t i = 0; i < 16; ++i) {
-    rq->descs[i] = (VirtqDesc){
-      .addr = (uint32_t)buffers + buffer_size * i,
-      .len = buffer_size,
-      .flags = VIRTQ_DESC_WRITE,
-    };
-    rq->avail.ring[i] = i;
-  }
-  rq->avail.index += 16;
-  __sync_synchronize();
-  // dev->queue_notify = 0;
+  ASSERT(dev->type == VIRTIO_DEVICE_NET);
+
+  uint64_t features = virtio_begin_init(dev, (uint64_t)1 << VIRTIO_NET_F_MAC);
+  ASSERT(features & ((uint64_t)1 << VIRTIO_NET_F_MAC));
 
-  dev->status |= VIRTIO_STATUS_DRIVER_OK;
+  Virtq *rq = virtq_create(dev, 0, VIRTQ_MAX_SIZE);
+  Virtq *tq = virtq_create(dev, 1, VIRTQ_MAX_SIZE);
 
+  // A receive buffer for every entry of the queue
+  char *buffers = alloc_dma_pages((rq->size * VIRTIO_NET_BUFFER_SIZE + PAGE_SIZE - 1) / PAGE_SIZE);
   VirtioNetdev netdev = {
     .dev = dev,
     .buffers = buffers,
     .rq = rq,
     .tq = tq,
+    .poll_budget = VIRTIO_NET_POLL_BUDGET,
   };
-  memcpy(&netdev.mac, mac, 6);
+  for (uint32_t i = 0; i < rq->size; ++i) virtio_net_refill(&netdev, i);
+
+  virtio_finish_init(dev);
+  virtq_notify(rq);
+
+  for (uint32_t i = 0; i < 6; ++i) netdev.mac[i] = dev->config[i];
   return netdev;
 }
 
-void virtio_net_send(VirtioNetdev *netdev, uint8_t *packet, uint32_t size) {
+void virtio_net_handle_interrupt(void *arg) {
+  VirtioNetdev *netdev = arg;
+  netdev->stats.interrupts++;
+  // The poll task takes it from here, until the receive queue is empty
+  if (netdev->rx_handler) virtq_disable_interrupts(netdev->rq);
+  virtq_handle_interrupt(netdev->rq);
+  virtq_handle_interrupt(netdev->tq);
+}
+
+void virtio_net_submit(VirtioNetdev *netdev, uint8_t *packet, uint32_t size) {
   // Send completely checksumed packet
   // flags zero, gso_type = hdr_gso_none
   // the header and packet are added as one output descriptor
@@ -59,52 +59,98 @@ void virtio_net_send(VirtioNetdev *netdev, uint8_t *packet, uint32_t size) {
     .gso_type = 0,
   };
   
-  Virtq *tq = netdev->tq;
-  tq->descs[0] = (VirtqDesc){
-    .addr = (uint32_t)&netdev->header,
-    .len = sizeof(netdev->header),
-    .next = 1,
-    .flags = VIRTQ_DESC_NEXT,
-  };
-  tq->descs[1] = (VirtqDesc){
-    .addr = (uint32_t)packet,
-    .len = size,
+  // NOTE: The header is the same for every packet, so all of them can share it
+  VirtqBuf bufs[] = {
+    {&netdev->header, sizeof(netdev->header), false},
+    {packet, size, false},
   };
+  Virtq *tq = netdev->tq;
+  virtio_net_reclaim_sent(netdev);
+  while (!virtq_add(tq, bufs, ARRAY_LEN(bufs), packet)) {
+    virtq_wait_used(tq);
+    virtio_net_reclaim_sent(netdev);
+  }
+  virtq_notify(tq);
+}
 
-  tq->avail.ring[tq->avail.index++ % VIRTQ_ENTRY_NUM] = 0;
-  __sync_synchronize();
-  netdev->dev->queue_notify = 1;
+void virtio_net_reclaim_sent(VirtioNetdev *netdev) {
+  while (virtq_pop_used(netdev->tq, NULL)) {}
+}
 
-  // TODO: get rid of it when we have some kind of task system
-  while (tq->avail.index != tq->used.index);
+bool virtio_net_is_sent(VirtioNetdev *netdev) {
+  virtio_net_reclaim_sent(netdev);
+  return virtq_is_idle(netdev->tq);
 }
 
-// TODO: I don't really like the way it works, I'm gonna change it later
-// Returns the buffer index - 0..16
-uint32_t virtio_net_recv(VirtioNetdev *netdev) {
-  while (netdev->rq->used.index <= netdev->processed_requests) {
-    LOG("Waiting\n", 0);
-  }
-  LOG("Packets available\n", 0);
+void virtio_net_send(VirtioNetdev *netdev, uint8_t *packet, uint32_t size) {
+  virtio_net_submit(netdev, packet, size);
+  virtq_wait_idle(netdev->tq);
+}
 
-  uint32_t used_index = netdev->processed_requests++;
-  LOG("Processing request %d\n", used_index);
-  VirtqUsedElem elem = netdev->rq->used.ring[used_index % VIRTQ_ENTRY_NUM];
+bool virtio_net_can_recv(VirtioNetdev *netdev) {
+  return virtq_has_used(netdev->rq);
+}
 
-  volatile VirtqDesc *desc = &netdev->rq->descs[elem.id];
-  // TODO: why the addr is zero?
-  // We populated the queue, so that each descriptor chain
-  // has only one link
-  ASSERT((desc->flags & VIRTQ_DESC_NEXT) == 0);
-  ASSERT(desc->len == 2048);
+// The id is the buffer index
+VirtqUsedElem virtio_net_pop(VirtioNetdev *netdev) {
+  uint32_t len;
+  char *buffer = virtq_pop_used(netdev->rq, &len);
+  ASSERT(buffer);
+  return (VirtqUsedElem){
+    .id = (buffer - netdev->buffers) / VIRTIO_NET_BUFFER_SIZE,
+    .len = len,
+  };
+}
 
-  return elem.id;
+// TODO: I don't really like the way it works, I'm gonna change it later
+// Returns the buffer index - 0..rq->size
+uint32_t virtio_net_recv(VirtioNetdev *netdev) {
+  virtq_wait_used(netdev->rq);
+  return virtio_net_pop(netdev).id;
 }
 
 void virtio_net_return_buffer(VirtioNetdev *netdev, uint32_t index) {
-  Virtq *tq = netdev->tq;
-  tq->avail.ring[tq->avail.index++ & VIRTQ_ENTRY_NUM] = index;
-  // Is it needed?
-  __sync_synchronize();
-  netdev->dev->queue_notify = 0;
+  virtio_net_refill(netdev, index);
+  virtq_notify(netdev->rq);
+}
+
+void virtio_net_poll_task(Task *task) {
+  VirtioNetPollTask *this = (void *)task;
+  VirtioNetdev *netdev = this->netdev;
+  Virtq *rq = netdev->rq;
+
+  BEGIN_TASK(task);
+  for (;;) {
+    AWAIT_EVENT(task, &rq->waiters, virtio_net_can_recv(netdev));
+    netdev->stats.polls++;
+
+    uint32_t budget = netdev->poll_budget;
+    for (; budget && virtio_net_can_recv(netdev); --budget) {
+      VirtqUsedElem elem = virtio_net_pop(netdev);
+      uint8_t *buffer = (void *)(netdev->buffers + VIRTIO_NET_BUFFER_SIZE * elem.id);
+      netdev->rx_handler(netdev->rx_arg, buffer + sizeof(VirtioNetHeader), elem.len - sizeof(VirtioNetHeader));
+      virtio_net_refill(netdev, elem.id);
+      netdev->stats.polled_packets++;
+    }
+    // One notification for the whole batch
+    virtq_notify(rq);
+
+    // Out of budget, more packets are waiting, stay in polling mode
+    if (virtio_net_can_recv(netdev)) {
+      YIELD(task);
+      continue;
+    }
+
+    // NOTE: A packet could arrive after the last check and before
+    // interrupts are enabled, without raising one, so check again
+    if (!virtq_enable_interrupts(rq)) virtq_disable_interrupts(rq);
+  }
+  END_TASK(task);
+}
+
+void virtio_net_start_polling(VirtioNetdev *netdev, NetRxHandler handler, void *arg) {
+  netdev->rx_handler = handler;
+  netdev->rx_arg = arg;
+  netdev->poll.netdev = netdev;
+  task_spawn(&TASKS, &netdev->poll.task, virtio_net_poll_task);
 }
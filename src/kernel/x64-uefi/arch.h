@@ -2,11 +2,43 @@
 #define INCLUDE_X64_ARCH
 
 #include "cmn/lib.h"
+#include "cmn/ring.h"
 #include "common.h"
 #include "efi.h"
+#include "vfs.h"
 
 #define PAGE_SIZE 4096
 #define WFI() __asm__ __volatile__("hlt")
+
+#define RFLAGS_IF (1 << 9)
+
+// Returns the previous interrupt state for irq_restore
+static inline size_t irq_save(void) {
+  size_t flags;
+  ASM("pushfq\n pop %0\n cli" : "=r"(flags) :: "memory");
+  return flags;
+}
+
+static inline void irq_restore(size_t flags) {
+  if (flags & RFLAGS_IF) ASM("sti" ::: "memory");
+}
+
+static inline void irq_enable(void) {
+  ASM("sti" ::: "memory");
+}
+
+// Called with interrupts disabled, returns with them disabled after one was handled.
+// NOTE: hlt doesn't wake up with interrupts disabled, sti takes effect
+// after the next instruction so nothing slips in before hlt
+static inline void wait_for_interrupt(void) {
+  ASM("sti\n hlt\n cli" ::: "memory");
+}
+
+static inline uint64_t read_tsc(void) {
+  uint32_t low, high;
+  ASM("rdtsc" : "=a"(low), "=d"(high));
+  return (uint64_t)high << 32 | low;
+}
 #define HIGHER_HALF 0xFFFF800000000000ull
 #define KERNEL_BASE 0xFFFFFFFFFFF00000ull
 
@@ -91,7 +123,8 @@ typedef struct {
 
 #define INTERRUPT __attribute__((interrupt))
 
-typedef struct PACKED {
+// NOTE: Not PACKED, the layout is the same and entries can be pointed to
+typedef struct {
   uint64_t entries[512];
 } PageTable;
 
@@ -99,10 +132,40 @@ typedef struct PACKED {
 #define PAGE_BIT_PRESENT ((size_t)1 << 0)
 #define PAGE_BIT_WRITABLE ((size_t)1 << 1)
 #define PAGE_BIT_USER ((size_t)1 << 2)
+#define PAGE_BIT_WRITE_THROUGH ((size_t)1 << 3)
+#define PAGE_BIT_CACHE_DISABLE ((size_t)1 << 4)
 #define PAGE_BIT_NOT_EXECUTABLE ((size_t)1 << 63)
+// NOTE: Bits 9-11 are free for the OS
+#define PAGE_BIT_COPY_ON_WRITE ((size_t)1 << 9)
+#define PAGE_BIT_SHARED ((size_t)1 << 10)
 
 #define PAGE_ADDR_MASK 0xfffffffffffff000ull
 
+// PWT and PCD select one of the first 4 PAT entries, setup_pat replaces
+// write-through in entry 1 with write-combining, the rest keep their reset value
+// SOURCE: Intel SDM Vol. 3A, 13.12 Page Attribute Table (PAT)
+#define MSR_PAT 0x277
+enum {
+  PAT_UNCACHEABLE = 0,
+  PAT_WRITE_COMBINING = 1,
+  PAT_WRITE_THROUGH = 4,
+  PAT_WRITE_PROTECTED = 5,
+  PAT_WRITE_BACK = 6,
+  PAT_UNCACHED = 7, // UC-, can be overridden by the MTRRs
+};
+
+#define PAGE_CACHE_WRITE_BACK 0
+// NOTE: For memory that is only written, like the framebuffer
+#define PAGE_CACHE_WRITE_COMBINING PAGE_BIT_WRITE_THROUGH
+// NOTE: For memory mapped device registers
+#define PAGE_CACHE_UNCACHEABLE (PAGE_BIT_CACHE_DISABLE | PAGE_BIT_WRITE_THROUGH)
+
+// Has to run on every CPU before it uses PAGE_CACHE_WRITE_COMBINING
+void setup_pat(void);
+
+// NOTE: Makes kernel writes to read-only pages fault, needed for copy-on-write
+#define CR0_WRITE_PROTECT ((size_t)1 << 16)
+
 size_t efi_setup(void *image_handle, EfiSystemTable *st, Surface *surface, uint8_t *memory_map, size_t *memory_map_size, size_t *memory_descriptor_size);
 
 void setup_idt(InterruptDescriptor *idt);
@@ -122,11 +185,44 @@ void exit_user_process(void);
 
 struct Process;
 
+// NOTE: Build with CFLAGS=-DSYSCALL_TRACE to record every system call,
+// without it the tracing code isn't compiled at all
+#ifdef SYSCALL_TRACE
+#define SYSCALL_TRACE_SIZE 256 // power of 2
+#define MAX_SYSCALL_TYPE 16
+#define SYSCALL_LATENCY_BUCKETS 40 // powers of 2 in cycles
+
+typedef struct {
+  uint64_t enter_tsc;
+  uint64_t exit_tsc;
+  struct Process *process;
+  uint32_t type;
+  uint32_t result;
+  size_t args[3];
+} SyscallTraceEntry;
+
+// Only written by its own CPU with interrupts disabled, so there is no lock.
+// Readers copy the entries out, the oldest ones might get overwritten meanwhile.
+typedef struct {
+  SyscallTraceEntry entries[SYSCALL_TRACE_SIZE];
+  uint64_t head; // number of entries ever written
+} SyscallTraceRing;
+
+SyscallTraceRing SYSCALL_TRACE_RING;
+
+void push_syscall_trace(SyscallTraceRing *ring, SyscallTraceEntry *entry);
+#endif
+
+// NOTE: One per CPU, found through the GS base, which is the user one
+// while interrupts from user mode are handled
 typedef struct {
   size_t kernel_sp;
   size_t user_sp;
   struct Process *user_process;
   size_t user_exit_code;
+#ifdef SYSCALL_TRACE
+  SyscallTraceRing *trace;
+#endif
 } KernelThreadContext;
 
 NORETURN void user_main(void);
@@ -191,14 +287,26 @@ typedef struct {
 
 void push_free_pages(PageAllocator2 *alloc, size_t physical_start, size_t page_count);
 paddr_t alloc_pages2(PageAllocator2 *alloc, size_t page_count);
+// Returns 0 instead of asserting when there isn't a big enough range
+paddr_t try_alloc_pages2(PageAllocator2 *alloc, size_t page_count);
 
 typedef struct {
   vaddr_t virtual;
   paddr_t physical;
   size_t size;
   uint32_t next;
+  // First PrivateFrames page, copy-on-write pages that got their own frame
+  paddr_t private_frames;
 } VirtualObject;
 
+// Linked list of pages, each one holding as many frames as fit
+#define PRIVATE_FRAMES_CAPACITY (PAGE_SIZE / sizeof(paddr_t) - 2)
+typedef struct {
+  paddr_t next;
+  size_t len;
+  paddr_t frames[PRIVATE_FRAMES_CAPACITY];
+} PrivateFrames;
+
 #define MAX_VIRTUAL_OBJECTS 256
 
 typedef struct {
@@ -210,6 +318,7 @@ typedef struct {
   VirtualObject objects[MAX_VIRTUAL_OBJECTS];
   uint32_t objects_count;
   uint32_t first_object;
+  uint32_t free_object; // released slots, linked through next
 } MemoryManager;
 
 void map_virtual_range(MemoryManager *mm, vaddr_t virtual, paddr_t physical, size_t size, size_t flags);
@@ -220,25 +329,127 @@ void free(MemoryManager *mm, vaddr_t virtual);
 void map_pages2(MemoryManager *mm, paddr_t physical, vaddr_t virtual, size_t size, size_t flags);
 void push_free_pages(PageAllocator2 *alloc, paddr_t physical_start, size_t page_count);
 vaddr_t alloc_physical(MemoryManager *mm, paddr_t physical, size_t size, size_t flags);
+// Reserves a free range, the pages have to be mapped separately
+vaddr_t alloc_virtual(MemoryManager *mm, size_t size);
+// Lowest free range alloc_virtual would take, 0 if there's none. Nothing is reserved
+vaddr_t find_free_virtual(MemoryManager *mm, size_t size);
+// Object slots left, new objects assert without one, so check before taking user input
+uint32_t free_virtual_objects(MemoryManager *mm);
+paddr_t unmap_page(MemoryManager *mm, vaddr_t virtual);
+
+// The kernel address space, for the drivers
+MemoryManager *KERNEL_MM = NULL;
+
+// Zeroed, physically contiguous memory for devices
+void *alloc_dma_pages(uint32_t count);
+void free_dma_pages(void *ptr, uint32_t count);
+// NOTE: A buffer crossing a page boundary has to be physically contiguous,
+// which holds for the kernel image, the stacks and alloc_dma_pages,
+// other buffers are split with virtq_split_buf
+uint64_t dma_address(void *ptr);
+bool is_virtual_range_free(MemoryManager *mm, vaddr_t virtual, size_t size);
+// Forgets the object starting at virtual, returns false if there isn't one
+bool remove_virtual_object(MemoryManager *mm, vaddr_t virtual, VirtualObject *out_obj);
+// Forgets part of an object, which is shrunk or split in two, the pages stay mapped
+void remove_virtual_range(MemoryManager *mm, vaddr_t virtual, size_t size);
+size_t *get_page_entry(MemoryManager *mm, vaddr_t virtual);
+bool handle_copy_on_write(MemoryManager *mm, vaddr_t virtual);
+VirtualObject *find_virtual_object(MemoryManager *mm, vaddr_t virtual);
+// Frees the frames copy-on-write faults gave the object, the shared ones are left alone
+void free_private_frames(MemoryManager *mm, VirtualObject *obj);
 
 ALIGNED(16) InterruptDescriptor IDT[256] = {0};
 Tss TSS;
 
 void setup_gdt_and_tss(GdtEntry gdt[GDT_COUNT], Tss *tss, void *interrupt_stack_top);
 
+#define MAX_IO_APICS 8
+#define MAX_IRQ_OVERRIDES 16
+#define ISA_IRQ_COUNT 16
+
+typedef struct {
+  paddr_t addr;
+  uint32_t gsi_base; // first global system interrupt it handles
+} IoApicInfo;
+
+// Legacy ISA interrupt wired to a different global system interrupt
+typedef struct {
+  uint8_t isa_irq;
+  uint32_t gsi;
+  uint16_t flags; // MADT MPS INTI flags, polarity and trigger mode
+} IrqOverride;
+
+#define MAX_PCI_ECAMS 4
+
+// Memory mapped configuration space of a PCI segment, from the MCFG table
+typedef struct {
+  paddr_t base; // configuration space of start_bus
+  uint16_t segment;
+  uint8_t start_bus;
+  uint8_t end_bus;
+} PciEcamInfo;
+
 typedef struct {
   paddr_t pml4;
   PhysicalPageRange *ranges;
   uint32_t ranges_len;
   Surface fb;
-  size_t io_apic_addr;
+  IoApicInfo io_apics[MAX_IO_APICS];
+  uint32_t io_apics_len;
+  IrqOverride irq_overrides[MAX_IRQ_OVERRIDES];
+  uint32_t irq_overrides_len;
+  PciEcamInfo pci_ecams[MAX_PCI_ECAMS];
+  uint32_t pci_ecams_len;
   paddr_t bootloader_image_base;
   size_t bootloader_image_size;
+  // NOTE: Tar archive with the user programs, not mapped by the bootloader
+  paddr_t ramdisk_base;
+  size_t ramdisk_size;
 } BootData;
 
 void validate_elf_header(ElfHeader64 *elf);
 void load_elf_file(PageAllocator2 *alloc, PageTable *pml4, void *file, vaddr_t *out_entry);
-void load_elf_file2(MemoryManager *mm, const char *file, vaddr_t *out_entry);
+
+#define MAX_ELF_SEGMENTS 8
+#define MAX_ELF_IMAGES 32
+
+typedef struct {
+  vaddr_t virtual;
+  paddr_t physical;
+  size_t size; // in whole pages
+  bool is_writable;
+} ElfSegment;
+
+// Segments of an executable loaded once, processes map them instead of
+// getting their own copies. Writable segments are mapped copy-on-write.
+typedef struct {
+  FileIdentity file;
+  vaddr_t entry;
+  ElfSegment segments[MAX_ELF_SEGMENTS];
+  uint32_t segments_len;
+  uint32_t process_count;
+} ElfImage;
+
+typedef struct {
+  ElfImage images[MAX_ELF_IMAGES];
+  uint32_t len;
+} ElfImageCache;
+
+// NOTE: Files on the ramdisk never change, so images are never invalidated
+ElfImageCache ELF_IMAGES;
+
+void load_elf_image(ElfImage *image, MemoryManager *kernel_mm, Vfs *vfs, Fid fid);
+ElfImage *get_elf_image(ElfImageCache *cache, MemoryManager *kernel_mm, Vfs *vfs, Fid fid);
+void map_elf_image(MemoryManager *mm, ElfImage *image);
+
+// src/ramdisk.c
+typedef struct {
+  BlkDev blk;
+  uint8_t *ptr;
+  WaitQueue waiters; // never woken, requests are done right away
+} RamDisk;
+
+void ramdisk_init(RamDisk *ramdisk, void *ptr, size_t size);
 
 enum {
   APIC_LOCAL_ID = 0x20 / 4,
@@ -246,8 +457,13 @@ enum {
   APIC_SPURIOUS_VECTOR = 0xF0 / 4,
   APIC_LVT = 0x320 / 4,
   APIC_TIMER_TICKS = 0x380 / 4,
+  APIC_TIMER_DIVIDE = 0x3E0 / 4,
 };
 
+#define APIC_LVT_PERIODIC (1 << 17)
+// NOTE: Not calibrated, about a millisecond with the QEMU bus clock
+#define APIC_TIMER_PERIOD 1000000
+
 enum {
   IO_APIC_ID = 0,
   IO_APIC_VER = 1,
@@ -268,9 +484,202 @@ uint32_t read_ioapic_register(size_t io_apic_addr, size_t register_select);
 void write_ioapic_register(size_t io_apic_addr, size_t register_select, uint32_t value);
 void discover_pci_devices(MemoryManager *mm);
 
-#define SCANCODE_BUFFER_SIZE 128
+#define MAX_CPUS 16
+// NOTE: Vectors below are exceptions, 240 and up are fixed (timer)
+#define IRQ_DYNAMIC_START 0x30
+#define IRQ_DYNAMIC_END 0xF0
+
+// Runs in the interrupt handler, the end of interrupt is sent afterwards
+typedef void (*IrqHandler)(void *arg);
+
+typedef struct {
+  IrqHandler handler;
+  void *arg;
+} IrqVector;
+
+// NOTE: Every CPU has its own IDT vector space, so a vector number
+// only means something together with the CPU it was allocated on
+typedef struct {
+  uint32_t apic_id;
+  IrqVector vectors[256];
+  uint32_t vectors_used;
+  // Runs on the way out of device interrupts
+  DeferredWorkQueue work;
+} Cpu;
+
+Cpu CPUS[MAX_CPUS];
+uint32_t CPU_COUNT = 0;
+
+// Runs on every local APIC timer tick, before the preemption
+IrqVector TIMER_IRQ = {0};
+
+// Bit per index into CPUS
+typedef uint32_t CpuSet;
+#define CPU_SET_ALL ((CpuSet)-1)
+
+Cpu *register_cpu(uint32_t apic_id);
+// Looks up the CPU by its local APIC id, works with the user GS base loaded
+Cpu *get_current_cpu(void);
+// Returns 0 if all the vectors of the CPU are taken
+uint8_t alloc_irq_vector(Cpu *cpu, IrqHandler handler, void *arg);
+void free_irq_vector(Cpu *cpu, uint8_t vector);
+
+typedef struct {
+  uint32_t id; // pack_pci_id
+  volatile uint32_t *table; // 4 dwords per entry
+  uint16_t size;
+  uint8_t cap_offset;
+} PciMsix;
+
+#define PCI_MSIX_NO_VECTOR 0xFFFF
+
+// 4 KiB of configuration space per function, 1 MiB per bus
+#define PCI_ECAM_BUS_SIZE (1 << 20)
+
+typedef struct {
+  MemoryManager *mm;
+  paddr_t base; // 0 without ECAM
+  uint8_t start_bus;
+  uint8_t end_bus;
+  // Mapped on first access, only the buses that exist get touched
+  vaddr_t buses[256];
+} PciEcam;
+
+// Configuration space goes through the legacy IO ports until it is set up
+PciEcam PCI_ECAM = {0};
+
+// NOTE: PCI ids don't carry a segment, only segment 0 is used
+void setup_pci_ecam(MemoryManager *mm, BootData *data, PciEcam *out_ecam);
+uint32_t read_pci_register32(uint32_t id, uint32_t register_offset);
+uint16_t read_pci_register16(uint32_t id, uint32_t register_offset);
+uint8_t read_pci_register8(uint32_t id, uint32_t register_offset);
+void write_pci_register32(uint32_t id, uint32_t register_offset, uint32_t value);
+void write_pci_register16(uint32_t id, uint32_t register_offset, uint16_t value);
+uint32_t pack_pci_id(uint8_t bus, uint8_t device, uint8_t function);
+// Returns 0 if the device doesn't have the capability
+uint8_t find_pci_capability(uint32_t id, uint8_t cap_id);
+paddr_t read_pci_bar(uint32_t id, uint8_t bar);
+
+typedef struct {
+  paddr_t addr;
+  uint64_t size; // 0 if the BAR isn't implemented
+  bool is_prefetchable;
+} PciBar;
+
+// Sizes a memory BAR by writing all ones to it, with memory decoding turned off meanwhile
+PciBar probe_pci_bar(uint32_t id, uint8_t bar);
+// Maps the whole BAR, cache_flags is one of the PAGE_CACHE_* values
+volatile uint8_t *map_pci_bar(MemoryManager *mm, PciBar *bar, size_t cache_flags);
+// Maps the vector table and enables MSI-X with every entry masked,
+// returns false if the device doesn't support it
+bool setup_pci_msix(MemoryManager *mm, uint32_t id, PciMsix *out_msix);
+void set_pci_msix_vector(PciMsix *msix, uint16_t entry, Cpu *cpu, uint8_t vector);
+void mask_pci_msix_vector(PciMsix *msix, uint16_t entry);
+
+typedef struct {
+  vaddr_t regs;
+  uint32_t gsi_base;
+  uint32_t gsi_count;
+} IoApic;
+
+typedef struct {
+  uint32_t gsi;
+  uint16_t flags;
+} IsaIrqRoute;
+
+typedef struct {
+  IoApic io_apics[MAX_IO_APICS];
+  uint32_t io_apics_len;
+  // Identity mapped to global system interrupts, unless overridden
+  IsaIrqRoute isa_irqs[ISA_IRQ_COUNT];
+} IrqRouting;
+
+IrqRouting IRQ_ROUTING;
+
+// Maps every IO APIC and masks all of their inputs
+void setup_io_apics(MemoryManager *mm, BootData *data, IrqRouting *routing);
+// The CPU from the set with the fewest vectors gets the interrupt,
+// returns the vector or 0 if it couldn't be routed
+uint8_t request_gsi_irq(IrqRouting *routing, uint32_t gsi, uint16_t flags, CpuSet cpus, IrqHandler handler, void *arg);
+uint8_t request_isa_irq(IrqRouting *routing, uint8_t isa_irq, CpuSet cpus, IrqHandler handler, void *arg);
+Cpu *pick_cpu(CpuSet cpus);
+
+// NOTE: The virtio headers need PAGE_SIZE
+#include "virtio.h"
+#include "virtio_net.h"
+#include "blk_queue.h"
+
+// SOURCE: https://docs.oasis-open.org/virtio/virtio/v1.2/virtio-v1.2.html#x1-1240004
+typedef volatile struct {
+  uint32_t device_feature_select;
+  uint32_t device_feature;
+  uint32_t driver_feature_select;
+  uint32_t driver_feature;
+  uint16_t msix_config;
+  uint16_t num_queues;
+  uint8_t device_status;
+  uint8_t config_generation;
+
+  uint16_t queue_select;
+  uint16_t queue_size;
+  uint16_t queue_msix_vector;
+  uint16_t queue_enable;
+  uint16_t queue_notify_off;
+  uint64_t queue_desc;
+  uint64_t queue_driver;
+  uint64_t queue_device;
+} VirtioPciCommonCfg;
+
+#define VIRTIO_PCI_MAX_QUEUES 8
+
+// Modern (virtio 1.0) PCI transport, every queue gets its own MSI-X vector
+typedef struct {
+  VirtioDevice dev;
+  uint32_t pci_id;
+  VirtioPciCommonCfg *common;
+  volatile uint8_t *notify;
+  uint32_t notify_off_multiplier;
+  // NOTE: Only needed for INTx, which isn't supported
+  volatile uint8_t *isr;
+  PciMsix msix;
+  volatile uint16_t *queue_notify[VIRTIO_PCI_MAX_QUEUES];
+  uint8_t queue_vectors[VIRTIO_PCI_MAX_QUEUES]; // 0 if the queue has no interrupt
+  // Set by whoever drives the device, the interrupts before that only wake up waiters
+  IrqHandler handler;
+  void *handler_arg;
+  // Runs the handler after the end of interrupt
+  DeferredWork work;
+} VirtioPciDevice;
+
+#define MAX_VIRTIO_PCI_DEVICES 8
+
+// Found on the PCI bus, only the first device of each type gets a driver,
+// the driver's dev is NULL if there is none
+typedef struct {
+  VirtioPciDevice pci[MAX_VIRTIO_PCI_DEVICES];
+  uint32_t pci_len;
+  VirtioBlkdev blk;
+  BlkQueue blk_queue; // for the filesystems, set up after the discovery
+  VirtioNetdev net;
+  VirtioGpu gpu;
+  VirtioInput input;
+} VirtioDevices;
+
+VirtioDevices VIRTIO = {0};
+
+// Maps the capabilities of a virtio 1.0 device, returns false if something's missing
+bool setup_virtio_pci_device(MemoryManager *mm, uint32_t id, VirtioDeviceType type, VirtioPciDevice *out_dev);
+
+#define SCANCODE_BUFFER_SIZE 128 // power of 2
 uint8_t SCANCODE_BUFFER[SCANCODE_BUFFER_SIZE];
-uint32_t SCANCODE_POSITION = 0;
+// Pushed by the keyboard interrupt, popped by the console task
+SpscRing SCANCODES = SPSC_RING_INIT(SCANCODE_BUFFER);
+uint32_t SCANCODES_DROPPED = 0;
+WaitQueue SCANCODE_WAIT = {0};
+
+// src/kernel.c, the bootloader doesn't run tasks
+void handle_keyboard_interrupt(void *arg);
+void tick_task_runtime(void *arg);
 
 typedef struct PACKED {
   size_t rax; size_t rdi; size_t rsi; size_t rdx;
@@ -294,14 +703,174 @@ typedef struct {
   KernelThreadContext *thread_context;
 } IsrFrame;
 
+// NOTE: Cycles come from the TSC, updated on every switch between user and kernel mode
+typedef struct {
+  uint64_t user_cycles;
+  uint64_t kernel_cycles;
+  uint64_t context_switches;
+  uint64_t syscalls;
+  uint64_t last_tsc; // start of the current stretch in user or kernel mode
+  // Shown by the last refresh of top
+  uint64_t shown_user_cycles;
+  uint64_t shown_kernel_cycles;
+} ProcessStats;
+
 typedef struct Process {
   SyscallFrame frame;
   size_t sp;
   MemoryManager mm;
   struct Process *next;
   Sink *log_sink;
+  char name[32];
+  ProcessStats stats;
 } Process;
 
-void load_user_process(Process *p, MemoryManager *kernel_mm, const char *elf_file);
+typedef struct {
+  Process *first;
+} ProcessList;
+
+ProcessList PROCESSES;
+
+// Charges the time since the last call to user or kernel mode
+void account_process_time(Process *p, bool was_user);
+
+void load_user_process(Process *p, MemoryManager *kernel_mm, ElfImage *image);
+
+typedef enum {
+  THREAD_READY,
+  THREAD_RUNNING,
+  THREAD_BLOCKED,
+  THREAD_DEAD,
+} ThreadState;
+
+typedef void (*ThreadFn)(void *arg);
+
+#define THREAD_STACK_PAGES 4
+// A stack and the unmapped guard page below it
+#define THREAD_STACK_SLOT_SIZE ((THREAD_STACK_PAGES + 1) * PAGE_SIZE)
+#define MAX_THREADS 64
+// In timer ticks
+#define THREAD_TIME_SLICE 10
+
+typedef struct Thread {
+  size_t sp; // saved by switch_to
+  uint8_t *stack;
+  ThreadState state;
+  const char *name;
+  uint32_t ticks; // used up from the current time slice
+  Process *process; // user process run by this thread, if any
+  // KernelThreadContext fields of this thread while it's switched out
+  size_t kernel_sp;
+  size_t user_sp;
+  Process *user_process;
+  struct IpcWaiter *ipc_reply_to; // sender waiting for this thread's reply
+  struct Thread *next;
+} Thread;
+
+typedef struct {
+  KernelThreadContext *ctx;
+  MemoryManager *kernel_mm;
+  Thread *current;
+  Thread *first_ready;
+  Thread *last_ready;
+  // Boot thread, it runs the task runtime and never blocks
+  Thread boot;
+  uint32_t preempt_count;
+  Thread threads[MAX_THREADS];
+  Thread *free_threads;
+  // Exited threads waiting for reap_dead_threads to free their stacks
+  Thread *dead_threads;
+  vaddr_t stacks; // MAX_THREADS stack slots in the kernel address space
+} Scheduler;
+
+Scheduler SCHED;
+
+SYSV extern void switch_to(size_t *out_sp, size_t sp);
+SYSV extern void thread_start(void);
+
+void scheduler_init(Scheduler *s, KernelThreadContext *ctx, MemoryManager *kernel_mm);
+// Threads start out blocked, start_thread hands them to the scheduler
+Thread *create_thread(Scheduler *s, MemoryManager *mm, const char *name, ThreadFn entry, void *arg);
+Thread *create_user_thread(Scheduler *s, MemoryManager *mm, Process *p);
+void start_thread(Scheduler *s, Thread *t);
+void schedule(Scheduler *s);
+// Called from the timer interrupt
+void preempt(Scheduler *s);
+void block_thread(Scheduler *s);
+void wake_thread(Scheduler *s, Thread *t);
+NORETURN void exit_thread(void);
+// Has to run on the boot thread, with the kernel address space active
+void reap_dead_threads(Scheduler *s);
+void run_user_process(KernelThreadContext *ctx, Process *p);
+// Loads the ELF at path and starts running it on a new thread
+Process *spawn(MemoryManager *kernel_mm, Vfs *vfs, Str path, Sink *log_sink);
+
+// NOTE: Waiters live on the stack of the blocked thread
+typedef struct FutexWaiter {
+  paddr_t key; // physical address of the futex word
+  Thread *thread;
+  struct FutexWaiter *next;
+} FutexWaiter;
+
+#define FUTEX_HASH_BITS 6
+
+typedef struct {
+  FutexWaiter *buckets[1 << FUTEX_HASH_BITS];
+} FutexTable;
+
+FutexTable FUTEXES;
+
+SyscallError futex_wait(FutexTable *table, MemoryManager *mm, vaddr_t addr, uint32_t expected);
+// out_woken gets the number of waiters that were woken up
+SyscallError futex_wake(FutexTable *table, MemoryManager *mm, vaddr_t addr, uint32_t count, uint32_t *out_woken);
+
+#define MAX_IPC_ENDPOINTS 64
+
+typedef struct IpcWaiter {
+  Thread *thread;
+  Process *process;
+  IpcMessage msg;
+  SyscallError error; // the sender's result, set when the receiver can't take the pages
+  struct IpcWaiter *next;
+} IpcWaiter;
+
+typedef struct {
+  IpcWaiter *senders; // blocked until a receiver shows up, FIFO
+  IpcWaiter *receiver; // blocked until a sender shows up
+} IpcEndpoint;
+
+// NOTE: Endpoints are global and known to the processes by their index
+IpcEndpoint IPC_ENDPOINTS[MAX_IPC_ENDPOINTS];
+
+// Synchronous, blocks until the receiver replies, the reply is written to msg.
+// SYS_ERR_OUT_OF_MEMORY on either side if the receiver has no room for the pages
+SyscallError ipc_send(uint32_t endpoint, Process *p, IpcMessage *msg);
+SyscallError ipc_receive(uint32_t endpoint, Process *p, IpcMessage *out_msg);
+SyscallError ipc_reply(Process *p, IpcMessage *msg);
+
+#define MAX_SHARED_MEMORY 64
+
+// Physically contiguous frames that can be mapped into several processes.
+// The creator's handle and every mapping hold a reference.
+typedef struct {
+  paddr_t physical;
+  size_t size;
+  uint32_t ref_count; // free slot if zero
+  MemoryManager *owner; // only the creator can release its reference
+  bool is_released;
+} SharedMemory;
+
+typedef struct {
+  SharedMemory objects[MAX_SHARED_MEMORY];
+} SharedMemoryTable;
+
+// NOTE: Handles are global, processes can pass them to each other over IPC
+SharedMemoryTable SHARED_MEMORY;
+
+SyscallError create_shared_memory(SharedMemoryTable *table, MemoryManager *mm, size_t size, uint32_t *out_handle);
+// Maps at virtual, or anywhere if it's zero. SYS_ERR_OUT_OF_MEMORY without an object slot or a free range
+SyscallError map_shared_memory(SharedMemoryTable *table, MemoryManager *mm, uint32_t handle, vaddr_t *virtual, bool is_writable);
+SyscallError unmap_shared_memory(SharedMemoryTable *table, MemoryManager *mm, uint32_t handle, vaddr_t virtual);
+SyscallError release_shared_memory(SharedMemoryTable *table, MemoryManager *mm, uint32_t handle);
 
 #endif
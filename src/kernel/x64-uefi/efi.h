@@ -99,6 +99,9 @@ typedef enum {
     EFI_MAX_MEMORY_TYPE
 } EfiMemoryType;
 
+// NOTE: Types from 0x80000000 are reserved for the OS loader
+#define EFI_RAMDISK_MEMORY ((EfiMemoryType)0x80000000)
+
 typedef struct {
   uint32_t revision;
   void *parent_handle;
@@ -13,6 +13,15 @@
 #include "gdt.c"
 #include "apic.c"
 #include "process.c"
+#include "deferred_work.c"
+#include "thread.c"
+#include "futex.c"
+#include "ipc.c"
+#include "shared_memory.c"
+#include "ramdisk.c"
+#include "fs/fat.c"
+#include "fs/tar.c"
+#include "fs/vfs.c"
 
 #define MAX_PHYSICAL_RANGES 256
 PhysicalPageRange PAGE_RANGES[MAX_PHYSICAL_RANGES];
@@ -116,7 +125,7 @@ void parse_acpi_tables(BootData *data, Rsdp *rsdp) {
         };
 
         if (cnt->type == IO_APIC_TYPE) {
-          struct {
+          struct PACKED {
             Controller cnt;
             uint8_t io_apic_id;
             uint8_t reserved;
@@ -124,7 +133,30 @@ void parse_acpi_tables(BootData *data, Rsdp *rsdp) {
             uint32_t global_system_interrupt_base;
           } *config = (void *)cnt;
 
-          data->io_apic_addr = config->io_apic_addr;
+          if (data->io_apics_len >= MAX_IO_APICS) {
+            log("Too many IO APICs, skipping the one at %x", (size_t)config->io_apic_addr);
+            continue;
+          }
+          data->io_apics[data->io_apics_len++] = (IoApicInfo){
+            .addr = config->io_apic_addr,
+            .gsi_base = config->global_system_interrupt_base,
+          };
+        } else if (cnt->type == INTERRUPT_SOURCE_OVERRIDE) {
+          // SOURCE: https://uefi.org/specs/ACPI/6.6/05_ACPI_Software_Programming_Model.html#interrupt-source-override-structure
+          struct PACKED {
+            Controller cnt;
+            uint8_t bus; // always ISA
+            uint8_t source;
+            uint32_t global_system_interrupt;
+            uint16_t flags;
+          } *config = (void *)cnt;
+
+          if (data->irq_overrides_len >= MAX_IRQ_OVERRIDES || config->source >= ISA_IRQ_COUNT) continue;
+          data->irq_overrides[data->irq_overrides_len++] = (IrqOverride){
+            .isa_irq = config->source,
+            .gsi = config->global_system_interrupt,
+            .flags = config->flags,
+          };
         }
       }
 
@@ -141,12 +173,18 @@ void parse_acpi_tables(BootData *data, Rsdp *rsdp) {
           uint32_t reserved;
         } *config = (void *)((uint8_t *)header + offset);
 
-        DEBUGD(config->base_addr);
-        DEBUGD(config->pci_segment_group_number);
-        DEBUGD(config->start_pci_bus_number);
-        DEBUGD(config->end_pci_bus_number);
-
         offset += sizeof(*config);
+
+        if (data->pci_ecams_len >= MAX_PCI_ECAMS) {
+          log("Too many PCI segments, skipping segment %d", (size_t)config->pci_segment_group_number);
+          continue;
+        }
+        data->pci_ecams[data->pci_ecams_len++] = (PciEcamInfo){
+          .base = config->base_addr,
+          .segment = config->pci_segment_group_number,
+          .start_bus = config->start_pci_bus_number,
+          .end_bus = config->end_pci_bus_number,
+        };
       }
     }
   }
@@ -184,6 +222,7 @@ EFIAPI size_t efi_main(void *image_handle, EfiSystemTable *st) {
 
   BootData *data = (void *)alloc_pages2(&alloc, 1);
   ASSERT(sizeof(*data) <= PAGE_SIZE);
+  *data = (BootData){0};
 
   EfiGraphicsOutputProtocol *gop;
 
@@ -268,6 +307,22 @@ EFIAPI size_t efi_main(void *image_handle, EfiSystemTable *st) {
   load_elf_file(&alloc, pml4, (void *)kernel_addr, &kernel_entry);
   push_free_pages(&alloc, kernel_addr, size_in_pages);
 
+  EfiFileHandle *ramdisk_file = open_efi_file(root, L"initrd.tar", EFI_FILE_MODE_READ, 0);
+  ASSERT(ramdisk_file && "Failed to open ramdisk file");
+
+  status = get_efi_file_info(ramdisk_file, &file_info);
+  ASSERT(!status && "Failed to get ramdisk file info");
+
+  // NOTE: Kept out of the free memory passed to the kernel
+  size_t ramdisk_pages = (file_info.file_size + PAGE_SIZE - 1) / PAGE_SIZE;
+  status = st->boot_services->allocate_pages(EFI_ALLOC_ANY_PAGES,
+      EFI_RAMDISK_MEMORY, ramdisk_pages, &data->ramdisk_base);
+  ASSERT(!status && "Failed to allocate memory for the ramdisk");
+
+  data->ramdisk_size = file_info.file_size;
+  status = ramdisk_file->read(ramdisk_file, &data->ramdisk_size, (void *)data->ramdisk_base);
+  ASSERT(!status && "Failed to read ramdisk file");
+
   size_t virtual_offset = HIGHER_HALF;
 
   paddr_t kernel_stack = alloc_pages2(&alloc, 8);
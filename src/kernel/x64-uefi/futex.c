@@ -0,0 +1,75 @@
+#include "cmn/lib.h"
+#include "common.h"
+#include "arch.h"
+
+// NOTE: Keyed on physical addresses, so processes sharing memory can use
+// the same futex at different virtual addresses
+
+size_t futex_hash(paddr_t key) {
+  // SOURCE: https://en.wikipedia.org/wiki/Hash_function#Fibonacci_hashing
+  return ((key >> 2) * 0x9E3779B97F4A7C15ull) >> (64 - FUTEX_HASH_BITS);
+}
+
+// Physical address of a user futex word, 0 if the address isn't valid
+paddr_t futex_key(MemoryManager *mm, vaddr_t addr) {
+  if (addr % sizeof(uint32_t) || addr >= HIGHER_HALF) return 0;
+  size_t *entry = get_page_entry(mm, addr);
+  if (!entry || !(*entry & PAGE_BIT_PRESENT) || !(*entry & PAGE_BIT_USER)) return 0;
+  // NOTE: The frame of a copy-on-write page changes on the first write,
+  // waiters would be left behind on the shared one
+  if (*entry & PAGE_BIT_COPY_ON_WRITE) handle_copy_on_write(mm, addr);
+  return (*entry & PAGE_ADDR_MASK) + addr % PAGE_SIZE;
+}
+
+SyscallError futex_wait(FutexTable *table, MemoryManager *mm, vaddr_t addr, uint32_t expected) {
+  size_t irq = irq_save();
+  paddr_t key = futex_key(mm, addr);
+  if (!key) {
+    irq_restore(irq);
+    return SYS_ERR_BAD_ARG;
+  }
+
+  // NOTE: Interrupts stay disabled until the thread is blocked,
+  // so a wake can't slip in between the check and going to sleep
+  if (*(volatile uint32_t *)(key + mm->virtual_offset) != expected) {
+    irq_restore(irq);
+    return SYS_ERR_WOULD_BLOCK;
+  }
+
+  FutexWaiter waiter = {
+    .key = key,
+    .thread = SCHED.current,
+  };
+  FutexWaiter **link = &table->buckets[futex_hash(key)];
+  while (*link) link = &(*link)->next;
+  *link = &waiter;
+
+  block_thread(&SCHED);
+  irq_restore(irq);
+  return SYS_OK;
+}
+
+SyscallError futex_wake(FutexTable *table, MemoryManager *mm, vaddr_t addr, uint32_t count, uint32_t *out_woken) {
+  *out_woken = 0;
+  size_t irq = irq_save();
+  paddr_t key = futex_key(mm, addr);
+  if (!key) {
+    irq_restore(irq);
+    return SYS_ERR_BAD_ARG;
+  }
+
+  FutexWaiter **link = &table->buckets[futex_hash(key)];
+  while (*link && count) {
+    FutexWaiter *waiter = *link;
+    if (waiter->key != key) {
+      link = &waiter->next;
+      continue;
+    }
+    *link = waiter->next;
+    wake_thread(&SCHED, waiter->thread);
+    (*out_woken)++;
+    count--;
+  }
+  irq_restore(irq);
+  return SYS_OK;
+}
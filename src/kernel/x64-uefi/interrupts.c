@@ -2,7 +2,7 @@
 #include "common.h"
 #include "arch.h"
 
-void set_idt_descriptor(InterruptDescriptor *idt, uint8_t descriptor_index, size_t handler, uint8_t flags) {
+void set_idt_descriptor(InterruptDescriptor *idt, uint8_t descriptor_index, size_t handler, uint8_t flags, uint8_t ist) {
   // SOURCE: https://wiki.osdev.org/Interrupt_Descriptor_Table#Gate_Descriptor_2
   InterruptDescriptor *desc = &idt[descriptor_index];
   *desc = (InterruptDescriptor){
@@ -12,7 +12,7 @@ void set_idt_descriptor(InterruptDescriptor *idt, uint8_t descriptor_index, size
     .isr16_31 = (handler >> 16) & 0xFFFF,
     .isr32_63 = handler >> 32,
     .reserved = 0,
-    .interrupt_stack_table = 01,
+    .interrupt_stack_table = ist,
   };
 }
 
@@ -31,8 +31,10 @@ void setup_idt(InterruptDescriptor *idt) {
   uint8_t flags = 0xEE;
   size_t vectors = (size_t)ISR_VECTORS;
 
+  // NOTE: Exceptions get their own stack, device interrupts run on the stack
+  // of the interrupted thread, so the handler can switch to another thread
   for (size_t i = 0; i < 256; ++i) {
-    set_idt_descriptor(idt, i, vectors + i * 16, flags);
+    set_idt_descriptor(idt, i, vectors + i * 16, flags, i < IDT_IRQ_START ? 1 : 0);
   }
 
   IdtPtr idt_ptr = { sizeof(*idt) * 256 - 1, idt };
@@ -48,7 +50,7 @@ typedef enum {
   INT_SYSCALL = 0x80,
 } InterruptVector;
 
-SYSV IsrFrame *interrupt_handler(IsrFrame *frame) {
+IsrFrame *handle_interrupt(IsrFrame *frame) {
   switch (frame->vector_number) {
     case INT_BREAKPOINT: {
       log("Brekpoint");
@@ -59,24 +61,28 @@ SYSV IsrFrame *interrupt_handler(IsrFrame *frame) {
     case INT_PAGE_FAULT: {
       size_t cr2;
       ASM("mov %0, cr2" : "=r"(cr2));
+      Process *p = SCHED.current ? SCHED.current->process : NULL;
+      size_t cow_fault = PAGE_FAULT_PROTECTION_VIOLATION | PAGE_FAULT_CAUSED_BY_WRITE;
+      if (p && (frame->error_code & cow_fault) == cow_fault && handle_copy_on_write(&p->mm, cr2)) {
+        return frame;
+      }
       log("Page fault, cr2=%X", cr2);
     } break;
     case 240: {
-      // prints(LOG_SINK, ".");
-      APIC.regs[APIC_TIMER_TICKS] = 1000000000;
-      APIC.regs[APIC_END_OF_INTERRUPT] = 0;
-      return frame;
-    } break;
-    case 241: {
-      uint8_t scancode;
-      READ_PORT(0x60, scancode);
-      if (scancode) {
-        SCANCODE_BUFFER[SCANCODE_POSITION++ % SCANCODE_BUFFER_SIZE] = scancode;
-      }
+      if (TIMER_IRQ.handler) TIMER_IRQ.handler(TIMER_IRQ.arg);
       APIC.regs[APIC_END_OF_INTERRUPT] = 0;
+      preempt(&SCHED);
       return frame;
     } break;
     default: {
+      if (frame->vector_number >= IRQ_DYNAMIC_START && frame->vector_number < IRQ_DYNAMIC_END) {
+        IrqVector *v = &get_current_cpu()->vectors[frame->vector_number];
+        if (v->handler) {
+          v->handler(v->arg);
+          APIC.regs[APIC_END_OF_INTERRUPT] = 0;
+          return frame;
+        }
+      }
       log("An interrupt occured: vector=%d", frame->vector_number);
     } break;
   }
@@ -88,3 +94,14 @@ SYSV IsrFrame *interrupt_handler(IsrFrame *frame) {
   for(;;) WFI();
   UNREACHABLE();
 }
+
+SYSV IsrFrame *interrupt_handler(IsrFrame *frame) {
+  Process *p = SCHED.current ? SCHED.current->process : NULL;
+  bool from_user = p && (frame->cs & 3) == 3;
+  if (from_user) account_process_time(p, true);
+  frame = handle_interrupt(frame);
+  // NOTE: The end of interrupt was sent already, so the work can be interrupted
+  if (frame->vector_number >= IDT_IRQ_START) run_deferred_work(&get_current_cpu()->work);
+  if (from_user) account_process_time(p, false);
+  return frame;
+}
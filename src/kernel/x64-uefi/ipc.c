@@ -0,0 +1,142 @@
+#include "cmn/lib.h"
+#include "common.h"
+#include "arch.h"
+
+// NOTE: Rendezvous style, the sender blocks until the receiver replies.
+// Everything runs with interrupts disabled, like the rest of the scheduler.
+
+// Only private pages can be moved, shared and copy-on-write frames stay where they are
+bool ipc_check_pages(MemoryManager *mm, IpcMessage *msg) {
+  if (!msg->page_count) return true;
+  if (msg->pages % PAGE_SIZE || msg->pages >= HIGHER_HALF) return false;
+  if (msg->page_count > (HIGHER_HALF - msg->pages) / PAGE_SIZE) return false;
+
+  // NOTE: The pages leave the sender's object, which is split in two if they're in the middle
+  vaddr_t end = msg->pages + msg->page_count * PAGE_SIZE;
+  VirtualObject *obj = find_virtual_object(mm, msg->pages);
+  if (!obj || obj->private_frames || end > obj->virtual + obj->size) return false;
+  bool is_split = msg->pages > obj->virtual && end < obj->virtual + obj->size;
+  if (is_split && !free_virtual_objects(mm)) return false;
+
+  for (size_t i = 0; i < msg->page_count; ++i) {
+    size_t *entry = get_page_entry(mm, msg->pages + i * PAGE_SIZE);
+    if (!entry) return false;
+    size_t required = PAGE_BIT_PRESENT | PAGE_BIT_USER | PAGE_BIT_WRITABLE;
+    if ((*entry & required) != required || (*entry & PAGE_BIT_SHARED)) return false;
+  }
+  return true;
+}
+
+// Copies the words and remaps the pages into a free range of the receiver.
+// Returns false without touching either side if the receiver has no room for the pages
+bool ipc_transfer(IpcMessage *msg, MemoryManager *from, MemoryManager *to, IpcMessage *out) {
+  size_t size = msg->page_count * PAGE_SIZE;
+  // NOTE: Within one process the sender's split takes a slot too
+  uint32_t slots = from == to ? 2 : 1;
+  if (msg->page_count && (free_virtual_objects(to) < slots || !find_free_virtual(to, size))) {
+    return false;
+  }
+
+  memcpy(out->words, msg->words, sizeof(out->words));
+  out->pages = 0;
+  out->page_count = msg->page_count;
+  if (!msg->page_count) return true;
+
+  remove_virtual_range(from, msg->pages, size);
+  out->pages = alloc_virtual(to, size);
+  for (size_t i = 0; i < msg->page_count; ++i) {
+    paddr_t physical = unmap_page(from, msg->pages + i * PAGE_SIZE);
+    map_page2(to, physical, out->pages + i * PAGE_SIZE,
+        PAGE_BIT_PRESENT | PAGE_BIT_WRITABLE | PAGE_BIT_USER);
+  }
+  return true;
+}
+
+SyscallError ipc_send(uint32_t endpoint, Process *p, IpcMessage *msg) {
+  if (endpoint >= MAX_IPC_ENDPOINTS || !ipc_check_pages(&p->mm, msg)) return SYS_ERR_BAD_ARG;
+  IpcEndpoint *ep = &IPC_ENDPOINTS[endpoint];
+
+  size_t irq = irq_save();
+  IpcWaiter self = {
+    .thread = SCHED.current,
+    .process = p,
+    .msg = *msg,
+  };
+
+  if (ep->receiver) {
+    IpcWaiter *receiver = ep->receiver;
+    // The receiver keeps waiting for a message it can take
+    if (!ipc_transfer(msg, &p->mm, &receiver->process->mm, &receiver->msg)) {
+      irq_restore(irq);
+      return SYS_ERR_OUT_OF_MEMORY;
+    }
+    ep->receiver = NULL;
+    receiver->thread->ipc_reply_to = &self;
+    wake_thread(&SCHED, receiver->thread);
+  } else {
+    IpcWaiter **link = &ep->senders;
+    while (*link) link = &(*link)->next;
+    *link = &self;
+  }
+
+  // Woken up by the reply, which is already in self.msg, or by the rejection
+  block_thread(&SCHED);
+  *msg = self.msg;
+  irq_restore(irq);
+  return self.error;
+}
+
+SyscallError ipc_receive(uint32_t endpoint, Process *p, IpcMessage *out_msg) {
+  if (endpoint >= MAX_IPC_ENDPOINTS) return SYS_ERR_BAD_ARG;
+  IpcEndpoint *ep = &IPC_ENDPOINTS[endpoint];
+  Thread *current = SCHED.current;
+
+  size_t irq = irq_save();
+  // NOTE: One reply at a time, the previous sender has to be answered first
+  if (current->ipc_reply_to || ep->receiver) {
+    irq_restore(irq);
+    return SYS_ERR_BUSY;
+  }
+
+  if (ep->senders) {
+    IpcWaiter *sender = ep->senders;
+    ep->senders = sender->next;
+    // NOTE: Both sides learn about it, the sender's pages stay where they are
+    if (!ipc_transfer(&sender->msg, &sender->process->mm, &p->mm, out_msg)) {
+      sender->error = SYS_ERR_OUT_OF_MEMORY;
+      wake_thread(&SCHED, sender->thread);
+      irq_restore(irq);
+      return SYS_ERR_OUT_OF_MEMORY;
+    }
+    current->ipc_reply_to = sender;
+    irq_restore(irq);
+    return SYS_OK;
+  }
+
+  IpcWaiter self = {
+    .thread = current,
+    .process = p,
+  };
+  ep->receiver = &self;
+  block_thread(&SCHED);
+  *out_msg = self.msg;
+  irq_restore(irq);
+  return SYS_OK;
+}
+
+SyscallError ipc_reply(Process *p, IpcMessage *msg) {
+  Thread *current = SCHED.current;
+  if (!current->ipc_reply_to || !ipc_check_pages(&p->mm, msg)) return SYS_ERR_BAD_ARG;
+
+  size_t irq = irq_save();
+  IpcWaiter *sender = current->ipc_reply_to;
+  // The sender keeps waiting, the reply can be sent again with fewer pages
+  if (!ipc_transfer(msg, &p->mm, &sender->process->mm, &sender->msg)) {
+    irq_restore(irq);
+    return SYS_ERR_OUT_OF_MEMORY;
+  }
+  current->ipc_reply_to = NULL;
+  wake_thread(&SCHED, sender->thread);
+  irq_restore(irq);
+  return SYS_OK;
+}
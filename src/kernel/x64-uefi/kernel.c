@@ -10,19 +10,34 @@
 #include "drawing.c"
 #include "elf.c"
 #include "apic.c"
+#include "virtio.c"
+#include "virtio_blk.c"
+#include "blk_queue.c"
+#include "virtio_net.c"
+#include "virtio_gpu.c"
+#include "virtio_input.c"
 #include "pci.c"
 #include "text_input.c"
 #include "console.c"
 #include "logging.c"
 #include "process.c"
+#include "task.c"
+#include "deferred_work.c"
+#include "thread.c"
+#include "futex.c"
+#include "ipc.c"
+#include "shared_memory.c"
+#include "ramdisk.c"
+#include "fs/fat.c"
+#include "fs/tar.c"
+#include "fs/vfs.c"
 
 INCLUDE_ASM("utils.s");
 
-extern char FONT_FILE[], USER_FILE1[], USER_FILE2[];
+extern char FONT_FILE[];
 __asm__("FONT_FILE: .incbin \"res/font1.psf\"");
-__asm__("USER_FILE1: .incbin \"out/x64-uefi/user_main1.elf\"");
-__asm__("USER_FILE2: .incbin \"out/x64-uefi/user_main2.elf\"");
 
+Vfs VFS;
 Tss TSS;
 GdtEntry GDT[GDT_COUNT];
 ALIGNED(16) InterruptDescriptor IDT[256];
@@ -52,10 +67,322 @@ Error colored_write(void *data, const void *buffer, uint32_t limit) {
   return err;
 }
 
+#define LOG_CHUNK_SIZE 31
+#define LOG_RING_CHUNKS 128 // power of 2
+#define LOG_BATCH 8
+
+typedef struct {
+  uint8_t len;
+  char bytes[LOG_CHUNK_SIZE];
+} LogChunk;
+
+// Writes only queue the bytes and the log task draws them later, so system
+// calls don't wait on the console with interrupts disabled
+typedef struct BufferedSink {
+  Sink sink;
+  Sink *target;
+  MpscRing ring;
+  LogChunk chunks[LOG_RING_CHUNKS];
+  uint32_t sequences[LOG_RING_CHUNKS];
+  uint32_t dropped; // bytes that didn't fit
+  struct BufferedSink *next;
+} BufferedSink;
+
+BufferedSink *BUFFERED_SINKS = NULL;
+WaitQueue LOG_WAIT = {0};
+
+Error buffered_write(void *data, const void *buffer, uint32_t limit) {
+  BufferedSink *this = data;
+  const char *bytes = buffer;
+  Error err = OK;
+
+  while (limit) {
+    LogChunk chunks[LOG_BATCH];
+    uint32_t count = 0;
+    for (; count < LOG_BATCH && limit; ++count) {
+      uint32_t len = MIN(limit, LOG_CHUNK_SIZE);
+      chunks[count].len = len;
+      memcpy(chunks[count].bytes, bytes, len);
+      bytes += len;
+      limit -= len;
+    }
+
+    uint32_t pushed = mpsc_ring_push_batch(&this->ring, chunks, count);
+    if (pushed < count) {
+      uint32_t dropped = limit;
+      for (uint32_t i = pushed; i < count; ++i) dropped += chunks[i].len;
+      __atomic_fetch_add(&this->dropped, dropped, __ATOMIC_RELAXED);
+      err = ERR_OUT_OF_SPACE;
+      break;
+    }
+  }
+  wake_all(&TASKS, &LOG_WAIT);
+  return err;
+}
+
+void buffered_sink_init(BufferedSink *this, Sink *target) {
+  this->sink.write = buffered_write;
+  this->target = target;
+  this->dropped = 0;
+  mpsc_ring_init(&this->ring, this->chunks, this->sequences, sizeof(LogChunk), LOG_RING_CHUNKS);
+  this->next = BUFFERED_SINKS;
+  BUFFERED_SINKS = this;
+}
+
+bool has_buffered_logs(void) {
+  for (BufferedSink *s = BUFFERED_SINKS; s; s = s->next) {
+    if (mpsc_ring_can_pop(&s->ring)) return true;
+  }
+  return false;
+}
+
+void run_log_task(Task *task) {
+  BEGIN_TASK(task);
+  for (;;) {
+    AWAIT_EVENT(task, &LOG_WAIT, has_buffered_logs());
+
+    for (BufferedSink *s = BUFFERED_SINKS; s; s = s->next) {
+      LogChunk chunks[LOG_BATCH];
+      uint32_t count;
+      while ((count = mpsc_ring_pop_batch(&s->ring, chunks, LOG_BATCH))) {
+        for (uint32_t i = 0; i < count; ++i) write(s->target, chunks[i].bytes, chunks[i].len);
+      }
+      uint32_t dropped = __atomic_exchange_n(&s->dropped, 0, __ATOMIC_RELAXED);
+      if (dropped) prints(s->target, "\n[%d bytes of log dropped]\n", (size_t)dropped);
+    }
+  }
+  END_TASK(task);
+}
+
+// In timer ticks
+#define TOP_REFRESH_TICKS 1000
+
+void draw_top(Console *console, uint64_t *last_tsc) {
+  uint64_t now = read_tsc();
+  uint64_t elapsed = MAX(now - *last_tsc, 1);
+  *last_tsc = now;
+
+  clear_console(console);
+  prints(&console->sink, "name, user %%, kernel %%, user Mcycles, kernel Mcycles, context switches, syscalls\n");
+  for (Process *p = PROCESSES.first; p; p = p->next) {
+    ProcessStats *stats = &p->stats;
+    uint64_t user = stats->user_cycles;
+    uint64_t kernel = stats->kernel_cycles;
+    prints(&console->sink, "%s, %d, %d, %d, %d, %d, %d\n", p->name,
+        (user - stats->shown_user_cycles) * 100 / elapsed,
+        (kernel - stats->shown_kernel_cycles) * 100 / elapsed,
+        user / 1000000, kernel / 1000000,
+        stats->context_switches, stats->syscalls);
+    stats->shown_user_cycles = user;
+    stats->shown_kernel_cycles = kernel;
+  }
+  prints(&console->sink, "\nPress any key to exit\n");
+}
+
+#ifdef BENCHMARK_VIRTIO_BLK
+#define BENCHMARK_VIRTIO_BLK_READS 10000
+
+uint32_t BENCHMARK_QUEUE_DEPTHS[] = {1, 4, 16, 64};
+
+void benchmark_read_done(VirtioBlkRequest *req) {
+  uint32_t *done = req->arg;
+  ++*done;
+}
+
+// 4K random reads with up to depth of them in flight, returns cycles per read
+uint64_t benchmark_virtio_blk_reads(VirtioBlkdev *blkdev, uint8_t *buffer, uint32_t depth) {
+  uint64_t blocks = blkdev->blk.sector_capacity / 8;
+  uint64_t state = 0x9e3779b97f4a7c15;
+  uint32_t submitted = 0, done = 0;
+  uint64_t start = read_tsc();
+  while (done < BENCHMARK_VIRTIO_BLK_READS) {
+    while (submitted < BENCHMARK_VIRTIO_BLK_READS && submitted - done < depth) {
+      // SOURCE: https://en.wikipedia.org/wiki/Xorshift
+      uint64_t next = state ^ state << 13;
+      next ^= next >> 7;
+      next ^= next << 17;
+      // NOTE: The reads share the buffer, nobody looks at the data
+      if (!virtio_blk_submit(blkdev, buffer, (next % blocks) * 8, 8, false, benchmark_read_done, &done)) break;
+      state = next;
+      submitted++;
+    }
+    if (!virtio_blk_complete(blkdev)) virtq_wait_used(blkdev->vq);
+  }
+  return (read_tsc() - start) / BENCHMARK_VIRTIO_BLK_READS;
+}
+
+void benchmark_virtio_blk_depths(VirtioBlkdev *blkdev, uint8_t *buffer, const char *layout) {
+  for (uint32_t i = 0; i < ARRAY_LEN(BENCHMARK_QUEUE_DEPTHS); ++i) {
+    uint32_t depth = BENCHMARK_QUEUE_DEPTHS[i];
+    uint64_t cycles = benchmark_virtio_blk_reads(blkdev, buffer, depth);
+    log("benchmark: %s ring, queue depth %d, %d cycles per read", layout, (size_t)depth, cycles);
+  }
+}
+
+// Compares the split and packed layouts on the same device, which is
+// torn down and set up again for each
+void benchmark_virtio_blk(VirtioDevices *virtio) {
+  if (!virtio->blk.dev || virtio->blk.blk.sector_capacity < 8) {
+    log("benchmark: no virtio_blkdev with a 4K block");
+    return;
+  }
+  VirtioDevice *dev = virtio->blk.dev;
+  uint8_t *buffer = alloc_dma_pages(1);
+  uint64_t ring_features = VIRTIO_RING_FEATURES;
+
+  VIRTIO_RING_FEATURES = ring_features & ~VIRTIO_F_RING_PACKED;
+  virtio_blk_destroy(&virtio->blk);
+  virtio->blk = virtio_blk_init(dev);
+  benchmark_virtio_blk_depths(&virtio->blk, buffer, "split");
+
+  VIRTIO_RING_FEATURES = ring_features;
+  virtio_blk_destroy(&virtio->blk);
+  virtio->blk = virtio_blk_init(dev);
+  if (virtio->blk.vq->is_packed) benchmark_virtio_blk_depths(&virtio->blk, buffer, "packed");
+  else log("benchmark: no packed ring support");
+  free_dma_pages(buffer, 1);
+}
+#endif
+
+#ifdef SYSCALL_TRACE
+#define SYSCALL_TRACE_SHOWN 10
+
+void draw_syscall_trace(Console *console, SyscallTraceRing *ring) {
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t len = MIN(head, SYSCALL_TRACE_SIZE);
+
+  // NOTE: Too big for the stack of a task
+  static uint32_t histograms[MAX_SYSCALL_TYPE][SYSCALL_LATENCY_BUCKETS];
+  memset(histograms, 0, sizeof(histograms));
+  for (uint64_t i = head - len; i < head; ++i) {
+    SyscallTraceEntry entry = ring->entries[i & (SYSCALL_TRACE_SIZE - 1)];
+    uint64_t cycles = entry.exit_tsc - entry.enter_tsc;
+    uint32_t bucket = MIN(63 - __builtin_clzll(cycles | 1), SYSCALL_LATENCY_BUCKETS - 1);
+    histograms[MIN(entry.type, MAX_SYSCALL_TYPE - 1)][bucket]++;
+
+    if (i + SYSCALL_TRACE_SHOWN < head) continue;
+    prints(&console->sink, "%s: syscall %d(%x, %x, %x) = %d, %d cycles\n",
+        entry.process->name, (size_t)entry.type, entry.args[0], entry.args[1], entry.args[2],
+        (size_t)entry.result, cycles);
+  }
+
+  prints(&console->sink, "Latency histograms, last %d calls, 2^n cycles: count\n", len);
+  for (uint32_t type = 0; type < MAX_SYSCALL_TYPE; ++type) {
+    bool is_empty = true;
+    for (uint32_t bucket = 0; bucket < SYSCALL_LATENCY_BUCKETS; ++bucket) {
+      uint32_t count = histograms[type][bucket];
+      if (!count) continue;
+      if (is_empty) prints(&console->sink, "syscall %d:", (size_t)type);
+      prints(&console->sink, " 2^%d: %d", (size_t)bucket, (size_t)count);
+      is_empty = false;
+    }
+    if (!is_empty) prints(&console->sink, "\n");
+  }
+}
+#endif
+
+void tick_task_runtime(void *arg) {
+  task_runtime_tick(arg);
+}
+
+void wake_scancode_readers(DeferredWork *work) {
+  wake_all(&TASKS, &SCANCODE_WAIT);
+}
+
+DeferredWork SCANCODE_WORK = { .run = wake_scancode_readers };
+
+void handle_keyboard_interrupt(void *arg) {
+  uint8_t scancode;
+  READ_PORT(0x60, scancode);
+  if (!scancode) return;
+  // NOTE: The newest key presses are lost when the console falls behind
+  if (!spsc_ring_push(&SCANCODES, &scancode)) SCANCODES_DROPPED++;
+  defer_work(&get_current_cpu()->work, &SCANCODE_WORK);
+}
+
+typedef struct {
+  Task task;
+  Console *console;
+  bool is_top_shown;
+  uint64_t top_tsc;
+} ConsoleTask;
+
+void run_console_task(Task *task) {
+  ConsoleTask *this = (void *)task;
+  Console *console = this->console;
+
+  BEGIN_TASK(task);
+  draw_console_prompt(console);
+
+  // SOURCE: https://wiki.osdev.org/PS/2_Keyboard
+  for (;;) {
+    AWAIT_EVENT(task, &SCANCODE_WAIT, !spsc_ring_is_empty(&SCANCODES));
+
+    uint8_t scancode;
+    while (spsc_ring_pop(&SCANCODES, &scancode)) {
+      // TODO: Support more scancodes
+      // TODO: Handling keys with multiple scancodes
+      uint32_t released = scancode >> 7;
+      scancode &= 128 - 1;
+      if (!scancode || scancode > KEY_F12) continue;
+
+      InputEvent event = {
+        .type = EV_KEY,
+        .code = scancode,
+        .value = released ? 0 : 1,
+      };
+
+      if (!push_console_input_event(console, event)) continue;
+
+      uint32_t len;
+      const char *cmd = strip_string(console->command_buffer, console->buffer_pos, &len);
+      if (len == 4 && are_strings_equal(cmd, "ping", 4)) {
+        prints(&console->sink, "pong\n");
+#ifdef SYSCALL_TRACE
+      } else if (len == 5 && are_strings_equal(cmd, "trace", 5)) {
+        draw_syscall_trace(console, &SYSCALL_TRACE_RING);
+#endif
+      } else if (len == 3 && are_strings_equal(cmd, "top", 3)) {
+        this->is_top_shown = true;
+        this->top_tsc = read_tsc();
+        console->buffer_pos = 0;
+        break;
+      } else {
+        prints(&console->sink, "Unknown command: '%S'\n", len, cmd);
+      }
+      console->buffer_pos = 0;
+      draw_console_prompt(console);
+    }
+
+    if (this->is_top_shown) {
+      // Redraw until a key gets pressed
+      while (this->is_top_shown) {
+        draw_top(console, &this->top_tsc);
+        SLEEP(task, TOP_REFRESH_TICKS);
+        uint8_t scancode;
+        while (spsc_ring_pop(&SCANCODES, &scancode)) {
+          if (!(scancode >> 7)) this->is_top_shown = false;
+        }
+      }
+      clear_console(console);
+      draw_console_prompt(console);
+    }
+  }
+  END_TASK(task);
+}
+
+// TODO: Hand the packets to a network stack
+void log_net_packet(void *arg, uint8_t *packet, uint32_t size) {
+  log("net: received %d bytes", (size_t)size);
+}
+
 void _start(BootData *data) {
   LOG_SINK = &QEMU_DEBUGCON_SINK;
 
   KernelThreadContext ctx = {0};
+#ifdef SYSCALL_TRACE
+  ctx.trace = &SYSCALL_TRACE_RING;
+#endif
 
   // TODO: Allocate interrupt stack per thread
   uint8_t *int_stack_end = &INTERUPT_STACK[sizeof(INTERUPT_STACK) - 8];
@@ -64,6 +391,10 @@ void _start(BootData *data) {
   setup_gdt_and_tss((GdtEntry *)GDT, &TSS, int_stack_end);
   setup_idt(IDT);
 
+  size_t cr0;
+  ASM("mov %0, cr0" : "=r"(cr0));
+  ASM("mov cr0, %0" :: "r"(cr0 | CR0_WRITE_PROTECT));
+
   ASSERT(data->ranges_len <= MAX_PHYSICAL_RANGES);
   memcpy(PAGE_RANGES, data->ranges, data->ranges_len * sizeof(PAGE_RANGES[0]));
 
@@ -93,9 +424,13 @@ void _start(BootData *data) {
     .pml4 = data->pml4,
     .virtual_offset = HIGHER_HALF,
   };
+  KERNEL_MM = &mm;
 
+  setup_pat();
+  // NOTE: The framebuffer is only written, write-combining turns the
+  // per-pixel stores into full bus writes
   data->fb.ptr = (void *)alloc_physical(&mm, (paddr_t)data->fb.ptr, data->fb.pitch * data->fb.height,
-      PAGE_BIT_WRITABLE | PAGE_BIT_PRESENT);
+      PAGE_BIT_WRITABLE | PAGE_BIT_PRESENT | PAGE_CACHE_WRITE_COMBINING);
 
   // Unmap the bootloader image
   // map_pages2(&mm, data->bootloader_image_base, 0, data->bootloader_image_size, 0);
@@ -123,24 +458,44 @@ void _start(BootData *data) {
   };
   LOG_SINK = &kernel_sink.sink;
 
+  TIMER_IRQ = (IrqVector){tick_task_runtime, &TASKS};
   setup_apic(&mm, &APIC);
   DEBUGD(APIC.id);
+  // TODO: Start the application processors
+  register_cpu(APIC.id >> 24);
 
+  setup_pci_ecam(&mm, data, &PCI_ECAM);
   discover_pci_devices(&mm);
 
-  vaddr_t io_apic = alloc_physical(&mm, data->io_apic_addr, PAGE_SIZE,
-      PAGE_BIT_PRESENT | PAGE_BIT_WRITABLE);
-  flush_page_table(&mm);
-
-  uint32_t ioapic_ver = read_ioapic_register(io_apic, IO_APIC_VER);
-  size_t input_count = ((ioapic_ver >> 16) & 0xFF) + 1;
-  DEBUGD(input_count);
+#ifdef BENCHMARK_VIRTIO_BLK
+  benchmark_virtio_blk(&VIRTIO);
+#endif
+  if (VIRTIO.blk.dev) blk_queue_init(&VIRTIO.blk_queue, &VIRTIO.blk, BLK_SCHED_DEADLINE);
+  if (VIRTIO.blk.dev && VIRTIO.blk.blk.sector_capacity) {
+    uint8_t *sector = alloc_dma_pages(1);
+    blk_v1_read_write_sectors(&VIRTIO.blk_queue.blk, sector, 0, 1, BLKDEV_READ);
+    log("virtio_blk sector 0: %S", 16, sector);
+
+    // A FAT32 disk goes through the request queue, so the cluster runs get merged
+    if (fat_is_fat32(sector)) {
+      static FatDriver fat_driver;
+      fat_driver = fat_driver_init(&VIRTIO.blk_queue.blk);
+      vfs_mount(&VFS, STR("/fat/"), &fat_driver.fs);
+      log("Mounted the virtio_blk FAT32 volume at /fat/");
+    }
+  }
 
-  uint32_t keyboard_reg = 0x10 + 2;
-  write_ioapic_register(io_apic, keyboard_reg, 0xF1);
-  write_ioapic_register(io_apic, keyboard_reg + 1, (size_t)APIC.id >> 56);
+  setup_io_apics(&mm, data, &IRQ_ROUTING);
+  enum {
+    ISA_IRQ_KEYBOARD = 1,
+  };
+  uint8_t keyboard_vector = request_isa_irq(&IRQ_ROUTING, ISA_IRQ_KEYBOARD, CPU_SET_ALL,
+      handle_keyboard_interrupt, NULL);
+  ASSERT(keyboard_vector);
 
   enable_system_calls(&ctx);
+  scheduler_init(&SCHED, &ctx, &mm);
+
   ColoredConsoleSink user_sink1 = {
     .sink.write = colored_write,
     .console = &console,
@@ -154,54 +509,48 @@ void _start(BootData *data) {
     .bg = 0x11111111,
   };
 
-  Process p1;
-  load_user_process(&p1, &mm, USER_FILE1);
-  p1.log_sink = &user_sink1.sink;
-  Process p2;
-  load_user_process(&p2, &mm, USER_FILE2);
-  p2.log_sink = &user_sink2.sink;
-
-  for (int i = 0; i < 5; ++i) {
-    run_user_process(&ctx, &p1);
-    run_user_process(&ctx, &p2);
-    log("Back in kernel");
-  }
+  void *ramdisk_ptr = (void *)alloc_physical(&mm, data->ramdisk_base, data->ramdisk_size, PAGE_BIT_PRESENT);
+  flush_page_table(&mm);
+  RamDisk ramdisk;
+  ramdisk_init(&ramdisk, ramdisk_ptr, data->ramdisk_size);
+  TarDriver tar_driver = tar_driver_init(&ramdisk.blk);
+  vfs_mount(&VFS, STR("/"), &tar_driver.fs);
 
-  ASM("sti");
+  // NOTE: Big for the stack, and the processes keep them forever anyway
+  static BufferedSink user_log1, user_log2, user_log3, user_log4;
+  buffered_sink_init(&user_log1, &user_sink1.sink);
+  buffered_sink_init(&user_log2, &user_sink2.sink);
+  buffered_sink_init(&user_log3, &user_sink1.sink);
+  buffered_sink_init(&user_log4, &user_sink2.sink);
 
-  uint32_t scancode_processed = 0;
+  spawn(&mm, &VFS, STR("/user_main1.elf"), &user_log1.sink);
+  spawn(&mm, &VFS, STR("/user_main2.elf"), &user_log2.sink);
+  // Futex wait and wake between two processes
+  spawn(&mm, &VFS, STR("/user_main3.elf"), &user_log3.sink);
+  spawn(&mm, &VFS, STR("/user_main4.elf"), &user_log4.sink);
 
-  draw_console_prompt(&console);
+  Task log_task;
+  task_spawn(&TASKS, &log_task, run_log_task);
 
-  // SOURCE: https://wiki.osdev.org/PS/2_Keyboard
-  for(;;) {
-    WFI();
-    uint32_t diff = SCANCODE_POSITION - scancode_processed;
-    for (uint32_t i = 0; i < diff; ++i) {
-      uint8_t scancode = SCANCODE_BUFFER[scancode_processed++ % SCANCODE_BUFFER_SIZE];
-      // TODO: Support more scancodes
-      // TODO: Handling keys with multiple scancodes
-      uint32_t released = scancode >> 7;
-      scancode &= 128 - 1;
-      if (!scancode || scancode > KEY_F12) continue;
+  ConsoleTask console_task = { .console = &console };
+  task_spawn(&TASKS, &console_task.task, run_console_task);
 
-      InputEvent event = {
-        .type = EV_KEY,
-        .code = scancode,
-        .value = released ? 0 : 1,
-      };
+  if (VIRTIO.net.dev) virtio_net_start_polling(&VIRTIO.net, log_net_packet, NULL);
 
-      if (!push_console_input_event(&console, event)) continue;
+  ASM("sti");
 
-      uint32_t len;
-      const char *cmd = strip_string(console.command_buffer, console.buffer_pos, &len);
-      if (len == 4 && are_strings_equal(cmd, "ping", 4)) {
-        prints(&console.sink, "pong\n");
-      } else {
-        prints(&console.sink, "Unknown command: '%S'\n", len, cmd);
-      }
-      console.buffer_pos = 0;
-      draw_console_prompt(&console);
+  // The boot thread runs the tasks and idles when nothing else can run
+  for (;;) {
+    reap_dead_threads(&SCHED);
+    if (run_tasks(&TASKS)) continue;
+    if (SCHED.first_ready) {
+      schedule(&SCHED);
+      continue;
     }
+    // NOTE: sti takes effect after the next instruction, so a wakeup
+    // can't slip in between checking the ready queues and halting
+    ASM("cli");
+    if (!TASKS.ready.first && !SCHED.first_ready) ASM("sti\n hlt");
+    ASM("sti");
   }
 }
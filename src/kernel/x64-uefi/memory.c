@@ -62,7 +62,10 @@ void map_page2(MemoryManager *mm, paddr_t physical, vaddr_t virtual, size_t flag
       paddr_t table_physical = alloc_pages2(mm->page_alloc, 1);
       vaddr_t table_addr = table_physical + mm->virtual_offset;
       memset((void *)table_addr, 0, PAGE_SIZE);
-      page_table->entries[index] = (table_physical & PAGE_ADDR_MASK) | flags;
+      // NOTE: Permissions and caching are decided by the last level, tables shared by
+      // read-only and writable pages can't restrict them
+      size_t table_flags = PAGE_BIT_PRESENT | PAGE_BIT_WRITABLE | (flags & PAGE_BIT_USER);
+      page_table->entries[index] = (table_physical & PAGE_ADDR_MASK) | table_flags;
     }
     page_table = (void *)((page_table->entries[index] & PAGE_ADDR_MASK) + mm->virtual_offset);
   }
@@ -85,47 +88,81 @@ void push_free_pages(PageAllocator2 *alloc, paddr_t physical_start, size_t page_
 
   size_t new_range_end = physical_start + page_count * PAGE_SIZE;
 
+  // NOTE: Shared by all threads, which can be preempted
+  size_t irq = irq_save();
   for (uint32_t i = 0; i < alloc->len; ++i) {
     PhysicalPageRange *range = &alloc->ranges[i];
     if (new_range_end == range->start) {
       range->start = physical_start;
       range->page_count += page_count;
+      irq_restore(irq);
       return;
     }
     if (physical_start == range->start + range->page_count * PAGE_SIZE) {
       range->page_count += page_count;
+      irq_restore(irq);
       return;
     }
   }
 
   alloc->ranges[alloc->len++] = (PhysicalPageRange){physical_start, page_count};
+  irq_restore(irq);
 }
 
-paddr_t alloc_pages2(PageAllocator2 *alloc, size_t page_count) {
+paddr_t try_alloc_pages2(PageAllocator2 *alloc, size_t page_count) {
+  size_t irq = irq_save();
   for (uint32_t i = 0; i < alloc->len; ++i) {
     PhysicalPageRange *range = &alloc->ranges[i];
     if (range->page_count == page_count) {
       paddr_t addr = range->start;
       *range = alloc->ranges[--alloc->len];
+      irq_restore(irq);
       return addr;
     } else if (range->page_count > page_count) {
       paddr_t addr = range->start;
       range->page_count -= page_count;
       range->start += page_count * PAGE_SIZE;
+      irq_restore(irq);
       return addr;
     }
   }
-  log("Failed to allocate %d physical pages", page_count);
-  ASSERT(0);
+  irq_restore(irq);
+  return 0;
+}
+
+paddr_t alloc_pages2(PageAllocator2 *alloc, size_t page_count) {
+  paddr_t addr = try_alloc_pages2(alloc, page_count);
+  if (!addr) {
+    log("Failed to allocate %d physical pages", page_count);
+    ASSERT(0);
+  }
+  return addr;
 }
 
 uint32_t push_virtual_object(MemoryManager *mm, VirtualObject obj) {
-  ASSERT(mm->objects_count < MAX_VIRTUAL_OBJECTS);
-  uint32_t index = mm->objects_count++;
+  uint32_t index = mm->free_object;
+  if (index) {
+    mm->free_object = mm->objects[index].next;
+  } else {
+    ASSERT(mm->objects_count < MAX_VIRTUAL_OBJECTS);
+    index = mm->objects_count++;
+  }
   mm->objects[index] = obj;
   return index;
 }
 
+void release_virtual_object(MemoryManager *mm, uint32_t index) {
+  mm->objects[index] = (VirtualObject){0};
+  mm->objects[index].next = mm->free_object;
+  mm->free_object = index;
+}
+
+uint32_t free_virtual_objects(MemoryManager *mm) {
+  uint32_t count = MAX_VIRTUAL_OBJECTS - mm->objects_count;
+  for (uint32_t index = mm->free_object; index; index = mm->objects[index].next) count++;
+  return count;
+}
+
 void map_virtual_range(MemoryManager *mm, vaddr_t virtual, paddr_t physical, size_t size, size_t flags) {
   ASSERT(virtual >= mm->start);
   ASSERT(virtual + size <= mm->end);
@@ -140,7 +177,7 @@ void map_virtual_range(MemoryManager *mm, vaddr_t virtual, paddr_t physical, siz
     obj_index = &obj->next;
   }
 
-  VirtualObject obj = {virtual, physical, size, *obj_index};
+  VirtualObject obj = {virtual, physical, size, *obj_index, 0};
   uint32_t index = push_virtual_object(mm, obj);
   *obj_index = index;
   // map_pages(&mm->page_alloc, mm->pml4, physical, virtual, size, flags);
@@ -151,33 +188,151 @@ void flush_page_table(MemoryManager *mm) {
   ASM("mov cr3, %0" :: "r"((size_t)mm->pml4 & PAGE_ADDR_MASK));
 }
 
+void setup_pat(void) {
+  // PAT0-3 and PAT4-7 are the same, the PAT bit in the page entries isn't used
+  uint32_t entries = PAT_WRITE_BACK | PAT_WRITE_COMBINING << 8 | PAT_UNCACHED << 16 | PAT_UNCACHEABLE << 24;
+  // NOTE: Nothing is mapped with PAGE_CACHE_WRITE_COMBINING yet, so there are no
+  // stale write-through lines or TLB entries, flush them anyway as the SDM asks
+  WRITE_MSR(MSR_PAT, entries, entries);
+  ASM("wbinvd" ::: "memory");
+  size_t cr3;
+  ASM("mov %0, cr3" : "=r"(cr3));
+  ASM("mov cr3, %0" :: "r"(cr3) : "memory");
+}
+
 void alloc_at(MemoryManager *mm, vaddr_t virtual, size_t size, size_t flags) {
   if (!size) return;
   paddr_t physical = alloc_pages2(mm->page_alloc, (size + PAGE_SIZE - 1) / PAGE_SIZE);
   map_virtual_range(mm, virtual, physical, size, flags);
 }
 
-vaddr_t alloc_physical(MemoryManager *mm, paddr_t physical, size_t size, size_t flags) {
+vaddr_t find_free_virtual(MemoryManager *mm, size_t size) {
   if (size == 0) return 0;
   size_t start = mm->start;
-  uint32_t *obj_index = &mm->first_object;
-
-  while (*obj_index) {
-    VirtualObject *obj = &mm->objects[*obj_index];
-    vaddr_t new_end = start + size;
-    if (new_end <= obj->virtual) break;
+  for (uint32_t index = mm->first_object; index; index = mm->objects[index].next) {
+    VirtualObject *obj = &mm->objects[index];
+    if (start + size <= obj->virtual) break;
     start = obj->virtual + obj->size;
-    obj_index = &obj->next;
   }
+  return start + size <= mm->end && start + size > start ? start : 0;
+}
+
+vaddr_t alloc_virtual(MemoryManager *mm, size_t size) {
+  if (size == 0) return 0;
+  vaddr_t start = find_free_virtual(mm, size);
+  ASSERT(start);
 
-  VirtualObject obj = {start, physical, size, *obj_index};
+  uint32_t *obj_index = &mm->first_object;
+  while (*obj_index && mm->objects[*obj_index].virtual < start) {
+    obj_index = &mm->objects[*obj_index].next;
+  }
+  VirtualObject obj = {start, 0, size, *obj_index, 0};
   uint32_t index = push_virtual_object(mm, obj);
   *obj_index = index;
+  return start;
+}
+
+vaddr_t alloc_physical(MemoryManager *mm, paddr_t physical, size_t size, size_t flags) {
+  vaddr_t start = alloc_virtual(mm, size);
+  if (!start) return 0;
+  find_virtual_object(mm, start)->physical = physical;
   // map_pages(&mm->page_alloc, mm->pml4, physical, start, size, flags);
   map_pages2(mm, physical, start, size, flags);
   return start;
 }
 
+bool is_virtual_range_free(MemoryManager *mm, vaddr_t virtual, size_t size) {
+  if (virtual < mm->start || virtual + size > mm->end || virtual + size < virtual) return false;
+  for (uint32_t index = mm->first_object; index; index = mm->objects[index].next) {
+    VirtualObject *obj = &mm->objects[index];
+    if (virtual < obj->virtual + obj->size && obj->virtual < virtual + size) return false;
+  }
+  return true;
+}
+
+bool remove_virtual_object(MemoryManager *mm, vaddr_t virtual, VirtualObject *out_obj) {
+  uint32_t *obj_index = &mm->first_object;
+  while (*obj_index) {
+    VirtualObject *obj = &mm->objects[*obj_index];
+    if (obj->virtual == virtual) {
+      uint32_t index = *obj_index;
+      *out_obj = *obj;
+      *obj_index = obj->next;
+      release_virtual_object(mm, index);
+      return true;
+    }
+    obj_index = &obj->next;
+  }
+  return false;
+}
+
+void remove_virtual_range(MemoryManager *mm, vaddr_t virtual, size_t size) {
+  uint32_t *obj_index = &mm->first_object;
+  while (*obj_index) {
+    VirtualObject *obj = &mm->objects[*obj_index];
+    vaddr_t obj_end = obj->virtual + obj->size;
+    if (virtual >= obj->virtual && virtual < obj_end) {
+      ASSERT(virtual + size <= obj_end);
+      size_t head = virtual - obj->virtual;
+      size_t tail = obj_end - (virtual + size);
+      if (!head && !tail) {
+        uint32_t index = *obj_index;
+        *obj_index = obj->next;
+        release_virtual_object(mm, index);
+        return;
+      }
+      if (head && tail) {
+        paddr_t physical = obj->physical ? obj->physical + head + size : 0;
+        VirtualObject rest = {virtual + size, physical, tail, obj->next, 0};
+        obj->next = push_virtual_object(mm, rest);
+      } else if (!head) {
+        obj->virtual += size;
+        if (obj->physical) obj->physical += size;
+      }
+      obj->size = head ? head : tail;
+      return;
+    }
+    obj_index = &obj->next;
+  }
+  ASSERT(0 && "Virtual range not found");
+}
+
+// Returns the frame that was mapped, the TLB entry is only flushed here
+// if mm is the active address space
+paddr_t unmap_page(MemoryManager *mm, vaddr_t virtual) {
+  size_t *entry = get_page_entry(mm, virtual);
+  if (!entry || !(*entry & PAGE_BIT_PRESENT)) return 0;
+  paddr_t physical = *entry & PAGE_ADDR_MASK;
+  *entry = 0;
+
+  size_t cr3;
+  ASM("mov %0, cr3" : "=r"(cr3));
+  if ((cr3 & PAGE_ADDR_MASK) == mm->pml4) ASM("invlpg [%0]" :: "r"(virtual) : "memory");
+  return physical;
+}
+
+void *alloc_dma_pages(uint32_t count) {
+  paddr_t physical = alloc_pages2(KERNEL_MM->page_alloc, count);
+  void *ptr = (void *)(physical + KERNEL_MM->virtual_offset);
+  memset(ptr, 0, count * PAGE_SIZE);
+  return ptr;
+}
+
+void free_dma_pages(void *ptr, uint32_t count) {
+  push_free_pages(KERNEL_MM->page_alloc, (vaddr_t)ptr - KERNEL_MM->virtual_offset, count);
+}
+
+uint64_t dma_address(void *ptr) {
+  vaddr_t virtual = (vaddr_t)ptr;
+  // Physical memory is mapped right below the dynamic mappings
+  if (virtual >= KERNEL_MM->virtual_offset && virtual < KERNEL_MM->start) {
+    return virtual - KERNEL_MM->virtual_offset;
+  }
+  size_t *entry = get_page_entry(KERNEL_MM, virtual);
+  ASSERT(entry && (*entry & PAGE_BIT_PRESENT));
+  return (*entry & PAGE_ADDR_MASK) | (virtual & (PAGE_SIZE - 1));
+}
+
 void *alloc(MemoryManager *mm, size_t size) {
   if (!size) return (void *)0;
   paddr_t physical = alloc_pages2(mm->page_alloc, (size + PAGE_SIZE - 1) / PAGE_SIZE);
@@ -190,10 +345,77 @@ void free(MemoryManager *mm, vaddr_t virtual) {
     VirtualObject *obj = &mm->objects[*obj_index];
     if (obj->virtual == virtual) {
       // TODO: Fre physical pages if it wasn't MMIO
-      // TODO: Keep a free list of available object slots
+      // TODO: Release the object slot with release_virtual_object
     }
   }
   ASSERT(0 && "Virtual address not found");
 }
 
+size_t *get_page_entry(MemoryManager *mm, vaddr_t virtual) {
+  uint32_t page_table_indices[4] = {
+    (virtual >> 39) % 512,
+    (virtual >> 30) % 512,
+    (virtual >> 21) % 512,
+    (virtual >> 12) % 512,
+  };
+
+  PageTable *page_table = (void *)(mm->pml4 + mm->virtual_offset);
+  for (int i = 0; i < 3; ++i) {
+    size_t entry = page_table->entries[page_table_indices[i]];
+    if (!(entry & PAGE_BIT_PRESENT)) return NULL;
+    page_table = (void *)((entry & PAGE_ADDR_MASK) + mm->virtual_offset);
+  }
+  return (size_t *)&page_table->entries[page_table_indices[3]];
+}
+
+VirtualObject *find_virtual_object(MemoryManager *mm, vaddr_t virtual) {
+  for (uint32_t index = mm->first_object; index; index = mm->objects[index].next) {
+    VirtualObject *obj = &mm->objects[index];
+    if (virtual >= obj->virtual && virtual < obj->virtual + obj->size) return obj;
+  }
+  return NULL;
+}
+
+void push_private_frame(MemoryManager *mm, VirtualObject *obj, paddr_t frame) {
+  PrivateFrames *list = obj->private_frames ? (void *)(obj->private_frames + mm->virtual_offset) : NULL;
+  if (!list || list->len == PRIVATE_FRAMES_CAPACITY) {
+    paddr_t physical = alloc_pages2(mm->page_alloc, 1);
+    PrivateFrames *new_list = (void *)(physical + mm->virtual_offset);
+    new_list->next = obj->private_frames;
+    new_list->len = 0;
+    obj->private_frames = physical;
+    list = new_list;
+  }
+  list->frames[list->len++] = frame;
+}
+
+void free_private_frames(MemoryManager *mm, VirtualObject *obj) {
+  while (obj->private_frames) {
+    PrivateFrames *list = (void *)(obj->private_frames + mm->virtual_offset);
+    for (size_t i = 0; i < list->len; ++i) push_free_pages(mm->page_alloc, list->frames[i], 1);
+    paddr_t page = obj->private_frames;
+    obj->private_frames = list->next;
+    push_free_pages(mm->page_alloc, page, 1);
+  }
+}
+
+// Gives the page its own copy of a shared frame, returns false if it wasn't copy-on-write
+bool handle_copy_on_write(MemoryManager *mm, vaddr_t virtual) {
+  size_t *entry = get_page_entry(mm, virtual);
+  if (!entry || !(*entry & PAGE_BIT_PRESENT) || !(*entry & PAGE_BIT_COPY_ON_WRITE)) return false;
+  VirtualObject *obj = find_virtual_object(mm, virtual);
+  ASSERT(obj);
+
+  paddr_t shared = *entry & PAGE_ADDR_MASK;
+  paddr_t physical = alloc_pages2(mm->page_alloc, 1);
+  memcpy((void *)(physical + mm->virtual_offset), (void *)(shared + mm->virtual_offset), PAGE_SIZE);
+  // NOTE: obj->physical still points at the shared frames
+  push_private_frame(mm, obj, physical);
+
+  size_t flags = (*entry & ~PAGE_ADDR_MASK & ~PAGE_BIT_COPY_ON_WRITE) | PAGE_BIT_WRITABLE;
+  *entry = physical | flags;
+  ASM("invlpg [%0]" :: "r"(virtual) : "memory");
+  return true;
+}
+
 // TODO: Add a function to change flags of an already mapped region or part of the region
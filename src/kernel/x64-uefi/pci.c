@@ -23,9 +23,110 @@ enum {
 
 enum {
   PCI_DEV_CONFIG_BAR0 = 0x10,
+  PCI_DEV_CONFIG_CAPABILITIES = 0x34,
 };
 
+enum {
+  PCI_BAR_IO_SPACE = 1 << 0,
+  PCI_BAR_TYPE_32BIT = 0 << 1,
+  PCI_BAR_TYPE_64BIT = 2 << 1,
+  PCI_BAR_TYPE_MASK = 3 << 1,
+  PCI_BAR_PREFETCHABLE = 1 << 3,
+};
+
+enum {
+  PCI_BRIDGE_CONFIG_PRIMARY_BUS = 0x18,
+  PCI_BRIDGE_CONFIG_SECONDARY_BUS = 0x19,
+};
+
+enum {
+  PCI_HEADER_TYPE_DEVICE = 0,
+  PCI_HEADER_TYPE_BRIDGE = 1,
+  PCI_HEADER_TYPE_MULTIFUNC = 0x80,
+};
+
+enum {
+  PCI_COMMAND_MEMORY_SPACE = 1 << 1,
+  PCI_COMMAND_BUS_MASTER = 1 << 2,
+  PCI_COMMAND_INTX_DISABLE = 1 << 10,
+};
+
+enum {
+  PCI_STATUS_CAPABILITIES = 1 << 4,
+};
+
+enum {
+  PCI_CAP_ID_MSIX = 0x11,
+  PCI_CAP_ID_VENDOR = 0x09,
+};
+
+// SOURCE: PCI Local Bus Specification 3.0, 6.8.2 MSI-X Capability and Table Structure
+enum {
+  PCI_MSIX_CONTROL = 2,
+  PCI_MSIX_TABLE = 4,
+};
+
+enum {
+  PCI_MSIX_CONTROL_FUNCTION_MASK = 1 << 14,
+  PCI_MSIX_CONTROL_ENABLE = 1 << 15,
+};
+
+enum {
+  PCI_MSIX_ENTRY_ADDR_LOW = 0,
+  PCI_MSIX_ENTRY_ADDR_HIGH = 1,
+  PCI_MSIX_ENTRY_DATA = 2,
+  PCI_MSIX_ENTRY_CONTROL = 3,
+};
+
+#define PCI_MSIX_ENTRY_MASKED 1
+
+// SOURCE: Intel SDM Volume 3, 11.11 Message Signalled Interrupts
+#define MSI_ADDRESS_BASE 0xFEE00000
+
+// SOURCE: PCI Express Base Specification 4.0, 7.2.2 Enhanced Configuration Access Mechanism
+enum {
+  PCI_CONFIG_SPACE_SIZE = 256,
+  PCIE_CONFIG_SPACE_SIZE = 4096,
+};
+
+void setup_pci_ecam(MemoryManager *mm, BootData *data, PciEcam *out_ecam) {
+  *out_ecam = (PciEcam){ .mm = mm };
+  for (uint32_t i = 0; i < data->pci_ecams_len; ++i) {
+    PciEcamInfo *info = &data->pci_ecams[i];
+    if (info->segment != 0) continue;
+    out_ecam->base = info->base;
+    out_ecam->start_bus = info->start_bus;
+    out_ecam->end_bus = info->end_bus;
+    log("PCIe ECAM at %x, buses %d-%d", info->base, (size_t)info->start_bus, (size_t)info->end_bus);
+    return;
+  }
+  log("No ECAM, using the legacy PCI configuration ports");
+}
+
+// Returns NULL if the bus isn't covered by ECAM
+volatile uint8_t *get_pci_ecam_register(uint32_t id, uint32_t register_offset) {
+  PciEcam *ecam = &PCI_ECAM;
+  uint8_t bus = id >> 16;
+  if (!ecam->base || bus < ecam->start_bus || bus > ecam->end_bus) return NULL;
+  ASSERT(register_offset < PCIE_CONFIG_SPACE_SIZE);
+
+  vaddr_t *regs = &ecam->buses[bus];
+  if (!*regs) {
+    paddr_t physical = ecam->base + (paddr_t)(bus - ecam->start_bus) * PCI_ECAM_BUS_SIZE;
+    // NOTE: Fresh mappings, there is nothing to flush from the TLB
+    *regs = alloc_physical(ecam->mm, physical, PCI_ECAM_BUS_SIZE,
+        PAGE_BIT_PRESENT | PAGE_BIT_WRITABLE | PAGE_CACHE_UNCACHEABLE);
+    ASSERT(*regs);
+  }
+  // Device and function move from bits 11 and 8 of the id to bits 15 and 12
+  return (volatile uint8_t *)(*regs + ((id & 0xFFFF) << 4) + register_offset);
+}
+
 uint32_t read_pci_register32(uint32_t id, uint32_t register_offset) {
+  volatile uint8_t *reg = get_pci_ecam_register(id, register_offset & ~3u);
+  if (reg) return *(volatile uint32_t *)reg;
+
+  ASSERT(register_offset < PCI_CONFIG_SPACE_SIZE);
   uint32_t addr = 0x80000000 | id | (register_offset & 0xFC);
   ASM("out %0, %1" :: "d"(PCI_PORT_CONFIG), "a"(addr));
   uint32_t value;
@@ -34,6 +135,10 @@ uint32_t read_pci_register32(uint32_t id, uint32_t register_offset) {
 }
 
 uint16_t read_pci_register16(uint32_t id, uint32_t register_offset) {
+  volatile uint8_t *reg = get_pci_ecam_register(id, register_offset & ~1u);
+  if (reg) return *(volatile uint16_t *)reg;
+
+  ASSERT(register_offset < PCI_CONFIG_SPACE_SIZE);
   uint32_t addr = 0x80000000 | id | (register_offset & 0xFC);
   ASM("out %0, %1" :: "d"(PCI_PORT_CONFIG), "a"(addr));
   uint16_t value;
@@ -42,6 +147,10 @@ uint16_t read_pci_register16(uint32_t id, uint32_t register_offset) {
 }
 
 uint8_t read_pci_register8(uint32_t id, uint32_t register_offset) {
+  volatile uint8_t *reg = get_pci_ecam_register(id, register_offset);
+  if (reg) return *reg;
+
+  ASSERT(register_offset < PCI_CONFIG_SPACE_SIZE);
   uint32_t addr = 0x80000000 | id | (register_offset & 0xFC);
   ASM("out %0, %1" :: "d"(PCI_PORT_CONFIG), "a"(addr));
   uint8_t value;
@@ -49,14 +158,431 @@ uint8_t read_pci_register8(uint32_t id, uint32_t register_offset) {
   return value;
 }
 
+void write_pci_register32(uint32_t id, uint32_t register_offset, uint32_t value) {
+  volatile uint8_t *reg = get_pci_ecam_register(id, register_offset & ~3u);
+  if (reg) {
+    *(volatile uint32_t *)reg = value;
+    return;
+  }
+
+  ASSERT(register_offset < PCI_CONFIG_SPACE_SIZE);
+  uint32_t addr = 0x80000000 | id | (register_offset & 0xFC);
+  ASM("out %0, %1" :: "d"(PCI_PORT_CONFIG), "a"(addr));
+  ASM("out %0, %1" :: "d"(PCI_PORT_DATA), "a"(value));
+}
+
+void write_pci_register16(uint32_t id, uint32_t register_offset, uint16_t value) {
+  volatile uint8_t *reg = get_pci_ecam_register(id, register_offset & ~1u);
+  if (reg) {
+    *(volatile uint16_t *)reg = value;
+    return;
+  }
+
+  ASSERT(register_offset < PCI_CONFIG_SPACE_SIZE);
+  uint32_t addr = 0x80000000 | id | (register_offset & 0xFC);
+  ASM("out %0, %1" :: "d"(PCI_PORT_CONFIG), "a"(addr));
+  ASM("out %0, %1" :: "d"(PCI_PORT_DATA + (register_offset & 0x2)), "a"(value));
+}
+
 uint32_t pack_pci_id(uint8_t bus, uint8_t device, uint8_t function) {
   return (bus << 16) | (device << 11) | (function << 8);
 }
 
+uint8_t find_pci_capability(uint32_t id, uint8_t cap_id) {
+  if (!(read_pci_register16(id, PCI_CONFIG_STATUS) & PCI_STATUS_CAPABILITIES)) return 0;
+
+  uint8_t offset = read_pci_register8(id, PCI_DEV_CONFIG_CAPABILITIES) & 0xFC;
+  // NOTE: Bounded in case of a looping list
+  for (uint32_t i = 0; offset && i < 48; ++i) {
+    if (read_pci_register8(id, offset) == cap_id) return offset;
+    offset = read_pci_register8(id, offset + 1) & 0xFC;
+  }
+  return 0;
+}
+
+paddr_t read_pci_bar(uint32_t id, uint8_t bar) {
+  ASSERT(bar <= 5);
+  uint32_t low = read_pci_register32(id, PCI_DEV_CONFIG_BAR0 + bar * 4);
+  ASSERT(!(low & PCI_BAR_IO_SPACE) && "Expected only memory space BAR");
+
+  paddr_t addr = low & 0xFFFFFFF0;
+  if ((low & PCI_BAR_TYPE_MASK) == PCI_BAR_TYPE_64BIT) {
+    addr |= (paddr_t)read_pci_register32(id, PCI_DEV_CONFIG_BAR0 + (bar + 1) * 4) << 32;
+  } else {
+    ASSERT((low & PCI_BAR_TYPE_MASK) == PCI_BAR_TYPE_32BIT && "Unsupported BAR type");
+  }
+  return addr;
+}
+
+// SOURCE: PCI Local Bus Specification 3.0, 6.2.5.1 Address Maps
+PciBar probe_pci_bar(uint32_t id, uint8_t bar) {
+  ASSERT(bar <= 5);
+  uint32_t offset = PCI_DEV_CONFIG_BAR0 + bar * 4;
+  uint32_t low = read_pci_register32(id, offset);
+  ASSERT(!(low & PCI_BAR_IO_SPACE) && "Expected only memory space BAR");
+  bool is_64bit = (low & PCI_BAR_TYPE_MASK) == PCI_BAR_TYPE_64BIT;
+  ASSERT((is_64bit || (low & PCI_BAR_TYPE_MASK) == PCI_BAR_TYPE_32BIT) && "Unsupported BAR type");
+  uint32_t high = is_64bit ? read_pci_register32(id, offset + 4) : 0;
+
+  // NOTE: The BAR points at all ones while it is sized, which
+  // could overlap another device if decoding stayed on
+  uint16_t command = read_pci_register16(id, PCI_CONFIG_COMMAND);
+  write_pci_register16(id, PCI_CONFIG_COMMAND, command & ~PCI_COMMAND_MEMORY_SPACE);
+
+  // The address bits below the size are hardwired to zero
+  write_pci_register32(id, offset, 0xFFFFFFFF);
+  uint64_t mask = read_pci_register32(id, offset) & 0xFFFFFFF0;
+  write_pci_register32(id, offset, low);
+  if (is_64bit) {
+    write_pci_register32(id, offset + 4, 0xFFFFFFFF);
+    mask |= (uint64_t)read_pci_register32(id, offset + 4) << 32;
+    write_pci_register32(id, offset + 4, high);
+  } else if (mask) {
+    mask |= 0xFFFFFFFF00000000;
+  }
+
+  write_pci_register16(id, PCI_CONFIG_COMMAND, command);
+
+  return (PciBar){
+    .addr = (low & 0xFFFFFFF0) | (paddr_t)high << 32,
+    .size = mask ? ~mask + 1 : 0,
+    .is_prefetchable = low & PCI_BAR_PREFETCHABLE,
+  };
+}
+
+volatile uint8_t *map_pci_bar(MemoryManager *mm, PciBar *bar, size_t cache_flags) {
+  ASSERT(bar->size);
+  // NOTE: BARs smaller than a page don't have to be page aligned
+  size_t page_offset = bar->addr & (PAGE_SIZE - 1);
+  vaddr_t ptr = alloc_physical(mm, bar->addr - page_offset, page_offset + bar->size,
+      PAGE_BIT_PRESENT | PAGE_BIT_WRITABLE | cache_flags);
+  ASSERT(ptr);
+  return (volatile uint8_t *)(ptr + page_offset);
+}
+
+bool setup_pci_msix(MemoryManager *mm, uint32_t id, PciMsix *out_msix) {
+  uint8_t cap = find_pci_capability(id, PCI_CAP_ID_MSIX);
+  if (!cap) return false;
+
+  uint16_t control = read_pci_register16(id, cap + PCI_MSIX_CONTROL);
+  uint32_t table = read_pci_register32(id, cap + PCI_MSIX_TABLE);
+  uint16_t size = (control & 0x7FF) + 1;
+
+  paddr_t table_addr = read_pci_bar(id, table & 7) + (table & ~7u);
+  // NOTE: The table doesn't have to be page aligned
+  size_t page_offset = table_addr & (PAGE_SIZE - 1);
+  vaddr_t table_ptr = alloc_physical(mm, table_addr - page_offset, page_offset + size * 16,
+      PAGE_BIT_PRESENT | PAGE_BIT_WRITABLE | PAGE_CACHE_UNCACHEABLE);
+  flush_page_table(mm);
+
+  *out_msix = (PciMsix){
+    .id = id,
+    .table = (void *)(table_ptr + page_offset),
+    .size = size,
+    .cap_offset = cap,
+  };
+
+  // Entries are unmasked one by one once they point at a vector
+  write_pci_register16(id, cap + PCI_MSIX_CONTROL, control | PCI_MSIX_CONTROL_FUNCTION_MASK);
+  for (uint16_t entry = 0; entry < size; ++entry) mask_pci_msix_vector(out_msix, entry);
+
+  uint16_t command = read_pci_register16(id, PCI_CONFIG_COMMAND);
+  write_pci_register16(id, PCI_CONFIG_COMMAND,
+      command | PCI_COMMAND_MEMORY_SPACE | PCI_COMMAND_BUS_MASTER | PCI_COMMAND_INTX_DISABLE);
+  write_pci_register16(id, cap + PCI_MSIX_CONTROL,
+      (control | PCI_MSIX_CONTROL_ENABLE) & ~PCI_MSIX_CONTROL_FUNCTION_MASK);
+  return true;
+}
+
+void set_pci_msix_vector(PciMsix *msix, uint16_t entry, Cpu *cpu, uint8_t vector) {
+  ASSERT(entry < msix->size);
+  volatile uint32_t *e = &msix->table[entry * 4];
+  // Fixed delivery, edge triggered, physical destination
+  e[PCI_MSIX_ENTRY_ADDR_LOW] = MSI_ADDRESS_BASE | (cpu->apic_id << 12);
+  e[PCI_MSIX_ENTRY_ADDR_HIGH] = 0;
+  e[PCI_MSIX_ENTRY_DATA] = vector;
+  e[PCI_MSIX_ENTRY_CONTROL] &= ~PCI_MSIX_ENTRY_MASKED;
+}
+
+void mask_pci_msix_vector(PciMsix *msix, uint16_t entry) {
+  ASSERT(entry < msix->size);
+  msix->table[entry * 4 + PCI_MSIX_ENTRY_CONTROL] |= PCI_MSIX_ENTRY_MASKED;
+}
+
+// NOTE: MSI-X entry 0 is for configuration changes, queue N uses entry N + 1
+// Returns the vector, 0 if the queue couldn't get one
+uint8_t route_virtio_queue_irq(VirtioPciCommonCfg *config, PciMsix *msix, uint16_t queue,
+    Cpu *cpu, IrqHandler handler, void *arg) {
+  uint16_t entry = queue + 1;
+  if (entry >= msix->size) return 0;
+
+  uint8_t vector = alloc_irq_vector(cpu, handler, arg);
+  if (!vector) return 0;
+
+  set_pci_msix_vector(msix, entry, cpu, vector);
+  config->queue_select = queue;
+  config->queue_msix_vector = entry;
+  // The device answers with PCI_MSIX_NO_VECTOR if it couldn't take the entry
+  if (config->queue_msix_vector != entry) {
+    mask_pci_msix_vector(msix, entry);
+    free_irq_vector(cpu, vector);
+    return 0;
+  }
+  return vector;
+}
+
+void run_virtio_pci_handler(DeferredWork *work) {
+  VirtioPciDevice *pci = (void *)((uint8_t *)work - offsetof(VirtioPciDevice, work));
+  if (pci->handler) pci->handler(pci->handler_arg);
+}
+
+// Every queue of the device has its own vector, so there is nothing to acknowledge.
+// NOTE: One work for all the queues, the handlers check every queue of their device
+void virtio_pci_handle_interrupt(void *arg) {
+  VirtioPciDevice *pci = arg;
+  defer_work(&get_current_cpu()->work, &pci->work);
+}
+
+uint8_t virtio_pci_get_status(VirtioDevice *dev) {
+  VirtioPciDevice *pci = (void *)dev;
+  return pci->common->device_status;
+}
+
+void virtio_pci_set_status(VirtioDevice *dev, uint8_t status) {
+  VirtioPciDevice *pci = (void *)dev;
+  pci->common->device_status = status;
+}
+
+uint64_t virtio_pci_get_features(VirtioDevice *dev) {
+  VirtioPciCommonCfg *common = ((VirtioPciDevice *)dev)->common;
+  common->device_feature_select = 0;
+  uint64_t features = common->device_feature;
+  common->device_feature_select = 1;
+  return features | (uint64_t)common->device_feature << 32;
+}
+
+void virtio_pci_set_features(VirtioDevice *dev, uint64_t features) {
+  VirtioPciCommonCfg *common = ((VirtioPciDevice *)dev)->common;
+  common->driver_feature_select = 0;
+  common->driver_feature = features;
+  common->driver_feature_select = 1;
+  common->driver_feature = features >> 32;
+}
+
+// NOTE: The 64-bit fields are written as two halves, the device doesn't have to take more
+void write_virtio_pci_u64(volatile uint64_t *field, uint64_t value) {
+  volatile uint32_t *halves = (volatile uint32_t *)field;
+  halves[0] = value;
+  halves[1] = value >> 32;
+}
+
+uint16_t virtio_pci_get_queue_size(VirtioDevice *dev, uint16_t index) {
+  VirtioPciCommonCfg *common = ((VirtioPciDevice *)dev)->common;
+  if (index >= common->num_queues || index >= VIRTIO_PCI_MAX_QUEUES) return 0;
+  common->queue_select = index;
+  return common->queue_size;
+}
+
+bool virtio_pci_setup_queue(VirtioDevice *dev, uint16_t index, Virtq *vq) {
+  VirtioPciDevice *pci = (void *)dev;
+  VirtioPciCommonCfg *common = pci->common;
+  if (index >= common->num_queues || index >= VIRTIO_PCI_MAX_QUEUES) return false;
+
+  common->queue_select = index;
+  // NOTE: The driver can only make the queue smaller
+  if (common->queue_size < vq->size) return false;
+  common->queue_size = vq->size;
+  uint64_t desc, driver, device;
+  virtq_get_areas(vq, &desc, &driver, &device);
+  write_virtio_pci_u64(&common->queue_desc, desc);
+  write_virtio_pci_u64(&common->queue_driver, driver);
+  write_virtio_pci_u64(&common->queue_device, device);
+
+  // Spread the queues over the CPUs, each queue interrupts only its own CPU
+  Cpu *cpu = &CPUS[index % CPU_COUNT];
+  pci->queue_vectors[index] = route_virtio_queue_irq(common, &pci->msix, index, cpu,
+      virtio_pci_handle_interrupt, pci);
+  if (!pci->queue_vectors[index]) {
+    log("No MSI-X vector for virtio queue %d", (size_t)index);
+  }
+
+  pci->queue_notify[index] = (volatile uint16_t *)(pci->notify +
+      common->queue_notify_off * pci->notify_off_multiplier);
+  common->queue_enable = 1;
+  return true;
+}
+
+// NOTE: The reset already took the vector off the queue on the device side
+void virtio_pci_release_queue(VirtioDevice *dev, uint16_t index) {
+  VirtioPciDevice *pci = (void *)dev;
+  ASSERT(index < VIRTIO_PCI_MAX_QUEUES);
+  uint8_t vector = pci->queue_vectors[index];
+  if (!vector) return;
+  mask_pci_msix_vector(&pci->msix, index + 1);
+  free_irq_vector(&CPUS[index % CPU_COUNT], vector);
+  pci->queue_vectors[index] = 0;
+}
+
+void virtio_pci_notify(VirtioDevice *dev, uint16_t index) {
+  VirtioPciDevice *pci = (void *)dev;
+  *pci->queue_notify[index] = index;
+}
+
+const VirtioTransport VIRTIO_PCI_TRANSPORT = {
+  .get_status = virtio_pci_get_status,
+  .set_status = virtio_pci_set_status,
+  .get_features = virtio_pci_get_features,
+  .set_features = virtio_pci_set_features,
+  .get_queue_size = virtio_pci_get_queue_size,
+  .setup_queue = virtio_pci_setup_queue,
+  .release_queue = virtio_pci_release_queue,
+  .notify = virtio_pci_notify,
+  .required_features = VIRTIO_F_VERSION_1,
+  // NOTE: Modern devices take the rings separately, 16 for the descriptors, 2 for the avail ring
+  .used_align = 4,
+};
+
+// SOURCE: https://docs.oasis-open.org/virtio/virtio/v1.2/virtio-v1.2.html#x1-1240004
+bool setup_virtio_pci_device(MemoryManager *mm, uint32_t id, VirtioDeviceType type, VirtioPciDevice *out_dev) {
+  enum {
+    VIRTIO_PCI_CAP_COMMON_CFG = 1,
+    VIRTIO_PCI_CAP_NOTIFY_CFG = 2,
+    VIRTIO_PCI_CAP_ISR_CFG = 3,
+    VIRTIO_PCI_CAP_DEVICE_CFG = 4,
+  };
+
+  *out_dev = (VirtioPciDevice){
+    .dev = {
+      .transport = &VIRTIO_PCI_TRANSPORT,
+      .type = type,
+    },
+    .pci_id = id,
+    .work.run = run_virtio_pci_handler,
+  };
+
+  // NOTE: The structures usually share a BAR, each BAR is mapped once
+  PciBar bars[6] = {0};
+  volatile uint8_t *bar_ptrs[6] = {0};
+
+  // NOTE: Bounded in case of a looping list
+  uint8_t cap_offset = find_pci_capability(id, PCI_CAP_ID_VENDOR);
+  for (uint32_t i = 0; cap_offset && i < 48; ++i) {
+    struct PACKED {
+      uint8_t vendor, next_offset, cap_len, config_type;
+      uint8_t bar, padding[3];
+      uint32_t config_offset;
+      uint32_t config_len;
+    } cap;
+
+    uint32_t *config_ints = (void *)&cap;
+    config_ints[0] = read_pci_register32(id, cap_offset + 0);
+    config_ints[1] = read_pci_register32(id, cap_offset + 4);
+    config_ints[2] = read_pci_register32(id, cap_offset + 8);
+    config_ints[3] = read_pci_register32(id, cap_offset + 12);
+
+    uint8_t this_offset = cap_offset;
+    cap_offset = cap.next_offset & 0xFC;
+    if (cap.vendor != PCI_CAP_ID_VENDOR || cap.bar > 5) continue;
+
+    // NOTE: The same structure can show up more than once, the first one is preferred
+    volatile uint8_t **target = NULL;
+    switch (cap.config_type) {
+      case VIRTIO_PCI_CAP_COMMON_CFG: target = (volatile uint8_t **)&out_dev->common; break;
+      case VIRTIO_PCI_CAP_NOTIFY_CFG: {
+        target = &out_dev->notify;
+        if (!*target) out_dev->notify_off_multiplier = read_pci_register32(id, this_offset + 16);
+      } break;
+      case VIRTIO_PCI_CAP_ISR_CFG: target = &out_dev->isr; break;
+      case VIRTIO_PCI_CAP_DEVICE_CFG: target = &out_dev->dev.config; break;
+      default: continue;
+    }
+    if (*target) continue;
+
+    if (!bar_ptrs[cap.bar]) {
+      bars[cap.bar] = probe_pci_bar(id, cap.bar);
+      if (!bars[cap.bar].size) continue;
+      // NOTE: Registers with side effects, even if the BAR is prefetchable
+      bar_ptrs[cap.bar] = map_pci_bar(mm, &bars[cap.bar], PAGE_CACHE_UNCACHEABLE);
+    }
+    if ((uint64_t)cap.config_offset + cap.config_len > bars[cap.bar].size) {
+      log("virtio structure outside of BAR %d, type=%d", (size_t)cap.bar, (size_t)cap.config_type);
+      continue;
+    }
+    *target = bar_ptrs[cap.bar] + cap.config_offset;
+  }
+  flush_page_table(mm);
+
+  if (!out_dev->common || !out_dev->notify || !out_dev->isr) {
+    log("virtio device without the required PCI capabilities");
+    return false;
+  }
+  if (!setup_pci_msix(mm, id, &out_dev->msix)) {
+    log("virtio device without MSI-X");
+    return false;
+  }
+  return true;
+}
+
+// Only the first device of each supported type gets a driver
+bool wants_virtio_device(VirtioDevices *virtio, VirtioDeviceType type) {
+  switch (type) {
+    case VIRTIO_DEVICE_BLK: return !virtio->blk.dev;
+    case VIRTIO_DEVICE_NET: return !virtio->net.dev;
+    case VIRTIO_DEVICE_GPU: return !virtio->gpu.dev;
+    case VIRTIO_DEVICE_INPUT: return !virtio->input.dev;
+    default: {
+      log("Unknown virtio device type %d", (size_t)type);
+      return false;
+    } break;
+  }
+}
+
+void probe_virtio_pci_device(MemoryManager *mm, uint32_t id, VirtioDeviceType type) {
+  VirtioDevices *virtio = &VIRTIO;
+  // NOTE: Checked before the setup, which takes a slot and enables MSI-X
+  if (!wants_virtio_device(virtio, type)) return;
+  if (virtio->pci_len >= MAX_VIRTIO_PCI_DEVICES) {
+    log("Not enough slots for virtio device, type=%d", (size_t)type);
+    return;
+  }
+  VirtioPciDevice *pci = &virtio->pci[virtio->pci_len];
+  if (!setup_virtio_pci_device(mm, id, type, pci)) return;
+  virtio->pci_len++;
+
+  switch (type) {
+    case VIRTIO_DEVICE_BLK: {
+      virtio->blk = virtio_blk_init(&pci->dev);
+      pci->handler = virtio_blk_handle_interrupt;
+      pci->handler_arg = &virtio->blk;
+      log("Connected virtio_blkdev");
+    } break;
+    case VIRTIO_DEVICE_NET: {
+      virtio->net = virtio_net_init(&pci->dev);
+      pci->handler = virtio_net_handle_interrupt;
+      pci->handler_arg = &virtio->net;
+      log("Connected virtio_net");
+    } break;
+    case VIRTIO_DEVICE_GPU: {
+      virtio->gpu = virtio_gpu_init(&pci->dev);
+      pci->handler = virtio_gpu_handle_interrupt;
+      pci->handler_arg = &virtio->gpu;
+      log("Connected virtio_gpu");
+    } break;
+    case VIRTIO_DEVICE_INPUT: {
+      virtio->input = virtio_input_init(&pci->dev);
+      pci->handler = virtio_input_handle_interrupt;
+      pci->handler_arg = &virtio->input;
+      log("Connected virtio_input");
+    } break;
+    default: break;
+  }
+}
+
 // NOTE: Site to lookup vendor id and device id
 // SOURCE: https://devicehunt.com/all-pci-vendors
 // TODO: Check in the efi to see if the PCI bus protocol exists
-// TODO: Switch to PCI express and MMIO
+
+void scan_pci_bus(uint8_t bus, MemoryManager *mm);
 
 void check_pci_device(uint8_t bus, uint8_t device, MemoryManager *mm) {
   uint32_t id = pack_pci_id(bus, device, 0);
@@ -64,16 +590,13 @@ void check_pci_device(uint8_t bus, uint8_t device, MemoryManager *mm) {
   if (vendor_id == 0xFFFF) return;
   uint8_t header_type = read_pci_register8(id, PCI_CONFIG_HEADER_TYPE);
 
-  enum {
-    PCI_TYPE_MULTIFUNC = 0x80,
-  };
-
-  uint32_t func_count = header_type & PCI_TYPE_MULTIFUNC ? 8 : 1;
+  uint32_t func_count = header_type & PCI_HEADER_TYPE_MULTIFUNC ? 8 : 1;
   for (uint32_t func = 0; func < func_count; ++func) {
     uint32_t id = pack_pci_id(bus, device, func);
 
+    // NOTE: Functions don't have to be contiguous
     uint16_t vendor_id = read_pci_register16(id, PCI_CONFIG_VENDOR_ID);
-    if (vendor_id == 0xFFFF) return;
+    if (vendor_id == 0xFFFF) continue;
 
     uint16_t device_id = read_pci_register16(id, PCI_CONFIG_DEVICE_ID);
 
@@ -88,79 +611,52 @@ void check_pci_device(uint8_t bus, uint8_t device, MemoryManager *mm) {
 
     uint8_t header_type = read_pci_register8(id, PCI_CONFIG_HEADER_TYPE);
 
-    uint8_t device_type = header_type & (PCI_TYPE_MULTIFUNC - 1);
-    if (device_type != 0) continue;
-
-    if (vendor_id == 0x1AF4 && device_id == 0x1052) {
-      log("virtio input");
-      size_t cap_offset = read_pci_register32(id, 0x34);
-
-      while (cap_offset) {
-        struct PACKED {
-          uint8_t vendor, next_offset, cap_len, config_type;
-          uint8_t bar, padding[3];
-          uint32_t config_offset;
-          uint32_t config_len;
-        } cap;
-
-        uint32_t *config_ints = (void *)&cap;
-        config_ints[0] = read_pci_register32(id, cap_offset + 0);
-        config_ints[1] = read_pci_register32(id, cap_offset + 4);
-        config_ints[2] = read_pci_register32(id, cap_offset + 8);
-        config_ints[3] = read_pci_register32(id, cap_offset + 12);
-        ASSERT(cap.bar <= 5);
-
-        enum {
-          VIRTIO_PCI_CAP_COMMON_CFG = 1,
-        };
-
-        cap_offset = cap.next_offset;
-        if (cap.config_type != VIRTIO_PCI_CAP_COMMON_CFG) continue;
-
-        size_t bar = read_pci_register32(id, PCI_DEV_CONFIG_BAR0 + cap.bar * 4);
-        // config_addr += cap.config_offset;
-
-        ASSERT(!(bar & 1) && "Expected only memory space BAR");
-
-        uint8_t bar_type = (bar >> 1) & 3;
-        ASSERT(bar_type == 2 && "Unsupported BAR type");
-
-        size_t next_bar = read_pci_register32(id, PCI_DEV_CONFIG_BAR0 + (cap.bar + 1) * 4);
-
-        uint64_t config_addr = ((next_bar << 32) | (bar_type & 0xFFFFFFF0)) + cap.config_offset;
-        DEBUGX(config_addr);
-
-        struct {
-          uint32_t device_feature_select;
-          uint32_t device_feature;
-          uint32_t driver_feature_select;
-          uint32_t driver_feature;
-          uint16_t msix_config;
-          uint16_t num_queues;
-          uint8_t device_status;
-          uint8_t config_generation;
-
-          uint16_t queue_select;
-          uint16_t queue_size;
-          uint16_t queue_msix_vector;
-          uint16_t queue_enable;
-          uint16_t queue_notify_off;
-          uint64_t queue_desc;
-          uint64_t queue_driver;
-          uint64_t queue_device;
-        } *config = (void *)alloc_physical(mm, config_addr, cap.config_len,
-            PAGE_BIT_PRESENT | PAGE_BIT_WRITABLE);
-        flush_page_table(mm);
-      }
+    uint8_t device_type = header_type & ~PCI_HEADER_TYPE_MULTIFUNC;
+    if (device_type == PCI_HEADER_TYPE_BRIDGE) {
+      uint8_t secondary_bus = read_pci_register8(id, PCI_BRIDGE_CONFIG_SECONDARY_BUS);
+      // NOTE: Buses behind a bridge are numbered higher, this also stops loops
+      // through misconfigured bridges
+      if (secondary_bus > bus) scan_pci_bus(secondary_bus, mm);
+      continue;
+    }
+    if (device_type != PCI_HEADER_TYPE_DEVICE) continue;
+
+    enum {
+      VIRTIO_PCI_VENDOR = 0x1AF4,
+      // Modern devices are 0x1040 + the virtio device type, the ones before are transitional.
+      // Other devices share the vendor id, like ivshmem at 0x1110
+      VIRTIO_PCI_DEVICE_TRANSITIONAL = 0x1000,
+      VIRTIO_PCI_DEVICE_MODERN = 0x1040,
+      VIRTIO_PCI_DEVICE_LAST = 0x107F,
+    };
+
+    if (vendor_id != VIRTIO_PCI_VENDOR) continue;
+    if (device_id >= VIRTIO_PCI_DEVICE_MODERN && device_id <= VIRTIO_PCI_DEVICE_LAST) {
+      probe_virtio_pci_device(mm, id, device_id - VIRTIO_PCI_DEVICE_MODERN);
+    } else if (device_id >= VIRTIO_PCI_DEVICE_TRANSITIONAL && device_id < VIRTIO_PCI_DEVICE_MODERN) {
+      log("Legacy virtio device, only modern ones are supported (disable-legacy=on)");
     }
   }
 }
 
+void scan_pci_bus(uint8_t bus, MemoryManager *mm) {
+  for (uint8_t dev = 0; dev < 32; ++dev) check_pci_device(bus, dev, mm);
+}
+
+// Only the buses reachable from the host bridges are scanned
+// SOURCE: https://wiki.osdev.org/PCI#Recursive_Scan
 void discover_pci_devices(MemoryManager *mm) {
-  for (uint32_t bus = 0; bus < 256; ++bus) {
-    for (uint32_t dev = 0; dev < 32; ++dev) {
-      check_pci_device(bus, dev, mm);
+  uint64_t start = read_tsc();
+  uint8_t header_type = read_pci_register8(pack_pci_id(0, 0, 0), PCI_CONFIG_HEADER_TYPE);
+  if (!(header_type & PCI_HEADER_TYPE_MULTIFUNC)) {
+    scan_pci_bus(0, mm);
+  } else {
+    // Every function of the device at 0:0 is a host bridge for the bus of the same number
+    for (uint8_t func = 0; func < 8; ++func) {
+      if (read_pci_register16(pack_pci_id(0, 0, func), PCI_CONFIG_VENDOR_ID) == 0xFFFF) continue;
+      scan_pci_bus(func, mm);
     }
   }
+  log("PCI discovery took %d cycles", read_tsc() - start);
 }
 
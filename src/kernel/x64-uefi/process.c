@@ -2,7 +2,7 @@
 #include "arch.h"
 #include "common.h"
 
-void load_user_process(Process *p, MemoryManager *kernel_mm, const char *elf_file) {
+void load_user_process(Process *p, MemoryManager *kernel_mm, ElfImage *image) {
   paddr_t pml4_physical = alloc_pages2(kernel_mm->page_alloc, 1);
   PageTable *pml4 = (void *)(pml4_physical + kernel_mm->virtual_offset);
   memcpy(pml4, (void *)(kernel_mm->pml4 + kernel_mm->virtual_offset), sizeof(*pml4));
@@ -17,8 +17,7 @@ void load_user_process(Process *p, MemoryManager *kernel_mm, const char *elf_fil
   };
   flush_page_table(&p->mm);
 
-  size_t program_entry;
-  load_elf_file2(&p->mm, elf_file, &program_entry);
+  map_elf_image(&p->mm, image);
 
   // TODO: Create a protection for the stack
   uint8_t *stack = alloc(&p->mm, 8 * PAGE_SIZE);
@@ -27,10 +26,41 @@ void load_user_process(Process *p, MemoryManager *kernel_mm, const char *elf_fil
 
   p->frame = (SyscallFrame){
     .r11 = 0x202, // flags
-    .rcx = program_entry,
+    .rcx = image->entry,
   };
 }
 
+Process *spawn(MemoryManager *kernel_mm, Vfs *vfs, Str path, Sink *log_sink) {
+  Fid fid = vfs_fopen(vfs, path);
+  ElfImage *image = get_elf_image(&ELF_IMAGES, kernel_mm, vfs, fid);
+  vfs_fclose(vfs, fid);
+
+  // TODO: Free the process after it exits
+  paddr_t physical = alloc_pages2(kernel_mm->page_alloc, SIZEOF_IN_PAGES(Process));
+  Process *p = (void *)(physical + kernel_mm->virtual_offset);
+  memset(p, 0, sizeof(*p));
+  load_user_process(p, kernel_mm, image);
+  p->log_sink = log_sink;
+  memcpy(p->name, path.ptr, MIN(path.len, sizeof(p->name) - 1));
+
+  size_t irq = irq_save();
+  p->next = PROCESSES.first;
+  PROCESSES.first = p;
+  irq_restore(irq);
+
+  // NOTE: Loading switched to the process page table
+  flush_page_table(kernel_mm);
+  start_thread(&SCHED, create_user_thread(&SCHED, kernel_mm, p));
+  return p;
+}
+
+void account_process_time(Process *p, bool was_user) {
+  uint64_t now = read_tsc();
+  if (was_user) p->stats.user_cycles += now - p->stats.last_tsc;
+  else p->stats.kernel_cycles += now - p->stats.last_tsc;
+  p->stats.last_tsc = now;
+}
+
 #define CTX ((KernelThreadContext *)0)
 
 // NOTE:
@@ -42,6 +72,8 @@ __attribute__((naked))
 size_t _run_user_process(void) {
   ASM("push rbx\n push rbp\n push r12\n push r13\n push r14\n push r15\n");
   ASM("mov gs:%0, rsp" :: "i"(&CTX->kernel_sp));
+  // Interrupts from user mode don't use the IST, they need a stack from the TSS
+  ASM("mov [%c0], rsp" :: "i"(&TSS.rsp0));
   ASM("mov rsp, gs:%0" :: "i"(&CTX->user_process));
   ASM("pop rax\n pop rdi\n pop rsi\n pop rdx\n pop rcx\n"
       "pop r8\n pop r9\n pop r10\n pop r11");
@@ -51,6 +83,7 @@ size_t _run_user_process(void) {
 }
 
 void run_user_process(KernelThreadContext *ctx, Process *p) {
+  p->stats.last_tsc = read_tsc();
   flush_page_table(&p->mm);
   ctx->user_sp = p->sp;
   ctx->user_process = p;
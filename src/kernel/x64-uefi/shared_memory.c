@@ -0,0 +1,113 @@
+#include "cmn/lib.h"
+#include "common.h"
+#include "arch.h"
+
+// NOTE: Handles are global, any process can map any of them
+#define MAX_SHARED_MEMORY_SIZE (64 * 1024 * 1024)
+
+SharedMemory *get_shared_memory(SharedMemoryTable *table, uint32_t handle) {
+  if (handle >= MAX_SHARED_MEMORY) return NULL;
+  SharedMemory *shm = &table->objects[handle];
+  return shm->ref_count ? shm : NULL;
+}
+
+void put_shared_memory(SharedMemory *shm, PageAllocator2 *alloc) {
+  ASSERT(shm->ref_count);
+  if (--shm->ref_count) return;
+  push_free_pages(alloc, shm->physical, shm->size / PAGE_SIZE);
+  *shm = (SharedMemory){0};
+}
+
+SyscallError create_shared_memory(SharedMemoryTable *table, MemoryManager *mm, size_t size, uint32_t *out_handle) {
+  if (!size || size > MAX_SHARED_MEMORY_SIZE) return SYS_ERR_BAD_ARG;
+  size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+  paddr_t physical = try_alloc_pages2(mm->page_alloc, size / PAGE_SIZE);
+  if (!physical) return SYS_ERR_OUT_OF_MEMORY;
+  // NOTE: Other processes can map it as soon as the handle is in the table, don't leak old data
+  memset((void *)(physical + mm->virtual_offset), 0, size);
+
+  size_t irq = irq_save();
+  uint32_t handle = 0;
+  for (; handle < MAX_SHARED_MEMORY && table->objects[handle].ref_count; ++handle);
+  if (handle == MAX_SHARED_MEMORY) {
+    irq_restore(irq);
+    push_free_pages(mm->page_alloc, physical, size / PAGE_SIZE);
+    return SYS_ERR_OUT_OF_MEMORY;
+  }
+
+  table->objects[handle] = (SharedMemory){
+    .physical = physical,
+    .size = size,
+    .ref_count = 1,
+    .owner = mm,
+  };
+  irq_restore(irq);
+
+  *out_handle = handle;
+  return SYS_OK;
+}
+
+SyscallError map_shared_memory(SharedMemoryTable *table, MemoryManager *mm, uint32_t handle, vaddr_t *virtual, bool is_writable) {
+  size_t irq = irq_save();
+  SharedMemory *shm = get_shared_memory(table, handle);
+  if (!shm || *virtual % PAGE_SIZE || *virtual >= HIGHER_HALF) {
+    irq_restore(irq);
+    return SYS_ERR_BAD_ARG;
+  }
+
+  // NOTE: Mapping takes an object slot, unmapping gives it back
+  if (!free_virtual_objects(mm) || (!*virtual && !find_free_virtual(mm, shm->size))) {
+    irq_restore(irq);
+    return SYS_ERR_OUT_OF_MEMORY;
+  }
+
+  size_t flags = PAGE_BIT_PRESENT | PAGE_BIT_USER | PAGE_BIT_SHARED;
+  if (is_writable) flags |= PAGE_BIT_WRITABLE;
+
+  if (!*virtual) {
+    *virtual = alloc_physical(mm, shm->physical, shm->size, flags);
+  } else if (is_virtual_range_free(mm, *virtual, shm->size) && *virtual + shm->size <= HIGHER_HALF) {
+    map_virtual_range(mm, *virtual, shm->physical, shm->size, flags);
+  } else {
+    irq_restore(irq);
+    return SYS_ERR_BAD_ARG;
+  }
+  shm->ref_count++;
+  irq_restore(irq);
+  return SYS_OK;
+}
+
+SyscallError unmap_shared_memory(SharedMemoryTable *table, MemoryManager *mm, uint32_t handle, vaddr_t virtual) {
+  size_t irq = irq_save();
+  SharedMemory *shm = get_shared_memory(table, handle);
+  size_t *entry = shm ? get_page_entry(mm, virtual) : NULL;
+  bool is_mapped = entry && (*entry & PAGE_BIT_SHARED) && (*entry & PAGE_ADDR_MASK) == shm->physical;
+
+  VirtualObject obj;
+  if (!is_mapped || !remove_virtual_object(mm, virtual, &obj)) {
+    irq_restore(irq);
+    return SYS_ERR_BAD_ARG;
+  }
+  for (size_t offset = 0; offset < obj.size; offset += PAGE_SIZE) {
+    unmap_page(mm, virtual + offset);
+  }
+  put_shared_memory(shm, mm->page_alloc);
+  irq_restore(irq);
+  return SYS_OK;
+}
+
+// Drops the creator's reference, only the creator can do it and only once.
+// The memory lives on until the last unmap
+SyscallError release_shared_memory(SharedMemoryTable *table, MemoryManager *mm, uint32_t handle) {
+  size_t irq = irq_save();
+  SharedMemory *shm = get_shared_memory(table, handle);
+  if (!shm || shm->owner != mm || shm->is_released) {
+    irq_restore(irq);
+    return SYS_ERR_BAD_ARG;
+  }
+  shm->is_released = true;
+  put_shared_memory(shm, mm->page_alloc);
+  irq_restore(irq);
+  return SYS_OK;
+}
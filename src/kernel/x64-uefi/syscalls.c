@@ -3,6 +3,8 @@
 #include "arch.h"
 
 #define MSR_GS_BAS 0xC0000101ull
+// Limit of a single SYS_ALLOC_PAGES call
+#define MAX_ALLOC_PAGES (64 * 1024 * 1024 / PAGE_SIZE)
 
 KernelThreadContext *get_thread_context(void) {
   size_t high, thread_context_addr;
@@ -11,9 +13,7 @@ KernelThreadContext *get_thread_context(void) {
   return (void *)thread_context_addr;
 }
 
-size_t handle_syscall(SyscallFrame *frame) {
-  KernelThreadContext *ctx = get_thread_context();
-
+size_t dispatch_syscall(KernelThreadContext *ctx, SyscallFrame *frame) {
   switch (frame->rax) {
     case SYS_LOG: {
       const char *str = (void *)frame->rdi;
@@ -30,8 +30,80 @@ size_t handle_syscall(SyscallFrame *frame) {
       return 1;
     } break;
     case SYS_YIELD: {
-      ctx->user_exit_code = frame->rdi;
-      return 1;
+      schedule(&SCHED);
+    } break;
+    case SYS_FUTEX_WAIT: {
+      frame->rax = futex_wait(&FUTEXES, &ctx->user_process->mm, frame->rdi, frame->rsi);
+      return 0;
+    } break;
+    case SYS_FUTEX_WAKE: {
+      uint32_t woken = 0;
+      frame->rax = futex_wake(&FUTEXES, &ctx->user_process->mm, frame->rdi, frame->rsi, &woken);
+      frame->rdi = woken;
+      return 0;
+    } break;
+    case SYS_ALLOC_PAGES: {
+      MemoryManager *mm = &ctx->user_process->mm;
+      size_t page_count = frame->rdi;
+      if (!page_count || page_count > MAX_ALLOC_PAGES) {
+        frame->rax = SYS_ERR_BAD_ARG;
+        return 0;
+      }
+      bool has_room = free_virtual_objects(mm) && find_free_virtual(mm, page_count * PAGE_SIZE);
+      paddr_t physical = has_room ? try_alloc_pages2(mm->page_alloc, page_count) : 0;
+      if (!physical) {
+        frame->rax = SYS_ERR_OUT_OF_MEMORY;
+        return 0;
+      }
+      frame->rdi = alloc_physical(mm, physical, page_count * PAGE_SIZE,
+          PAGE_BIT_PRESENT | PAGE_BIT_WRITABLE | PAGE_BIT_USER);
+    } break;
+    // NOTE: Messages are passed in rsi, rdx, r8 (words), r9 (pages) and r10 (page count)
+    // both ways, rdi is the endpoint
+    case SYS_IPC_SEND:
+    case SYS_IPC_RECEIVE:
+    case SYS_IPC_REPLY: {
+      IpcMessage msg = {
+        .words = { frame->rsi, frame->rdx, frame->r8 },
+        .pages = frame->r9,
+        .page_count = frame->r10,
+      };
+      Process *p = ctx->user_process;
+      SyscallType type = frame->rax;
+      SyscallError err;
+      if (type == SYS_IPC_SEND) err = ipc_send(frame->rdi, p, &msg);
+      else if (type == SYS_IPC_RECEIVE) err = ipc_receive(frame->rdi, p, &msg);
+      else err = ipc_reply(p, &msg);
+
+      frame->rax = err;
+      if (err == SYS_OK && type != SYS_IPC_REPLY) {
+        frame->rsi = msg.words[0];
+        frame->rdx = msg.words[1];
+        frame->r8 = msg.words[2];
+        frame->r9 = msg.pages;
+        frame->r10 = msg.page_count;
+      }
+      return 0;
+    } break;
+    case SYS_SHM_CREATE: {
+      uint32_t handle = 0;
+      frame->rax = create_shared_memory(&SHARED_MEMORY, &ctx->user_process->mm, frame->rdi, &handle);
+      frame->rdi = handle;
+      return 0;
+    } break;
+    case SYS_SHM_MAP: {
+      vaddr_t virtual = frame->rsi;
+      frame->rax = map_shared_memory(&SHARED_MEMORY, &ctx->user_process->mm, frame->rdi, &virtual, frame->rdx);
+      frame->rsi = virtual;
+      return 0;
+    } break;
+    case SYS_SHM_UNMAP: {
+      frame->rax = unmap_shared_memory(&SHARED_MEMORY, &ctx->user_process->mm, frame->rdi, frame->rsi);
+      return 0;
+    } break;
+    case SYS_SHM_RELEASE: {
+      frame->rax = release_shared_memory(&SHARED_MEMORY, &ctx->user_process->mm, frame->rdi);
+      return 0;
     } break;
     default: {
       frame->rax = SYS_ERR_UNKNOWN_SYSCALL;
@@ -43,6 +115,42 @@ size_t handle_syscall(SyscallFrame *frame) {
   return 0;
 }
 
+#ifdef SYSCALL_TRACE
+void push_syscall_trace(SyscallTraceRing *ring, SyscallTraceEntry *entry) {
+  uint64_t head = ring->head;
+  ring->entries[head & (SYSCALL_TRACE_SIZE - 1)] = *entry;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+#endif
+
+size_t handle_syscall(SyscallFrame *frame) {
+  KernelThreadContext *ctx = get_thread_context();
+  Process *p = ctx->user_process;
+  account_process_time(p, true);
+  p->stats.syscalls++;
+
+#ifdef SYSCALL_TRACE
+  SyscallTraceEntry entry = {
+    .enter_tsc = read_tsc(),
+    .process = p,
+    .type = frame->rax,
+    .args = { frame->rdi, frame->rsi, frame->rdx },
+  };
+#endif
+
+  size_t should_exit = dispatch_syscall(ctx, frame);
+
+#ifdef SYSCALL_TRACE
+  entry.exit_tsc = read_tsc();
+  entry.result = frame->rax;
+  // NOTE: The thread could have blocked and continued on another CPU
+  push_syscall_trace(get_thread_context()->trace, &entry);
+#endif
+
+  account_process_time(p, false);
+  return should_exit;
+}
+
 #define CTX ((KernelThreadContext *)0)
 
 __attribute__((naked))
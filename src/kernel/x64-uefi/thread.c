@@ -0,0 +1,186 @@
+#include "cmn/lib.h"
+#include "common.h"
+#include "arch.h"
+
+// NOTE: Scheduler state is touched from the timer interrupt,
+// every modification happens with interrupts disabled
+
+void scheduler_init(Scheduler *s, KernelThreadContext *ctx, MemoryManager *kernel_mm) {
+  // NOTE: Too big for a compound literal on the boot stack
+  memset(s, 0, sizeof(*s));
+  s->ctx = ctx;
+  s->kernel_mm = kernel_mm;
+  s->boot.state = THREAD_RUNNING;
+  s->boot.name = "boot";
+  s->current = &s->boot;
+
+  for (int i = MAX_THREADS - 1; i >= 0; --i) {
+    s->threads[i].next = s->free_threads;
+    s->free_threads = &s->threads[i];
+  }
+  s->stacks = alloc_virtual(kernel_mm, MAX_THREADS * THREAD_STACK_SLOT_SIZE);
+}
+
+void push_ready_thread(Scheduler *s, Thread *t) {
+  t->state = THREAD_READY;
+  t->next = NULL;
+  if (s->last_ready) s->last_ready->next = t;
+  else s->first_ready = t;
+  s->last_ready = t;
+}
+
+Thread *pop_ready_thread(Scheduler *s) {
+  Thread *t = s->first_ready;
+  if (!t) return NULL;
+  s->first_ready = t->next;
+  if (!s->first_ready) s->last_ready = NULL;
+  t->next = NULL;
+  return t;
+}
+
+Thread *create_thread(Scheduler *s, MemoryManager *mm, const char *name, ThreadFn entry, void *arg) {
+  size_t stack_size = THREAD_STACK_PAGES * PAGE_SIZE;
+
+  size_t irq = irq_save();
+  Thread *t = s->free_threads;
+  ASSERT(t && "Out of threads");
+  s->free_threads = t->next;
+
+  // NOTE: The lowest page of the slot is never mapped, an overflow faults
+  // instead of running into the stack below
+  size_t slot = t - s->threads;
+  uint8_t *stack = (void *)(s->stacks + slot * THREAD_STACK_SLOT_SIZE + PAGE_SIZE);
+  paddr_t physical = alloc_pages2(mm->page_alloc, THREAD_STACK_PAGES);
+  map_pages2(mm, physical, (vaddr_t)stack, stack_size, PAGE_BIT_WRITABLE);
+  irq_restore(irq);
+
+  *t = (Thread){
+    .stack = stack,
+    .state = THREAD_BLOCKED,
+    .name = name,
+  };
+
+  // switch_to pops r15, r14, r13, r12, rbp and rbx, then returns into thread_start
+  size_t *sp = (size_t *)(stack + stack_size) - 7;
+  sp[0] = 0;
+  sp[1] = 0;
+  sp[2] = (size_t)entry;
+  sp[3] = (size_t)arg;
+  sp[4] = 0;
+  sp[5] = 0;
+  sp[6] = (size_t)thread_start;
+  t->sp = (size_t)sp;
+  return t;
+}
+
+void start_thread(Scheduler *s, Thread *t) {
+  size_t irq = irq_save();
+  push_ready_thread(s, t);
+  irq_restore(irq);
+}
+
+void run_user_thread(void *arg) {
+  Process *p = arg;
+  run_user_process(SCHED.ctx, p);
+  log("Process exited, code=%d", SCHED.ctx->user_exit_code);
+}
+
+Thread *create_user_thread(Scheduler *s, MemoryManager *mm, Process *p) {
+  Thread *t = create_thread(s, mm, "user", run_user_thread, p);
+  t->process = p;
+  return t;
+}
+
+void schedule(Scheduler *s) {
+  size_t irq = irq_save();
+  Thread *prev = s->current;
+  Thread *next = pop_ready_thread(s);
+
+  if (!next) {
+    // Nothing else to run, keep going with the current thread
+    ASSERT(prev->state == THREAD_RUNNING);
+    prev->ticks = 0;
+    irq_restore(irq);
+    return;
+  }
+  if (prev->state == THREAD_RUNNING) push_ready_thread(s, prev);
+
+  // Per-cpu context belongs to whichever thread is running
+  KernelThreadContext *ctx = s->ctx;
+  prev->kernel_sp = ctx->kernel_sp;
+  prev->user_sp = ctx->user_sp;
+  prev->user_process = ctx->user_process;
+  ctx->kernel_sp = next->kernel_sp;
+  ctx->user_sp = next->user_sp;
+  ctx->user_process = next->user_process;
+  // NOTE: Interrupts from user mode land right below the frames of run_user_process
+  TSS.rsp0 = next->kernel_sp;
+
+  flush_page_table(next->process ? &next->process->mm : s->kernel_mm);
+
+  if (prev->process) {
+    account_process_time(prev->process, false);
+    prev->process->stats.context_switches++;
+  }
+
+  next->state = THREAD_RUNNING;
+  next->ticks = 0;
+  s->current = next;
+  switch_to(&prev->sp, next->sp);
+  // NOTE: Time spent switched out isn't charged to anyone
+  if (prev->process) prev->process->stats.last_tsc = read_tsc();
+  irq_restore(irq);
+}
+
+void preempt(Scheduler *s) {
+  if (!s->current || s->preempt_count) return;
+  if (++s->current->ticks < THREAD_TIME_SLICE) return;
+  schedule(s);
+}
+
+// The caller has to register the thread for a wakeup beforehand,
+// with interrupts disabled up until this call
+void block_thread(Scheduler *s) {
+  size_t irq = irq_save();
+  s->current->state = THREAD_BLOCKED;
+  schedule(s);
+  irq_restore(irq);
+}
+
+void wake_thread(Scheduler *s, Thread *t) {
+  size_t irq = irq_save();
+  if (t->state == THREAD_BLOCKED) push_ready_thread(s, t);
+  irq_restore(irq);
+}
+
+NORETURN void exit_thread(void) {
+  irq_save();
+  // NOTE: Still running on the stack, the boot thread frees it after the switch
+  Thread *t = SCHED.current;
+  t->state = THREAD_DEAD;
+  t->next = SCHED.dead_threads;
+  SCHED.dead_threads = t;
+  schedule(&SCHED);
+  UNREACHABLE();
+}
+
+void reap_dead_threads(Scheduler *s) {
+  // NOTE: unmap_page only flushes the TLB in the active address space
+  ASSERT(s->current == &s->boot);
+  size_t irq = irq_save();
+  while (s->dead_threads) {
+    Thread *t = s->dead_threads;
+    s->dead_threads = t->next;
+
+    // Stack frames come from a single allocation
+    paddr_t physical = unmap_page(s->kernel_mm, (vaddr_t)t->stack);
+    for (size_t i = 1; i < THREAD_STACK_PAGES; ++i) {
+      unmap_page(s->kernel_mm, (vaddr_t)t->stack + i * PAGE_SIZE);
+    }
+    push_free_pages(s->kernel_mm->page_alloc, physical, THREAD_STACK_PAGES);
+
+    t->next = s->free_threads;
+    s->free_threads = t;
+  }
+  irq_restore(irq);
+}
@@ -97,6 +97,40 @@ enable_system_calls:
          # kernel gs base
   ret
 
+# NOTE: Only callee-saved registers need to be kept,
+# the caller of switch_to already saved the rest
+.global switch_to
+# input:
+#   rdi: where to save the stack pointer of the current thread
+#   rsi: stack pointer of the thread to resume
+switch_to:
+  push rbx
+  push rbp
+  push r12
+  push r13
+  push r14
+  push r15
+  mov [rdi], rsp
+  mov rsp, rsi
+  pop r15
+  pop r14
+  pop r13
+  pop r12
+  pop rbp
+  pop rbx
+  ret
+
+.extern exit_thread
+
+# First switch_to into a new thread returns here,
+# create_thread puts the entry point in r13 and its argument in r12
+.global thread_start
+thread_start:
+  mov rdi, r12
+  sti
+  call r13
+  call exit_thread
+
 # Cpu pushes those on the stack during an interrupt
 # ss, rsp, rflags, cs, rip
 
@@ -26,6 +26,84 @@ SyscallError sys_yield(void) {
   return syscall0(SYS_YIELD);
 }
 
+// Blocks while *addr == expected, until a wake on the same address
+SyscallError sys_futex_wait(uint32_t *addr, uint32_t expected) {
+  return syscall2(SYS_FUTEX_WAIT, (size_t)addr, expected);
+}
+
+// Wakes up at most count waiters, out_woken gets how many were woken up
+SyscallError sys_futex_wake(uint32_t *addr, uint32_t count, uint32_t *out_woken) {
+  size_t result = SYS_FUTEX_WAKE;
+  size_t woken = (size_t)addr;
+  ASM("syscall" : "+a"(result), "+D"(woken) : "S"((size_t)count) : "r11", "rcx", "memory");
+  if (out_woken) *out_woken = result == SYS_OK ? woken : 0;
+  return result;
+}
+
+void *sys_alloc_pages(size_t page_count) {
+  size_t result = SYS_ALLOC_PAGES;
+  size_t addr = page_count;
+  ASM("syscall" : "+a"(result), "+D"(addr) :: "r11", "rcx", "memory");
+  return result == SYS_OK ? (void *)addr : NULL;
+}
+
+SyscallError syscall_ipc(SyscallType type, uint32_t endpoint, IpcMessage *msg) {
+  size_t result = type;
+  size_t rsi = msg->words[0];
+  size_t rdx = msg->words[1];
+  register size_t r8 __asm__("r8") = msg->words[2];
+  register size_t r9 __asm__("r9") = msg->pages;
+  register size_t r10 __asm__("r10") = msg->page_count;
+  ASM("syscall" : "+a"(result), "+S"(rsi), "+d"(rdx), "+r"(r8), "+r"(r9), "+r"(r10)
+      : "D"(endpoint) : "r11", "rcx", "memory");
+  if (result == SYS_OK && type != SYS_IPC_REPLY) {
+    *msg = (IpcMessage){
+      .words = { rsi, rdx, r8 },
+      .pages = r9,
+      .page_count = r10,
+    };
+  }
+  return result;
+}
+
+// Blocks until the receiver replies, the reply overwrites msg
+SyscallError sys_ipc_send(uint32_t endpoint, IpcMessage *msg) {
+  return syscall_ipc(SYS_IPC_SEND, endpoint, msg);
+}
+
+SyscallError sys_ipc_receive(uint32_t endpoint, IpcMessage *out_msg) {
+  return syscall_ipc(SYS_IPC_RECEIVE, endpoint, out_msg);
+}
+
+SyscallError sys_ipc_reply(IpcMessage *msg) {
+  return syscall_ipc(SYS_IPC_REPLY, 0, msg);
+}
+
+SyscallError sys_shm_create(size_t size, uint32_t *out_handle) {
+  size_t result = SYS_SHM_CREATE;
+  size_t handle = size;
+  ASM("syscall" : "+a"(result), "+D"(handle) :: "r11", "rcx", "memory");
+  *out_handle = handle;
+  return result;
+}
+
+// Maps at addr, or anywhere if it's NULL, returns NULL on errors
+void *sys_shm_map(uint32_t handle, void *addr, bool is_writable) {
+  size_t result = SYS_SHM_MAP;
+  size_t virtual = (size_t)addr;
+  ASM("syscall" : "+a"(result), "+S"(virtual) : "D"(handle), "d"(is_writable) : "r11", "rcx", "memory");
+  return result == SYS_OK ? (void *)virtual : NULL;
+}
+
+SyscallError sys_shm_unmap(uint32_t handle, void *addr) {
+  return syscall2(SYS_SHM_UNMAP, handle, (size_t)addr);
+}
+
+// The memory is freed after the last process unmaps it
+SyscallError sys_shm_release(uint32_t handle) {
+  return syscall1(SYS_SHM_RELEASE, handle);
+}
+
 NORETURN void sys_exit(size_t error_code) {
   syscall1(SYS_EXIT, error_code);
   UNREACHABLE();
@@ -0,0 +1,29 @@
+#include "cmn/lib.h"
+#include "lib.h"
+
+// Futex test, waits on a word shared with main4.c until it gets woken up
+
+// NOTE: Same as in main4.c
+#define FUTEX_TEST_ENDPOINT 0
+
+int main(void) {
+  uint32_t handle;
+  if (sys_shm_create(sizeof(uint32_t), &handle) != SYS_OK) return 1;
+  volatile uint32_t *word = sys_shm_map(handle, NULL, true);
+  if (!word) return 1;
+
+  // Returns after main4 mapped the memory
+  IpcMessage msg = { .words = { handle } };
+  if (sys_ipc_send(FUTEX_TEST_ENDPOINT, &msg) != SYS_OK) return 1;
+  sys_shm_release(handle);
+
+  size_t waits = 0;
+  while (*word == 0) {
+    SyscallError err = sys_futex_wait((uint32_t *)word, 0);
+    if (err != SYS_OK && err != SYS_ERR_WOULD_BLOCK) return 1;
+    waits++;
+  }
+  log("Futex test: woken up after %d waits, word=%d", waits, (size_t)*word);
+  sys_shm_unmap(handle, (void *)word);
+  return 0;
+}
@@ -0,0 +1,27 @@
+#include "cmn/lib.h"
+#include "lib.h"
+
+// Futex test, wakes up main3.c after changing the shared word
+
+// NOTE: Same as in main3.c
+#define FUTEX_TEST_ENDPOINT 0
+
+int main(void) {
+  IpcMessage msg = {0};
+  if (sys_ipc_receive(FUTEX_TEST_ENDPOINT, &msg) != SYS_OK) return 1;
+  uint32_t handle = msg.words[0];
+  volatile uint32_t *word = sys_shm_map(handle, NULL, true);
+  // NOTE: Reply even on errors, the sender stays blocked until then
+  sys_ipc_reply(&msg);
+  if (!word) return 1;
+
+  // Gives main3 the chance to block on the word
+  for (int i = 0; i < 5; ++i) sys_yield();
+
+  *word = 1;
+  uint32_t woken = 0;
+  if (sys_futex_wake((uint32_t *)word, 1, &woken) != SYS_OK) return 1;
+  log("Futex test: woke up %d waiters", (size_t)woken);
+  sys_shm_unmap(handle, (void *)word);
+  return 0;
+}